@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2020 Open Mobile Platform LLC.
+ *
+ * This program is licensed under the terms and conditions of the
+ * Apache License, version 2.0.  The full text of the Apache License is at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include <QDataStream>
+#include <QDir>
+#include <QFileInfo>
+#include <QSaveFile>
+
+#include "actionjournal.h"
+#include "logging_p.h"
+
+namespace {
+
+enum Operation {
+    AddOperation = 1,
+    RemoveOperation
+};
+
+// Finished records tolerated before the journal is rewritten
+const int CompactThreshold = 64;
+
+void writeAdd(QDataStream &stream, quint64 actionId, const ActionJournal::Entry &entry)
+{
+    stream << quint8(AddOperation) << actionId << entry.kind
+           << quint64(entry.accountId.toULongLong()) << quint64(entry.messageId.toULongLong());
+}
+
+}
+
+ActionJournal::ActionJournal(const QString &path)
+    : m_path(path)
+    , m_file(path)
+    , m_finished(0)
+{
+    load();
+}
+
+QList<ActionJournal::Entry> ActionJournal::takePending()
+{
+    QList<Entry> previous;
+    previous.swap(m_previous);
+    return previous;
+}
+
+void ActionJournal::load()
+{
+    QMap<quint64, Entry> pending;
+
+    QFile file(m_path);
+    if (file.open(QIODevice::ReadOnly)) {
+        QDataStream stream(&file);
+        stream.setVersion(QDataStream::Qt_5_6);
+        while (!stream.atEnd()) {
+            quint8 operation;
+            quint64 actionId;
+            stream >> operation >> actionId;
+            if (operation == AddOperation) {
+                Entry entry;
+                quint64 accountId;
+                quint64 messageId;
+                stream >> entry.kind >> accountId >> messageId;
+                entry.accountId = QMailAccountId(accountId);
+                entry.messageId = QMailMessageId(messageId);
+                if (stream.status() == QDataStream::Ok) {
+                    pending.insert(actionId, entry);
+                }
+            } else if (operation == RemoveOperation) {
+                pending.remove(actionId);
+            }
+
+            // A record cut short by a crash ends the journal
+            if (stream.status() != QDataStream::Ok || (operation != AddOperation && operation != RemoveOperation)) {
+                qCWarning(lcEmail) << "Action journal truncated at offset" << file.pos();
+                break;
+            }
+        }
+        file.close();
+    }
+
+    clear();
+    m_previous = pending.values();
+}
+
+void ActionJournal::add(quint64 actionId, const Entry &entry)
+{
+    if (!openForAppend()) {
+        return;
+    }
+
+    m_pending.insert(actionId, entry);
+    QDataStream stream(&m_file);
+    stream.setVersion(QDataStream::Qt_5_6);
+    writeAdd(stream, actionId, entry);
+    m_file.flush();
+}
+
+void ActionJournal::remove(quint64 actionId)
+{
+    if (!m_pending.remove(actionId) || !openForAppend()) {
+        return;
+    }
+
+    QDataStream stream(&m_file);
+    stream.setVersion(QDataStream::Qt_5_6);
+    stream << quint8(RemoveOperation) << actionId;
+    m_file.flush();
+
+    if (++m_finished > CompactThreshold && m_finished > m_pending.size()) {
+        compact();
+    }
+}
+
+void ActionJournal::clear()
+{
+    m_file.close();
+    m_pending.clear();
+    m_finished = 0;
+    QFile::remove(m_path);
+}
+
+bool ActionJournal::openForAppend()
+{
+    if (m_file.isOpen()) {
+        return true;
+    }
+
+    QDir().mkpath(QFileInfo(m_path).absolutePath());
+    if (!m_file.open(QIODevice::WriteOnly | QIODevice::Append)) {
+        qCWarning(lcEmail) << "Cannot open action journal" << m_path << m_file.errorString();
+        return false;
+    }
+    return true;
+}
+
+void ActionJournal::compact()
+{
+    m_file.close();
+
+    QSaveFile file(m_path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qCWarning(lcEmail) << "Cannot compact action journal" << m_path << file.errorString();
+        return;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_6);
+    for (auto it = m_pending.constBegin(); it != m_pending.constEnd(); ++it) {
+        writeAdd(stream, it.key(), it.value());
+    }
+
+    if (file.commit()) {
+        m_finished = 0;
+    } else {
+        qCWarning(lcEmail) << "Cannot compact action journal" << m_path << file.errorString();
+    }
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2020 Open Mobile Platform LLC.
+ *
+ * This program is licensed under the terms and conditions of the
+ * Apache License, version 2.0.  The full text of the Apache License is at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ACTIONJOURNAL_H
+#define ACTIONJOURNAL_H
+
+#include <QFile>
+#include <QList>
+#include <QMap>
+#include <QString>
+
+#include <qmailaccount.h>
+#include <qmailmessage.h>
+
+// Append-only record of the queued actions that must survive a restart of
+// the process, e.g. exports of local changes and sends. Every queued and
+// finished action appends a record, the file is rewritten with only the
+// pending actions once the finished ones dominate.
+class ActionJournal
+{
+public:
+    struct Entry {
+        QString kind;
+        QMailAccountId accountId;
+        QMailMessageId messageId;
+    };
+
+    // Reads the pending actions of the previous run and empties the journal,
+    // before this run adds anything under action ids that start over
+    explicit ActionJournal(const QString &path);
+
+    // Pending actions of the previous run, oldest first. Replayed actions
+    // are expected to be added again.
+    QList<Entry> takePending();
+
+    void add(quint64 actionId, const Entry &entry);
+    void remove(quint64 actionId);
+    void clear();
+
+private:
+    void load();
+    bool openForAppend();
+    void compact();
+
+    QString m_path;
+    QFile m_file;
+    QList<Entry> m_previous;
+    QMap<quint64, Entry> m_pending;
+    int m_finished;
+};
+
+#endif
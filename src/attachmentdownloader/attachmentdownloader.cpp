@@ -16,6 +16,10 @@
  *
  */
 
+#include <QDateTime>
+#include <QDir>
+
+#include <qmailnamespace.h>
 #include <qmailstore.h>
 
 #include "attachmentdownloader.h"
@@ -25,26 +29,85 @@
 
 Q_LOGGING_CATEGORY(lcAD, "org.qt.messageserver.attachmentdownloader", QtWarningMsg)
 
-AttachmentDownloader::AttachmentDownloader(const QMailAccountId &account, QObject *parent)
+namespace {
+
+// Parts of one account downloading at the same time
+const int MaxAccountDownloads = 2;
+
+// Drops the downloaded content of a part, the message keeps its structure
+// and its other content
+void evictContent(const QMailMessagePart::Location &location)
+{
+    QMailMessage message(location.containingMessageId());
+    if (!message.id().isValid() || !message.contains(location))
+        return;
+
+    QMailMessagePart &part = message.partAt(location);
+    part.setBody(QMailMessageBody::fromData(QByteArray(), part.contentType(), part.transferEncoding()));
+    if (QMailStore::instance()->updateMessage(&message)) {
+        qCDebug(lcAD) << "Evicted attachment content of" << location.toString(true);
+    } else {
+        qCWarning(lcAD) << "Failed to evict attachment content of" << location.toString(true);
+    }
+}
+
+// Size of the content as downloaded, the expected size if it cannot be told
+qint64 downloadedSize(const QMailMessagePart::Location &location, qint64 expected)
+{
+    const QMailMessage message(location.containingMessageId());
+    if (message.id().isValid() && message.contains(location)) {
+        const QMailMessagePart &part = message.partAt(location);
+        if (part.hasBody())
+            return part.body().length();
+    }
+    return expected;
+}
+
+}
+
+AttachmentDownloader::AttachmentDownloader(QObject *parent)
     : QObject(parent)
-    , m_account(account)
-    , m_store(account)
+    , m_queue(QDir(QMail::dataPath()).filePath(QStringLiteral("attachmentdownloader/queue")))
 {
     if (offlineForced()) {
         qCWarning(lcAD) << "Nemo-email forced to offline mode, attachment downloader disabled";
     }
 
-    connect(&m_store, &QMailStoreAccountFilter::messagesAdded,
+    auto *store = QMailStore::instance();
+    connect(store, &QMailStore::messagesAdded,
             this, &AttachmentDownloader::messagesUpdated);
 
-    connect(&m_store, &QMailStoreAccountFilter::messagesUpdated,
+    connect(store, &QMailStore::messagesUpdated,
             this, &AttachmentDownloader::messagesUpdated);
 
+    connect(store, &QMailStore::accountsRemoved,
+            this, &AttachmentDownloader::accountsRemoved);
+
     connect(&m_networkConfiguration, &QNetworkConfigurationManager::onlineStateChanged,
             this, &AttachmentDownloader::onlineStateChanged);
 
-    connect(&m_action, &QMailRetrievalAction::activityChanged,
-            this, &AttachmentDownloader::activityChanged);
+    connect(&m_networkConfiguration, &QNetworkConfigurationManager::configurationChanged,
+            this, &AttachmentDownloader::networkConfigurationChanged);
+
+    m_budgetTimer.setSingleShot(true);
+    connect(&m_budgetTimer, &QTimer::timeout, this, &AttachmentDownloader::dispatch);
+
+    // Downloads of the previous run, unless the account or the message is
+    // gone meanwhile or the policy changed
+    const QMailAccountIdList accounts = store->queryAccounts();
+    QMailMessage message;
+    m_queue.restore([this, &accounts, &message](const DownloadQueue::Job &job) {
+        if (!accounts.contains(job.accountId))
+            return false;
+        // Parts of a message are queued together
+        if (message.id() != job.location.containingMessageId())
+            message = QMailMessage(job.location.containingMessageId());
+        if (!message.id().isValid() || !message.contains(job.location))
+            return false;
+        const QMailMessagePart &part = message.partAt(job.location);
+        return !part.contentAvailable() && m_policy.accepts(job.location, part, job.size);
+    });
+    dispatch();
 }
 
 AttachmentDownloader::~AttachmentDownloader()
@@ -53,97 +116,223 @@ AttachmentDownloader::~AttachmentDownloader()
 
 void AttachmentDownloader::messagesUpdated(const QMailMessageIdList &messageIds)
 {
-    qCDebug(lcAD) << "Checking for attachments to download";
-    for (const auto &id : messageIds) {
-        autoDownloadAttachments(id);
+    if (messageIds.isEmpty())
+        return;
+
+    // Decided on the metadata first, only messages which may have something
+    // to download are loaded with their parts
+    const QMailMessageKey candidates(QMailMessageKey::id(messageIds)
+            & QMailMessageKey::status(QMailMessageMetaData::HasAttachments, QMailDataComparator::Includes)
+            & QMailMessageKey::status(QMailMessageMetaData::LocalOnly | QMailMessageMetaData::Temporary,
+                                      QMailDataComparator::Excludes));
+    const QMailMessageIdList ids = QMailStore::instance()->queryMessages(candidates);
+    qCDebug(lcAD) << "Checking for attachments to download in" << ids.size() << "of" << messageIds.size() << "messages";
+    bool queued = false;
+    for (const auto &id : ids) {
+        queued |= autoDownloadAttachments(id);
     }
+    if (queued)
+        dispatch();
+}
+
+void AttachmentDownloader::accountsRemoved(const QMailAccountIdList &ids)
+{
+    for (const auto &account : ids) {
+        const AccountDownloads downloads = m_accounts.take(account.toULongLong());
+        for (QMailRetrievalAction *action : downloads.actions) {
+            if (action->isRunning())
+                action->cancelOperation();
+            action->deleteLater();
+        }
+    }
+    m_queue.removeAccounts(ids);
+    dispatch();
 }
 
 void AttachmentDownloader::onlineStateChanged(bool online)
 {
     qCDebug(lcAD) << "Online state changed:" << online;
     if (online) {
-        processNext();
-    } else if (!m_locationQueue.isEmpty()) {
+        dispatch();
+    } else {
+        cancelAndRequeue();
+    }
+}
+
+void AttachmentDownloader::networkConfigurationChanged()
+{
+    // E.g. from WLAN to a metered connection
+    if (!m_policy.networkAllowed(m_networkConfiguration)) {
+        qCDebug(lcAD) << "Network not allowed for attachment downloads";
         cancelAndRequeue();
+    } else {
+        dispatch();
+    }
+}
+
+// Starts queued downloads while there are free slots, the accounts take turns
+void AttachmentDownloader::dispatch()
+{
+    if (!networkReady())
+        return;
+
+    DownloadQueue::Job job;
+    bool overBudget = false;
+    const auto ready = [this, &overBudget](const DownloadQueue::Job &next) {
+        if (!hasFreeSlot(next.accountId))
+            return false;
+        // Stays queued, the account is skipped for the rest of the day
+        if (!m_policy.withinDailyBudget(next.accountId, next.size)) {
+            overBudget = true;
+            return false;
+        }
+        return true;
+    };
+    while (m_queue.takeNext(ready, &job)) {
+        start(job);
+    }
+
+    if (overBudget && !m_budgetTimer.isActive()) {
+        const QDateTime now = QDateTime::currentDateTime();
+        const QDateTime tomorrow(now.date().addDays(1), QTime(0, 0));
+        qCDebug(lcAD) << "Daily download budget exceeded, continuing at" << tomorrow;
+        m_budgetTimer.start(int(now.msecsTo(tomorrow)) + 1000);
+    }
+}
+
+bool AttachmentDownloader::networkReady() const
+{
+    return m_networkConfiguration.isOnline() && m_policy.networkAllowed(m_networkConfiguration);
+}
+
+bool AttachmentDownloader::hasFreeSlot(const QMailAccountId &account) const
+{
+    const auto downloads = m_accounts.constFind(account.toULongLong());
+    if (downloads == m_accounts.constEnd() || downloads->actions.size() < MaxAccountDownloads)
+        return true;
+
+    for (QMailRetrievalAction *action : downloads->actions) {
+        if (!downloads->running.contains(action) && !action->isRunning())
+            return true;
+    }
+    return false;
+}
+
+// Creates the actions of the account as they are needed
+QMailRetrievalAction *AttachmentDownloader::idleAction(const QMailAccountId &account)
+{
+    AccountDownloads &downloads = m_accounts[account.toULongLong()];
+    for (QMailRetrievalAction *action : downloads.actions) {
+        // A cancelled action may not have stopped yet
+        if (!downloads.running.contains(action) && !action->isRunning())
+            return action;
+    }
+
+    if (downloads.actions.size() < MaxAccountDownloads) {
+        QMailRetrievalAction *action = new QMailRetrievalAction(this);
+        connect(action, &QMailRetrievalAction::activityChanged,
+                this, [this, account, action](QMailServiceAction::Activity activity) {
+            activityChanged(account, action, activity);
+        });
+        downloads.actions.append(action);
+        return action;
     }
+    return nullptr;
 }
 
-void AttachmentDownloader::activityChanged(QMailServiceAction::Activity activity)
+void AttachmentDownloader::start(const DownloadQueue::Job &job)
 {
-    const QMailServiceAction::Status status(m_action.status());
+    QMailRetrievalAction *action = idleAction(job.accountId);
+    Q_ASSERT(action && action->activity() == QMailServiceAction::Pending);
+    qCDebug(lcAD) << Q_FUNC_INFO << "Downloading" << job.location.toString(true) << "for account" << job.accountId;
+    m_accounts[job.accountId.toULongLong()].running.insert(action, job);
+    action->retrieveMessagePart(job.location);
+}
+
+void AttachmentDownloader::activityChanged(const QMailAccountId &account, QMailRetrievalAction *action,
+                                           QMailServiceAction::Activity activity)
+{
+    auto downloads = m_accounts.find(account.toULongLong());
+    if (downloads == m_accounts.end() || !downloads->running.contains(action))
+        return; // Cancelled and requeued already
+
+    const QMailServiceAction::Status status(action->status());
     bool requeue = false;
 
     switch (activity) {
     case QMailServiceAction::Failed:
-        qCWarning(lcAD) << Q_FUNC_INFO << "Attachment download failed, account: " << m_account
+        qCWarning(lcAD) << Q_FUNC_INFO << "Attachment download failed, account: " << account
                         << "error code:" << status.errorCode << "error text:" << status.text
-                        << "account:" << status.accountId << "connection status:" << m_action.connectivity()
+                        << "account:" << status.accountId << "connection status:" << action->connectivity()
                         << "online:" << m_networkConfiguration.isOnline();
         // If failure was due to not being connected, requeue
         if (status.errorCode == QMailServiceAction::Status::ErrNoConnection
                 || status.errorCode == QMailServiceAction::Status::ErrConnectionNotReady)
             requeue = true;
         break;
-    case QMailServiceAction::Successful:
-        qCDebug(lcAD) << Q_FUNC_INFO << "Attachment download finished for account" << m_account;
+    case QMailServiceAction::Successful: {
+        qCDebug(lcAD) << Q_FUNC_INFO << "Attachment download finished for account" << account;
+        const DownloadQueue::Job &job = downloads->running.value(action);
+        const auto evictions = m_policy.recordDownload(account, job.location,
+                                                       downloadedSize(job.location, job.size));
+        for (const auto &evicted : evictions) {
+            evictContent(evicted);
+        }
         break;
+    }
     case QMailServiceAction::Pending:
     case QMailServiceAction::InProgress:
         return;
     }
 
+    // Evicting updates the store, look the account up again
+    const DownloadQueue::Job job = m_accounts[account.toULongLong()].running.take(action);
     if (requeue) {
-        cancelAndRequeue();
+        m_queue.requeue(job.location);
     } else {
-        m_locationQueue.removeFirst();
-        processNext();
+        m_queue.finish(job.location);
     }
-    qCDebug(lcAD) << Q_FUNC_INFO << "Attachment download queue length is now" << m_locationQueue.size();
+    qCDebug(lcAD) << Q_FUNC_INFO << "Attachment download queue length is now" << m_queue.size();
+    dispatch();
 }
 
-void AttachmentDownloader::autoDownloadAttachments(const QMailMessageId &messageId)
+bool AttachmentDownloader::autoDownloadAttachments(const QMailMessageId &messageId)
 {
     const QMailMessage message(messageId);
     if (message.status() & (QMailMessageMetaData::LocalOnly | QMailMessageMetaData::Temporary)
             || !message.hasAttachments())
-        return;
+        return false;
+
+    bool queued = false;
     for (auto &location : message.findAttachmentLocations()) {
         const QMailMessagePart attachmentPart = message.partAt(location);
-        if (isEmailPart(attachmentPart) && !attachmentPart.contentAvailable()) {
-            location.setContainingMessageId(messageId);
-            if (enqueue(location)) {
-                qCDebug(lcAD) << Q_FUNC_INFO << "Auto download attachment for:" << location.toString(true)
-                              << "on account" << m_account << "queue size" << m_locationQueue.size();
-            }
+        DownloadQueue::Job job;
+        job.accountId = message.parentAccountId();
+        job.size = attachmentSize(attachmentPart);
+        location.setContainingMessageId(messageId);
+        job.location = location;
+        if (!attachmentPart.contentAvailable() && m_policy.accepts(location, attachmentPart, job.size)
+                && m_queue.enqueue(job)) {
+            qCDebug(lcAD) << Q_FUNC_INFO << "Auto download attachment for:" << location.toString(true)
+                          << "on account" << job.accountId << "queue size" << m_queue.size();
+            queued = true;
         }
     }
+    return queued;
 }
 
-bool AttachmentDownloader::enqueue(const QMailMessagePart::Location &location)
+void AttachmentDownloader::cancelAndRequeue()
 {
-    bool alreadyQueued = m_locationQueue.contains(location);
-    if (!alreadyQueued) {
-        m_locationQueue.append(location);
-    }
-    processNext();
-    return !alreadyQueued;
-}
+    for (auto downloads = m_accounts.begin(); downloads != m_accounts.end(); ++downloads) {
+        if (downloads->running.isEmpty())
+            continue;
 
-void AttachmentDownloader::processNext()
-{
-    if (!m_locationQueue.isEmpty() && m_networkConfiguration.isOnline() && !m_action.isRunning()) {
-        Q_ASSERT(m_action.activity() == QMailServiceAction::Pending);
-        qCDebug(lcAD) << Q_FUNC_INFO << "Executing next attachment download action for account" << m_account;
-        m_action.retrieveMessagePart(m_locationQueue.constFirst());
+        qCDebug(lcAD) << Q_FUNC_INFO << "Canceling and requeing attachment downloads for account" << downloads.key();
+        for (auto it = downloads->running.constBegin(); it != downloads->running.constEnd(); ++it) {
+            if (it.key()->isRunning())
+                it.key()->cancelOperation();
+            m_queue.requeue(it->location);
+        }
+        downloads->running.clear();
     }
 }
-
-void AttachmentDownloader::cancelAndRequeue()
-{
-    qCDebug(lcAD) << Q_FUNC_INFO << "Canceling and requeing attachment download action for account" << m_account;
-    if (m_action.isRunning())
-        m_action.cancelOperation();
-    if (!m_locationQueue.isEmpty())
-        enqueue(m_locationQueue.takeFirst());
-}
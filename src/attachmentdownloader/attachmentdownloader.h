@@ -20,36 +20,56 @@
 #define DOWNLOADER_H
 
 #include <QObject>
+#include <QHash>
 #include <QList>
 #include <QNetworkConfigurationManager>
+#include <QTimer>
 
 #include <qmailmessageserverplugin.h>
 #include <qmailserviceaction.h>
-#include <qmailstoreaccountfilter.h>
 
+#include "downloadpolicy.h"
+#include "downloadqueue.h"
+
+// Downloads the attachments of all accounts. Store changes and network state
+// are followed once for every account, the parts found are scheduled through
+// the shared queue and each account downloads a few of them at a time.
 class AttachmentDownloader : public QObject
 {
     Q_OBJECT
 
 public:
-    AttachmentDownloader(const QMailAccountId &account, QObject *parent = 0);
+    explicit AttachmentDownloader(QObject *parent = 0);
     ~AttachmentDownloader();
 
 private slots:
     void messagesUpdated(const QMailMessageIdList &messageIds);
+    void accountsRemoved(const QMailAccountIdList &ids);
     void onlineStateChanged(bool online);
-    void activityChanged(QMailServiceAction::Activity activity);
+    void networkConfigurationChanged();
+    void dispatch();
 
 private:
-    QMailAccountId m_account;
-    QMailRetrievalAction m_action;
-    QList<QMailMessagePart::Location> m_locationQueue;
+    // Created with the first download of the account
+    struct AccountDownloads {
+        QList<QMailRetrievalAction *> actions;
+        QHash<QMailRetrievalAction *, DownloadQueue::Job> running;
+    };
+
+    DownloadPolicy m_policy;
+    DownloadQueue m_queue;
     QNetworkConfigurationManager m_networkConfiguration;
-    QMailStoreAccountFilter m_store;
+    // Dispatches again when the daily budgets start over
+    QTimer m_budgetTimer;
+    QHash<quint64, AccountDownloads> m_accounts;
 
-    void autoDownloadAttachments(const QMailMessageId &messageId);
-    bool enqueue(const QMailMessagePart::Location &location);
-    void processNext();
+    bool networkReady() const;
+    bool hasFreeSlot(const QMailAccountId &account) const;
+    QMailRetrievalAction *idleAction(const QMailAccountId &account);
+    void start(const DownloadQueue::Job &job);
+    void activityChanged(const QMailAccountId &account, QMailRetrievalAction *action,
+                         QMailServiceAction::Activity activity);
+    bool autoDownloadAttachments(const QMailMessageId &messageId);
     void cancelAndRequeue();
 };
 
@@ -8,11 +8,15 @@ PKGCONFIG += QmfMessageServer QmfClient
 INCLUDEPATH += ..
 SOURCES += \
     attachmentdownloaderplugin.cpp \
-    attachmentdownloader.cpp
+    attachmentdownloader.cpp \
+    downloadpolicy.cpp \
+    downloadqueue.cpp
 
 HEADERS += \
     attachmentdownloaderplugin.h \
-    attachmentdownloader.h
+    attachmentdownloader.h \
+    downloadpolicy.h \
+    downloadqueue.h
 
 target.path = $$[QT_INSTALL_PLUGINS]/messagingframework/messageserverplugins
 INSTALLS += target
@@ -17,43 +17,16 @@
  */
 
 #include "attachmentdownloaderplugin.h"
-#include "attachmentdownloader.h"
 
 AttachmentDownloaderService::AttachmentDownloaderService()
     : QMailMessageServerService()
 {
-    auto *store = QMailStore::instance();
-    connect(store, &QMailStore::accountsAdded,
-            this, &AttachmentDownloaderService::accountsAdded);
-    connect(store, &QMailStore::accountsRemoved,
-            this, &AttachmentDownloaderService::accountsRemoved);
-    auto accounts = store->queryAccounts();
-    for (const auto &account : accounts) {
-        m_downloaders.insert(account.toULongLong(),
-                             QSharedPointer<AttachmentDownloader>(new AttachmentDownloader(account, this)));
-    }
 }
 
 AttachmentDownloaderService::~AttachmentDownloaderService()
 {
 }
 
-void AttachmentDownloaderService::accountsAdded(const QMailAccountIdList &ids)
-{
-    for (const auto &account : ids) {
-        int id = account.toULongLong();
-        if (!m_downloaders.contains(id))
-            m_downloaders.insert(id, QSharedPointer<AttachmentDownloader>(new AttachmentDownloader(account, this)));
-    }
-}
-
-void AttachmentDownloaderService::accountsRemoved(const QMailAccountIdList &ids)
-{
-    for (const auto &account : ids) {
-        m_downloaders.remove(account.toULongLong());
-    }
-}
-
 AttachmentDownloaderPlugin::AttachmentDownloaderPlugin(QObject *parent)
     : QMailMessageServerPlugin(parent)
 {
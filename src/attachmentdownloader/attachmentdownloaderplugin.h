@@ -19,12 +19,9 @@
 #ifndef DOWNLOADERPLUGIN_H
 #define DOWNLOADERPLUGIN_H
 
-#include <QHash>
-#include <QSharedPointer>
-#include <qmailid.h>
 #include <qmailmessageserverplugin.h>
 
-class AttachmentDownloader;
+#include "attachmentdownloader.h"
 
 class AttachmentDownloaderService : public QMailMessageServerService
 {
@@ -34,12 +31,8 @@ public:
     AttachmentDownloaderService();
     ~AttachmentDownloaderService();
 
-private slots:
-    void accountsAdded(const QMailAccountIdList &ids);
-    void accountsRemoved(const QMailAccountIdList &ids);
-
 private:
-    QHash<int, QSharedPointer<AttachmentDownloader>> m_downloaders;
+    AttachmentDownloader m_downloader;
 };
 
 class AttachmentDownloaderPlugin : public QMailMessageServerPlugin
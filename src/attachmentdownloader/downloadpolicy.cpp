@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2020 Open Mobile Platform LLC.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.         See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <QDataStream>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QLoggingCategory>
+#include <QNetworkConfigurationManager>
+#include <QSaveFile>
+#include <QSettings>
+
+#include <qmailnamespace.h>
+#include <qmailstore.h>
+
+#include "downloadpolicy.h"
+#include "emailutils.h"
+
+Q_DECLARE_LOGGING_CATEGORY(lcAD)
+
+namespace {
+
+const quint32 LedgerVersion = 1;
+
+const qint64 DefaultMaxPartSize = 10 * 1024 * 1024;
+const qint64 DefaultDailyAccountBudget = 100 * 1024 * 1024;
+const qint64 DefaultDiskBudget = 500 * 1024 * 1024;
+
+}
+
+DownloadPolicy::DownloadPolicy()
+    : m_diskUsage(0)
+{
+    QSettings settings(QSettings::SystemScope, "nemo-qml-plugin-email", "attachmentDownloadPolicy");
+    m_maxPartSize = settings.value("MaxPartSize", DefaultMaxPartSize).toLongLong();
+    m_allowedTypes = settings.value("AllowedTypes").toStringList();
+    m_deniedTypes = settings.value("DeniedTypes").toStringList();
+    m_unmeteredOnly = settings.value("UnmeteredOnly", false).toBool();
+    m_dailyAccountBudget = settings.value("DailyAccountBudget", DefaultDailyAccountBudget).toLongLong();
+    m_diskBudget = settings.value("DiskBudget", DefaultDiskBudget).toLongLong();
+
+    m_ledgerPath = QDir(QMail::dataPath()).filePath(QStringLiteral("attachmentdownloader/ledger"));
+    load();
+}
+
+bool DownloadPolicy::accepts(const QMailMessagePart::Location &location, const QMailMessagePart &part, qint64 size) const
+{
+    if (m_evicted.contains(location.toString(true)))
+        return false;
+
+    // A part of unknown size could be of any size
+    if (m_maxPartSize > 0 && (size < 0 || size > m_maxPartSize)) {
+        qCDebug(lcAD) << "Attachment" << location.toString(true) << "exceeds the size limit:" << size;
+        return false;
+    }
+
+    if (typeMatches(m_deniedTypes, part))
+        return false;
+
+    return m_allowedTypes.isEmpty() ? isEmailPart(part) : typeMatches(m_allowedTypes, part);
+}
+
+bool DownloadPolicy::networkAllowed(const QNetworkConfigurationManager &manager) const
+{
+    if (!m_unmeteredOnly)
+        return true;
+
+    switch (manager.defaultConfiguration().bearerTypeFamily()) {
+    case QNetworkConfiguration::Bearer2G:
+    case QNetworkConfiguration::Bearer3G:
+    case QNetworkConfiguration::Bearer4G:
+        return false;
+    default:
+        return true;
+    }
+}
+
+bool DownloadPolicy::withinDailyBudget(const QMailAccountId &account, qint64 size)
+{
+    if (m_dailyAccountBudget <= 0)
+        return true;
+
+    resetDailyUsage();
+    return m_dailyUsage.value(account.toULongLong()) + qMax<qint64>(size, 0) <= m_dailyAccountBudget;
+}
+
+QList<QMailMessagePart::Location> DownloadPolicy::recordDownload(const QMailAccountId &account,
+                                                                 const QMailMessagePart::Location &location,
+                                                                 qint64 size)
+{
+    size = qMax<qint64>(size, 0);
+    resetDailyUsage();
+    m_dailyUsage[account.toULongLong()] += size;
+
+    Entry entry;
+    entry.location = location.toString(true);
+    entry.messageId = location.containingMessageId().toULongLong();
+    entry.size = size;
+    for (int i = 0; i < m_downloads.size(); ++i) {
+        if (m_downloads.at(i).location == entry.location) {
+            m_diskUsage -= m_downloads.takeAt(i).size;
+            break;
+        }
+    }
+    m_downloads.append(entry);
+    m_diskUsage += size;
+
+    QList<QMailMessagePart::Location> evictions;
+    // The newest download stays even if it alone is over the budget
+    while (m_diskBudget > 0 && m_diskUsage > m_diskBudget && m_downloads.size() > 1) {
+        const Entry oldest = m_downloads.takeFirst();
+        m_diskUsage -= oldest.size;
+        m_evicted.insert(oldest.location);
+        evictions.append(QMailMessagePart::Location(oldest.location));
+    }
+
+    save();
+    return evictions;
+}
+
+bool DownloadPolicy::typeMatches(const QStringList &patterns, const QMailMessagePart &part) const
+{
+    const QString type = QString::fromLatin1(part.contentType().content()).toLower();
+    for (const QString &pattern : patterns) {
+        const QString lowered = pattern.trimmed().toLower();
+        if (lowered.endsWith(QLatin1String("/*"))
+                ? type.startsWith(lowered.left(lowered.size() - 1))
+                : type == lowered) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void DownloadPolicy::resetDailyUsage()
+{
+    const QDate today = QDate::currentDate();
+    if (m_usageDate != today) {
+        m_usageDate = today;
+        m_dailyUsage.clear();
+    }
+}
+
+void DownloadPolicy::load()
+{
+    QFile file(m_ledgerPath);
+    if (!file.open(QIODevice::ReadOnly))
+        return;
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_6);
+    quint32 version;
+    qint64 usageDay;
+    QList<Entry> downloads;
+    int count;
+    stream >> version;
+    if (version != LedgerVersion) {
+        qCWarning(lcAD) << "Unknown attachment download ledger version" << version;
+        return;
+    }
+    stream >> usageDay >> m_dailyUsage >> m_evicted >> count;
+    for (int i = 0; i < count && stream.status() == QDataStream::Ok; ++i) {
+        Entry entry;
+        stream >> entry.location >> entry.messageId >> entry.size;
+        downloads.append(entry);
+    }
+    if (stream.status() != QDataStream::Ok) {
+        qCWarning(lcAD) << "Attachment download ledger is corrupt, starting over";
+        m_dailyUsage.clear();
+        m_evicted.clear();
+        return;
+    }
+    m_usageDate = QDate::fromJulianDay(usageDay);
+
+    // Content of removed messages is gone with them
+    QMailMessageIdList ids;
+    for (const Entry &entry : downloads)
+        ids.append(QMailMessageId(entry.messageId));
+    for (const QString &location : m_evicted)
+        ids.append(QMailMessagePart::Location(location).containingMessageId());
+    QSet<quint64> existing;
+    if (!ids.isEmpty()) {
+        for (const QMailMessageId &id : QMailStore::instance()->queryMessages(QMailMessageKey::id(ids)))
+            existing.insert(id.toULongLong());
+    }
+    for (const Entry &entry : downloads) {
+        if (existing.contains(entry.messageId)) {
+            m_downloads.append(entry);
+            m_diskUsage += entry.size;
+        }
+    }
+    QSet<QString> evicted;
+    for (const QString &location : m_evicted) {
+        if (existing.contains(QMailMessagePart::Location(location).containingMessageId().toULongLong()))
+            evicted.insert(location);
+    }
+    m_evicted = evicted;
+}
+
+void DownloadPolicy::save() const
+{
+    QDir().mkpath(QFileInfo(m_ledgerPath).absolutePath());
+    QSaveFile file(m_ledgerPath);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qCWarning(lcAD) << "Cannot write attachment download ledger" << m_ledgerPath << file.errorString();
+        return;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_6);
+    stream << LedgerVersion << m_usageDate.toJulianDay() << m_dailyUsage << m_evicted << m_downloads.size();
+    for (const Entry &entry : m_downloads)
+        stream << entry.location << entry.messageId << entry.size;
+
+    if (!file.commit())
+        qCWarning(lcAD) << "Cannot write attachment download ledger" << m_ledgerPath << file.errorString();
+}
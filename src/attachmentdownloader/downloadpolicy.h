@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2020 Open Mobile Platform LLC.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.         See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef DOWNLOADPOLICY_H
+#define DOWNLOADPOLICY_H
+
+#include <QDate>
+#include <QHash>
+#include <QList>
+#include <QSet>
+#include <QStringList>
+
+#include <qmailid.h>
+#include <qmailmessage.h>
+
+class QNetworkConfigurationManager;
+
+// Limits of the automatic attachment download, read from the system settings
+// nemo-qml-plugin-email/attachmentDownloadPolicy:
+//   MaxPartSize         largest part in bytes, 0 for no limit
+//   AllowedTypes        MIME types like "image/*", by default e-mail parts only
+//   DeniedTypes         MIME types never downloaded
+//   UnmeteredOnly       no downloads over cellular connections
+//   DailyAccountBudget  bytes per account and day, 0 for no limit
+//   DiskBudget          bytes of downloaded content kept, 0 for no limit
+// The downloads are recorded in a ledger so that the budgets hold across
+// restarts. Over the disk budget content is evicted first in, first out by
+// download time, the messageserver does not see when content is opened.
+// Evicted parts are not downloaded again automatically.
+class DownloadPolicy
+{
+public:
+    DownloadPolicy();
+
+    // Size of the part in bytes, -1 if unknown
+    bool accepts(const QMailMessagePart::Location &location, const QMailMessagePart &part, qint64 size) const;
+    bool networkAllowed(const QNetworkConfigurationManager &manager) const;
+    bool withinDailyBudget(const QMailAccountId &account, qint64 size);
+
+    // Returns the parts to evict to stay within the disk budget
+    QList<QMailMessagePart::Location> recordDownload(const QMailAccountId &account,
+                                                     const QMailMessagePart::Location &location,
+                                                     qint64 size);
+
+private:
+    struct Entry {
+        QString location;
+        quint64 messageId;
+        qint64 size;
+    };
+
+    bool typeMatches(const QStringList &patterns, const QMailMessagePart &part) const;
+    void resetDailyUsage();
+    void load();
+    void save() const;
+
+    qint64 m_maxPartSize;
+    QStringList m_allowedTypes;
+    QStringList m_deniedTypes;
+    bool m_unmeteredOnly;
+    qint64 m_dailyAccountBudget;
+    qint64 m_diskBudget;
+
+    QString m_ledgerPath;
+    // Oldest download first, evicted in this order
+    QList<Entry> m_downloads;
+    qint64 m_diskUsage;
+    QSet<QString> m_evicted;
+    QDate m_usageDate;
+    QHash<quint64, qint64> m_dailyUsage;
+};
+
+#endif
@@ -0,0 +1,242 @@
+/*
+ * Copyright (c) 2020 Open Mobile Platform LLC.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.         See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <QDataStream>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QLoggingCategory>
+#include <QSaveFile>
+#include <QSet>
+
+#include "downloadqueue.h"
+
+Q_DECLARE_LOGGING_CATEGORY(lcAD)
+
+namespace {
+
+const quint32 QueueVersion = 1;
+// Parts of all accounts downloading at the same time
+const int MaxRunning = 4;
+// Changes are collected for this long before the queue is saved
+const int SaveDelay = 2000;
+
+}
+
+DownloadQueue::DownloadQueue(const QString &path, QObject *parent)
+    : QObject(parent)
+    , m_path(path)
+    , m_running(0)
+    , m_firstSequence(0)
+    , m_lastSequence(0)
+{
+    m_saveTimer.setSingleShot(true);
+    m_saveTimer.setInterval(SaveDelay);
+    connect(&m_saveTimer, &QTimer::timeout, this, &DownloadQueue::save);
+}
+
+DownloadQueue::~DownloadQueue()
+{
+    if (m_saveTimer.isActive())
+        save();
+}
+
+bool DownloadQueue::enqueue(const Job &job)
+{
+    if (m_entries.contains(job.location.toString(true)))
+        return false;
+
+    insert(job, ++m_lastSequence);
+    m_saveTimer.start();
+    return true;
+}
+
+bool DownloadQueue::takeNext(const std::function<bool(const Job &)> &ready, Job *job)
+{
+    if (m_running >= MaxRunning)
+        return false;
+
+    for (int i = 0; i < m_turns.size(); ++i) {
+        const quint64 account = m_turns.at(i);
+        QMap<qint64, QString> &queued = m_queued[account];
+        Entry &entry = m_entries[queued.first()];
+        if (!ready(entry.job))
+            continue;
+
+        queued.remove(queued.firstKey());
+        entry.running = true;
+        ++m_running;
+        *job = entry.job;
+
+        // Others go first next time
+        m_turns.removeAt(i);
+        if (queued.isEmpty()) {
+            m_queued.remove(account);
+        } else {
+            m_turns.append(account);
+        }
+        return true;
+    }
+    return false;
+}
+
+void DownloadQueue::finish(const QMailMessagePart::Location &location)
+{
+    const QString key = location.toString(true);
+    auto it = m_entries.find(key);
+    if (it == m_entries.end())
+        return;
+
+    if (it->running) {
+        --m_running;
+    } else {
+        const quint64 account = it->job.accountId.toULongLong();
+        QMap<qint64, QString> &queued = m_queued[account];
+        queued.remove(it->sequence);
+        if (queued.isEmpty()) {
+            m_queued.remove(account);
+            m_turns.removeOne(account);
+        }
+    }
+    m_entries.erase(it);
+    m_saveTimer.start();
+}
+
+void DownloadQueue::requeue(const QMailMessagePart::Location &location)
+{
+    auto it = m_entries.find(location.toString(true));
+    if (it == m_entries.end() || !it->running)
+        return;
+
+    const Job job = it->job;
+    --m_running;
+    m_entries.erase(it);
+    insert(job, --m_firstSequence);
+    m_saveTimer.start();
+}
+
+void DownloadQueue::removeAccounts(const QMailAccountIdList &ids)
+{
+    QSet<quint64> accounts;
+    for (const QMailAccountId &id : ids) {
+        accounts.insert(id.toULongLong());
+        m_queued.remove(id.toULongLong());
+        m_turns.removeOne(id.toULongLong());
+    }
+
+    for (auto it = m_entries.begin(); it != m_entries.end();) {
+        if (accounts.contains(it->job.accountId.toULongLong())) {
+            if (it->running)
+                --m_running;
+            it = m_entries.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    m_saveTimer.start();
+}
+
+QMailAccountIdList DownloadQueue::accounts() const
+{
+    QMailAccountIdList ids;
+    for (quint64 account : m_turns)
+        ids.append(QMailAccountId(account));
+    return ids;
+}
+
+int DownloadQueue::size() const
+{
+    return m_entries.size();
+}
+
+void DownloadQueue::insert(const Job &job, qint64 sequence)
+{
+    const QString key = job.location.toString(true);
+    Entry entry;
+    entry.job = job;
+    entry.sequence = sequence;
+    entry.running = false;
+    m_entries.insert(key, entry);
+
+    const quint64 account = job.accountId.toULongLong();
+    QMap<qint64, QString> &queued = m_queued[account];
+    if (queued.isEmpty())
+        m_turns.append(account);
+    queued.insert(sequence, key);
+}
+
+void DownloadQueue::restore(const std::function<bool(const Job &)> &accept)
+{
+    QFile file(m_path);
+    if (!file.open(QIODevice::ReadOnly))
+        return;
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_6);
+    quint32 version;
+    stream >> version;
+    if (version != QueueVersion) {
+        qCWarning(lcAD) << "Unknown attachment download queue version" << version;
+        return;
+    }
+
+    bool dropped = false;
+    while (!stream.atEnd()) {
+        quint64 account;
+        QString location;
+        Job job;
+        stream >> account >> location >> job.size;
+        if (stream.status() != QDataStream::Ok) {
+            qCWarning(lcAD) << "Attachment download queue truncated at offset" << file.pos();
+            dropped = true;
+            break;
+        }
+        job.accountId = QMailAccountId(account);
+        job.location = QMailMessagePart::Location(location);
+        if (!accept(job) || !enqueue(job))
+            dropped = true;
+    }
+    // Saved again only if it differs from the file
+    if (!dropped)
+        m_saveTimer.stop();
+    qCDebug(lcAD) << "Restored" << m_entries.size() << "attachment downloads";
+}
+
+void DownloadQueue::save()
+{
+    m_saveTimer.stop();
+    QDir().mkpath(QFileInfo(m_path).absolutePath());
+    QSaveFile file(m_path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qCWarning(lcAD) << "Cannot write attachment download queue" << m_path << file.errorString();
+        return;
+    }
+
+    // Downloads in progress are saved as queued, in front of their account
+    QMap<qint64, const Entry *> ordered;
+    for (auto it = m_entries.constBegin(); it != m_entries.constEnd(); ++it)
+        ordered.insert(it->running ? it->sequence - m_lastSequence + m_firstSequence - 1 : it->sequence, &it.value());
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_6);
+    stream << QueueVersion;
+    for (const Entry *entry : ordered)
+        stream << quint64(entry->job.accountId.toULongLong()) << entry->job.location.toString(true) << entry->job.size;
+
+    if (!file.commit())
+        qCWarning(lcAD) << "Cannot write attachment download queue" << m_path << file.errorString();
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2020 Open Mobile Platform LLC.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.         See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef DOWNLOADQUEUE_H
+#define DOWNLOADQUEUE_H
+
+#include <functional>
+
+#include <QHash>
+#include <QList>
+#include <QMap>
+#include <QObject>
+#include <QTimer>
+
+#include <qmailid.h>
+#include <qmailmessage.h>
+
+// Attachment parts waiting for download, in order per account and looked up
+// by location. Accounts take turns, and at most MaxRunning parts download at
+// the same time. The queue is saved to disk and can be restored on the next start.
+class DownloadQueue : public QObject
+{
+    Q_OBJECT
+
+public:
+    struct Job {
+        QMailAccountId accountId;
+        QMailMessagePart::Location location;
+        qint64 size = -1;
+    };
+
+    explicit DownloadQueue(const QString &path, QObject *parent = 0);
+    ~DownloadQueue();
+
+    // Parts saved by the previous run for which accept() holds
+    void restore(const std::function<bool(const Job &)> &accept);
+
+    // False if the part is already queued or downloading
+    bool enqueue(const Job &job);
+    // First part of the account following in turn for which ready() holds,
+    // false if there is none or too many are downloading
+    bool takeNext(const std::function<bool(const Job &)> &ready, Job *job);
+    // Downloaded or given up
+    void finish(const QMailMessagePart::Location &location);
+    // Downloads again before the other parts of the account
+    void requeue(const QMailMessagePart::Location &location);
+    void removeAccounts(const QMailAccountIdList &ids);
+    // Accounts with queued parts
+    QMailAccountIdList accounts() const;
+    int size() const;
+
+private slots:
+    void save();
+
+private:
+    struct Entry {
+        Job job;
+        qint64 sequence;
+        bool running;
+    };
+
+    void insert(const Job &job, qint64 sequence);
+
+    QString m_path;
+    // All parts by location, queued and downloading
+    QHash<QString, Entry> m_entries;
+    // Queued locations of each account in download order
+    QHash<quint64, QMap<qint64, QString>> m_queued;
+    // Accounts with queued parts, the next in turn first
+    QList<quint64> m_turns;
+    int m_running;
+    qint64 m_firstSequence;
+    qint64 m_lastSequence;
+    QTimer m_saveTimer;
+};
+
+#endif
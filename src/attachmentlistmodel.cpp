@@ -17,24 +17,101 @@
 #include "emailagent.h"
 #include "emailmessage.h"
 
+namespace {
+
+const int DefaultProgressInterval = 250;
+
+// Roles of the properties coming from the message part
+QVector<int> changedPartRoles(const AttachmentListModel::Attachment &current,
+                              const AttachmentListModel::Attachment &updated)
+{
+    QVector<int> roles;
+    if (current.displayName != updated.displayName)
+        roles << AttachmentListModel::DisplayName;
+    if (current.downloaded != updated.downloaded)
+        roles << AttachmentListModel::Downloaded;
+    if (current.mimeType != updated.mimeType)
+        roles << AttachmentListModel::MimeType;
+    if (current.size != updated.size)
+        roles << AttachmentListModel::Size;
+    if (current.title != updated.title)
+        roles << AttachmentListModel::Title;
+    if (current.type != updated.type)
+        roles << AttachmentListModel::Type;
+    return roles;
+}
+
+}
+
+// One connection to EmailAgent for all models, instead of every model
+// scanning its attachments for each update
+class AttachmentListModel::Router : public QObject
+{
+public:
+    static Router *instance()
+    {
+        static Router *router = new Router(EmailAgent::instance());
+        return router;
+    }
+
+    void subscribe(const QString &location, AttachmentListModel *model)
+    {
+        m_subscribers[location].append(model);
+    }
+
+    void unsubscribe(const QString &location, AttachmentListModel *model)
+    {
+        auto it = m_subscribers.find(location);
+        if (it != m_subscribers.end()) {
+            it->removeOne(model);
+            if (it->isEmpty()) {
+                m_subscribers.erase(it);
+            }
+        }
+    }
+
+private:
+    explicit Router(EmailAgent *agent)
+        : QObject(agent)
+    {
+        connect(agent, &EmailAgent::attachmentDownloadStatusChanged,
+                this, [this](const QString &location, EmailAgent::AttachmentStatus status) {
+            for (AttachmentListModel *model : m_subscribers.value(location)) {
+                model->onAttachmentDownloadStatusChanged(location, status);
+            }
+        });
+        connect(agent, &EmailAgent::attachmentDownloadProgressChanged,
+                this, [this](const QString &location, double progress) {
+            for (AttachmentListModel *model : m_subscribers.value(location)) {
+                model->onAttachmentDownloadProgressChanged(location, progress);
+            }
+        });
+        connect(agent, &EmailAgent::attachmentPathChanged,
+                this, [this](const QString &location, const QString &path) {
+            for (AttachmentListModel *model : m_subscribers.value(location)) {
+                model->onAttachmentPathChanged(location, path);
+            }
+        });
+    }
+
+    QHash<QString, QList<AttachmentListModel *> > m_subscribers;
+};
+
 AttachmentListModel::AttachmentListModel(EmailMessage *parent)
     : QAbstractListModel(parent)
     , m_message(parent)
     , m_attachmentFileWatcher(new QFileSystemWatcher(this))
+    , m_progressInterval(DefaultProgressInterval)
 {
+    m_progressClock.start();
+    m_progressTimer.setSingleShot(true);
+    connect(&m_progressTimer, &QTimer::timeout,
+            this, &AttachmentListModel::flushProgress);
+
     resetModel();
 
     connect(parent, &EmailMessage::attachmentsChanged,
-            this, &AttachmentListModel::resetModel);
-
-    connect(EmailAgent::instance(), &EmailAgent::attachmentDownloadStatusChanged,
-            this, &AttachmentListModel::onAttachmentDownloadStatusChanged);
-
-    connect(EmailAgent::instance(), &EmailAgent::attachmentDownloadProgressChanged,
-            this, &AttachmentListModel::onAttachmentDownloadProgressChanged);
-
-    connect(EmailAgent::instance(), &EmailAgent::attachmentPathChanged,
-            this, &AttachmentListModel::onAttachmentPathChanged);
+            this, &AttachmentListModel::refresh);
 
     connect(QMailStore::instance(), &QMailStore::messagesUpdated,
             this, &AttachmentListModel::onMessagesUpdated);
@@ -45,6 +122,7 @@ AttachmentListModel::AttachmentListModel(EmailMessage *parent)
 
 AttachmentListModel::~AttachmentListModel()
 {
+    unsubscribe();
 }
 
 QHash<int, QByteArray> AttachmentListModel::roleNames() const
@@ -104,42 +182,89 @@ QVariant AttachmentListModel::data(const QModelIndex &index, int role) const
 
 void AttachmentListModel::onAttachmentDownloadStatusChanged(const QString &attachmentLocation, EmailAgent::AttachmentStatus status)
 {
-    for (int i = 0; i < m_attachmentsList.count(); ++i) {
-        if (m_attachmentsList[i].location == attachmentLocation) {
-            m_attachmentsList[i].status = status;
-            QModelIndex changeIndex = index(i, 0);
-            emit dataChanged(changeIndex, changeIndex, QVector<int>() << StatusInfo);
-            return;
-        }
+    const int row = m_rows.value(attachmentLocation, -1);
+    if (row < 0) {
+        return;
+    }
+
+    m_attachmentsList[row].status = status;
+    QVector<int> roles;
+    roles << StatusInfo;
+    // Held back progress goes out with the status
+    if (m_pendingProgress.remove(attachmentLocation)) {
+        roles << ProgressInfo;
     }
+    m_progressUpdated.remove(attachmentLocation);
+    emitRowChanged(row, roles);
 }
 
 void AttachmentListModel::onAttachmentDownloadProgressChanged(const QString &attachmentLocation, double progress)
 {
-    for (int i = 0; i < m_attachmentsList.count(); ++i) {
-        if (m_attachmentsList[i].location == attachmentLocation) {
-            m_attachmentsList[i].progressInfo = progress;
-            QModelIndex changeIndex = index(i, 0);
-            emit dataChanged(changeIndex, changeIndex, QVector<int>() << ProgressInfo);
-            return;
+    const int row = m_rows.value(attachmentLocation, -1);
+    if (row < 0) {
+        return;
+    }
+
+    m_attachmentsList[row].progressInfo = progress;
+
+    const qint64 now = m_progressClock.elapsed();
+    auto updated = m_progressUpdated.constFind(attachmentLocation);
+    const qint64 due = updated == m_progressUpdated.constEnd() ? now : *updated + m_progressInterval;
+    if (due <= now || progress >= 1.0) {
+        m_pendingProgress.remove(attachmentLocation);
+        m_progressUpdated.insert(attachmentLocation, now);
+        emitRowChanged(row, QVector<int>() << ProgressInfo);
+    } else {
+        m_pendingProgress.insert(attachmentLocation);
+        if (!m_progressTimer.isActive() || m_progressTimer.remainingTime() > due - now) {
+            m_progressTimer.start(int(due - now));
         }
     }
 }
 
 void AttachmentListModel::onAttachmentPathChanged(const QString &attachmentLocation, const QString &path)
 {
-    for (int i = 0; i < m_attachmentsList.count(); ++i) {
-        if (m_attachmentsList[i].location == attachmentLocation) {
-            QString url = QUrl::fromLocalFile(path).toString();
-            if (m_attachmentsList[i].url != url) {
-                m_attachmentFileWatcher->addPath(QFileInfo(path).dir().path());
-                m_attachmentsList[i].url = url;
-                QModelIndex changeIndex = index(i, 0);
-                emit dataChanged(changeIndex, changeIndex, QVector<int>() << Url);
-                return;
+    const int row = m_rows.value(attachmentLocation, -1);
+    if (row < 0) {
+        return;
+    }
+
+    QString url = QUrl::fromLocalFile(path).toString();
+    if (m_attachmentsList[row].url != url) {
+        m_attachmentFileWatcher->addPath(QFileInfo(path).dir().path());
+        m_attachmentsList[row].url = url;
+        emitRowChanged(row, QVector<int>() << Url);
+    }
+}
+
+void AttachmentListModel::flushProgress()
+{
+    const qint64 now = m_progressClock.elapsed();
+    qint64 wait = -1;
+    for (auto it = m_pendingProgress.begin(); it != m_pendingProgress.end();) {
+        const qint64 due = m_progressUpdated.value(*it) + m_progressInterval;
+        if (due <= now) {
+            const int row = m_rows.value(*it, -1);
+            if (row >= 0) {
+                emitRowChanged(row, QVector<int>() << ProgressInfo);
             }
+            m_progressUpdated.insert(*it, now);
+            it = m_pendingProgress.erase(it);
+        } else {
+            wait = wait < 0 ? due - now : qMin(wait, due - now);
+            ++it;
         }
     }
+
+    if (wait >= 0) {
+        m_progressTimer.start(int(wait));
+    }
+}
+
+void AttachmentListModel::emitRowChanged(int row, const QVector<int> &roles)
+{
+    const QModelIndex changeIndex = index(row, 0);
+    emit dataChanged(changeIndex, changeIndex, roles);
 }
 
 void AttachmentListModel::onDirectoryChanged(const QString &path)
@@ -158,7 +283,7 @@ void AttachmentListModel::onMessagesUpdated(const QMailMessageIdList &ids)
 {
     if (m_message && ids.contains(QMailMessageId(m_message->messageId()))) {
         // Message got updated, number of attachments may have changed.
-        resetModel();
+        refresh();
     }
 }
 
@@ -207,10 +332,135 @@ int AttachmentListModel::count() const
     return rowCount();
 }
 
+int AttachmentListModel::progressInterval() const
+{
+    return m_progressInterval;
+}
+
+void AttachmentListModel::setProgressInterval(int interval)
+{
+    interval = qMax(0, interval);
+    if (m_progressInterval != interval) {
+        m_progressInterval = interval;
+        emit progressIntervalChanged();
+    }
+}
+
+void AttachmentListModel::subscribe()
+{
+    Router *router = Router::instance();
+    for (auto it = m_rows.constBegin(); it != m_rows.constEnd(); ++it) {
+        router->subscribe(it.key(), this);
+    }
+}
+
+void AttachmentListModel::unsubscribe()
+{
+    Router *router = Router::instance();
+    for (auto it = m_rows.constBegin(); it != m_rows.constEnd(); ++it) {
+        router->unsubscribe(it.key(), this);
+    }
+}
+
+// Applies the changes of the attachments as row changes, unchanged parts are
+// left alone without checking their files again
+void AttachmentListModel::refresh()
+{
+    const QStringList locations = m_message ? m_message->attachmentLocations() : QStringList();
+
+    QSet<QString> kept;
+    for (const QString &location : locations) {
+        if (m_rows.contains(location)) {
+            kept.insert(location);
+        }
+    }
+    if (kept.isEmpty() && !m_attachmentsList.isEmpty()) {
+        // Another message
+        resetModel();
+        return;
+    }
+
+    const int oldCount = m_attachmentsList.count();
+    unsubscribe();
+
+    for (int row = m_attachmentsList.count() - 1; row >= 0; --row) {
+        const QString location = m_attachmentsList.at(row).location;
+        if (!kept.contains(location)) {
+            beginRemoveRows(QModelIndex(), row, row);
+            m_attachmentsList.removeAt(row);
+            m_progressUpdated.remove(location);
+            m_pendingProgress.remove(location);
+            endRemoveRows();
+        }
+    }
+
+    int row = 0;
+    for (const QString &location : locations) {
+        if (kept.contains(location)) {
+            if (m_attachmentsList.at(row).location != location) {
+                // Reordered, not worth tracking row moves
+                m_rows.clear();
+                resetModel();
+                return;
+            }
+
+            const Attachment part = m_message->attachmentPart(location);
+            QVector<int> roles = changedPartRoles(m_attachmentsList.at(row), part);
+            if (!roles.isEmpty()) {
+                // Content may have been downloaded, the saved file is looked up again
+                const Attachment item = m_message->attachment(location);
+                Attachment &current = m_attachmentsList[row];
+                if (current.status != item.status)
+                    roles << StatusInfo;
+                if (current.url != item.url)
+                    roles << Url;
+                current = item;
+                watchDirectory(item.url);
+                emitRowChanged(row, roles);
+            }
+            ++row;
+        } else {
+            const Attachment item = m_message->attachment(location);
+            if (!item.location.isEmpty()) {
+                beginInsertRows(QModelIndex(), row, row);
+                m_attachmentsList.insert(row, item);
+                endInsertRows();
+                watchDirectory(item.url);
+                ++row;
+            }
+        }
+    }
+
+    m_rows.clear();
+    for (int i = 0; i < m_attachmentsList.count(); ++i) {
+        m_rows.insert(m_attachmentsList.at(i).location, i);
+    }
+    subscribe();
+
+    if (m_attachmentsList.count() != oldCount) {
+        emit countChanged();
+    }
+}
+
+void AttachmentListModel::watchDirectory(const QString &url)
+{
+    const QUrl fileUrl(url);
+    if (fileUrl.isValid() && fileUrl.isLocalFile()) {
+        const QString dir = QFileInfo(fileUrl.path()).dir().path();
+        if (!m_attachmentFileWatcher->directories().contains(dir)) {
+            m_attachmentFileWatcher->addPath(dir);
+        }
+    }
+}
+
 void AttachmentListModel::resetModel()
 {
     beginResetModel();
+    unsubscribe();
     m_attachmentsList.clear();
+    m_rows.clear();
+    m_progressUpdated.clear();
+    m_pendingProgress.clear();
     const QStringList dirs = m_attachmentFileWatcher->directories();
     if (!dirs.isEmpty()) {
         m_attachmentFileWatcher->removePaths(dirs);
@@ -221,14 +471,13 @@ void AttachmentListModel::resetModel()
             Attachment item = m_message->attachment(location);
 
             if (!item.location.isEmpty()) {
-                QUrl url(item.url);
-                if (url.isValid() && url.isLocalFile()) {
-                    m_attachmentFileWatcher->addPath(QFileInfo(url.path()).dir().path());
-                }
+                watchDirectory(item.url);
+                m_rows.insert(item.location, m_attachmentsList.count());
                 m_attachmentsList.append(item);
             }
         }
     }
+    subscribe();
     endResetModel();
     emit countChanged();
 }
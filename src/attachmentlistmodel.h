@@ -11,7 +11,10 @@
 #define EMAILATTACHMENTLISTMODEL_H
 
 #include <QAbstractListModel>
+#include <QElapsedTimer>
 #include <QFileSystemWatcher>
+#include <QSet>
+#include <QTimer>
 
 #include <qmailmessage.h>
 #include "emailagent.h"
@@ -22,6 +25,7 @@ class Q_DECL_EXPORT AttachmentListModel : public QAbstractListModel
 {
     Q_OBJECT
     Q_PROPERTY(int count READ count NOTIFY countChanged)
+    Q_PROPERTY(int progressInterval READ progressInterval WRITE setProgressInterval NOTIFY progressIntervalChanged)
     Q_ENUMS(AttachmentType);
 
 public:
@@ -73,24 +77,46 @@ public:
 
     int count() const;
 
+    // Shortest time between progress updates of one attachment, in milliseconds
+    int progressInterval() const;
+    void setProgressInterval(int interval);
+
 protected:
     QHash<int, QByteArray> roleNames() const override;
 
 signals:
     void countChanged();
+    void progressIntervalChanged();
 
 private slots:
-    void onAttachmentDownloadStatusChanged(const QString &attachmentLocation, EmailAgent::AttachmentStatus status);
-    void onAttachmentDownloadProgressChanged(const QString &attachmentLocation, double progress);
-    void onAttachmentPathChanged(const QString &attachmentLocation, const QString &path);
     void onMessagesUpdated(const QMailMessageIdList &ids);
     void onDirectoryChanged(const QString &path);
+    void flushProgress();
+    void refresh();
 
 private:
+    // Delivers the attachment updates of EmailAgent to the models showing the attachment
+    class Router;
+
     EmailMessage *m_message;
     QList<Attachment> m_attachmentsList;
+    // Rows by attachment location
+    QHash<QString, int> m_rows;
     QFileSystemWatcher *m_attachmentFileWatcher;
+    int m_progressInterval;
+    QElapsedTimer m_progressClock;
+    QTimer m_progressTimer;
+    // Time of the last progress update by location, and the locations with an update held back
+    QHash<QString, qint64> m_progressUpdated;
+    QSet<QString> m_pendingProgress;
 
+    void onAttachmentDownloadStatusChanged(const QString &attachmentLocation, EmailAgent::AttachmentStatus status);
+    void onAttachmentDownloadProgressChanged(const QString &attachmentLocation, double progress);
+    void onAttachmentPathChanged(const QString &attachmentLocation, const QString &path);
+    void emitRowChanged(int row, const QVector<int> &roles);
+    void subscribe();
+    void unsubscribe();
+    void watchDirectory(const QString &url);
     void resetModel();
 };
 
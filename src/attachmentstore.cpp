@@ -0,0 +1,291 @@
+/*
+ * Copyright (c) 2020 Open Mobile Platform LLC.
+ *
+ * This program is licensed under the terms and conditions of the
+ * Apache License, version 2.0.  The full text of the Apache License is at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include <QDataStream>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QSet>
+
+#include <qmailstore.h>
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <linux/fs.h>
+
+#include "attachmentstore.h"
+#include "logging_p.h"
+
+namespace {
+
+const quint32 IndexVersion = 1;
+
+// Hardlink, or a copy-on-write clone where the filesystem cannot link
+// (e.g. the link count of the file is exhausted)
+bool shareFile(const QString &source, const QString &target)
+{
+    const QByteArray sourceName = QFile::encodeName(source);
+    const QByteArray targetName = QFile::encodeName(target);
+    if (::link(sourceName.constData(), targetName.constData()) == 0) {
+        return true;
+    }
+
+#ifdef FICLONE
+    const int in = ::open(sourceName.constData(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        return false;
+    }
+    const int out = ::open(targetName.constData(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (out < 0) {
+        ::close(in);
+        return false;
+    }
+    const bool cloned = ::ioctl(out, FICLONE, in) == 0;
+    ::close(out);
+    ::close(in);
+    if (cloned) {
+        return true;
+    }
+    ::unlink(targetName.constData());
+#endif
+    return false;
+}
+
+}
+
+AttachmentStore::AttachmentStore(const QString &root, QObject *parent)
+    : QObject(parent)
+    , m_root(root)
+    , m_indexPath(root + QLatin1String("/.index"))
+    , m_indexLock(root + QLatin1String("/.index.lock"))
+{
+    QDir().mkpath(m_root);
+    if (lockIndex()) {
+        load();
+        // Messages removed while no process was watching
+        if (releaseRemovedMessages()) {
+            save();
+        }
+        m_indexLock.unlock();
+    }
+    connect(QMailStore::instance(), &QMailStore::messagesRemoved,
+            this, &AttachmentStore::onMessagesRemoved);
+}
+
+QString AttachmentStore::temporaryDirectory() const
+{
+    return m_root + QLatin1String("/.incoming");
+}
+
+QString AttachmentStore::add(const QString &file, const QByteArray &digest, const QString &name,
+                             const QMailMessageId &messageId, const QString &attachmentLocation)
+{
+    QString fileName = QString(name).remove('/');
+    if (fileName.isEmpty() || fileName.startsWith('.')) {
+        fileName.prepend(QStringLiteral("attachment"));
+    }
+
+    if (!lockIndex()) {
+        QFile::remove(file);
+        return QString();
+    }
+    // Other processes may have changed the references meanwhile
+    load();
+
+    const QString directory = m_root + '/' + QString::fromLatin1(digest.toHex());
+    const QString target = directory + '/' + fileName;
+    QDir().mkpath(directory);
+
+    if (QFile::exists(target)) {
+        // Same content under the same name, nothing to keep
+        QFile::remove(file);
+    } else {
+        const QStringList existing = QDir(directory).entryList(QDir::Files);
+        if (!existing.isEmpty() && shareFile(directory + '/' + existing.first(), target)) {
+            qCDebug(lcEmail) << "Attachment" << attachmentLocation << "shares content with" << existing.first();
+            QFile::remove(file);
+        } else if (!QFile::rename(file, target)) {
+            qCWarning(lcEmail) << "Cannot move attachment" << file << "to" << target;
+            QFile::remove(file);
+            if (existing.isEmpty()) {
+                QDir().rmdir(directory);
+            }
+            m_indexLock.unlock();
+            return QString();
+        }
+    }
+
+    Reference reference;
+    reference.messageId = messageId;
+    reference.path = target;
+    addReference(attachmentLocation, reference);
+    save();
+    m_indexLock.unlock();
+    return target;
+}
+
+void AttachmentStore::onMessagesRemoved(const QMailMessageIdList &ids)
+{
+    if (!lockIndex()) {
+        return;
+    }
+    load();
+
+    bool changed = false;
+    for (const QMailMessageId &id : ids) {
+        const QStringList locations = m_messageLocations.value(id);
+        for (const QString &location : locations) {
+            releaseReference(location);
+            changed = true;
+        }
+    }
+    if (changed) {
+        save();
+    }
+    m_indexLock.unlock();
+}
+
+bool AttachmentStore::lockIndex()
+{
+    // The index is shared by all processes using the plugin
+    if (!m_indexLock.lock()) {
+        qCWarning(lcEmail) << "Cannot lock attachment store index" << m_indexPath << m_indexLock.error();
+        return false;
+    }
+    return true;
+}
+
+bool AttachmentStore::releaseRemovedMessages()
+{
+    if (m_messageLocations.isEmpty()) {
+        return false;
+    }
+
+    QSet<QMailMessageId> existing;
+    const QMailMessageIdList ids = m_messageLocations.keys();
+    for (const QMailMessageId &id : QMailStore::instance()->queryMessages(QMailMessageKey::id(ids))) {
+        existing.insert(id);
+    }
+
+    bool changed = false;
+    for (const QMailMessageId &id : ids) {
+        if (!existing.contains(id)) {
+            for (const QString &location : m_messageLocations.value(id)) {
+                releaseReference(location);
+            }
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+void AttachmentStore::insertReference(const QString &attachmentLocation, const Reference &reference)
+{
+    m_references.insert(attachmentLocation, reference);
+    ++m_referenceCounts[reference.path];
+    m_messageLocations[reference.messageId].append(attachmentLocation);
+}
+
+void AttachmentStore::addReference(const QString &attachmentLocation, const Reference &reference)
+{
+    auto it = m_references.constFind(attachmentLocation);
+    if (it != m_references.constEnd() && it->path == reference.path) {
+        return;
+    }
+    // Saved again, e.g. after the file was modified outside of the store
+    releaseReference(attachmentLocation);
+    insertReference(attachmentLocation, reference);
+}
+
+void AttachmentStore::releaseReference(const QString &attachmentLocation)
+{
+    auto it = m_references.find(attachmentLocation);
+    if (it == m_references.end()) {
+        return;
+    }
+
+    const Reference reference = it.value();
+    m_references.erase(it);
+
+    auto locations = m_messageLocations.find(reference.messageId);
+    if (locations != m_messageLocations.end()) {
+        locations->removeOne(attachmentLocation);
+        if (locations->isEmpty()) {
+            m_messageLocations.erase(locations);
+        }
+    }
+
+    if (--m_referenceCounts[reference.path] > 0) {
+        return;
+    }
+
+    m_referenceCounts.remove(reference.path);
+    qCDebug(lcEmail) << "Removing unreferenced attachment" << reference.path;
+    QFile::remove(reference.path);
+    // Gone with its last name
+    QDir().rmdir(QFileInfo(reference.path).absolutePath());
+}
+
+void AttachmentStore::load()
+{
+    m_references.clear();
+    m_referenceCounts.clear();
+    m_messageLocations.clear();
+
+    QFile file(m_indexPath);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_6);
+    quint32 version;
+    stream >> version;
+    if (version != IndexVersion) {
+        qCWarning(lcEmail) << "Unknown attachment store index version" << version;
+        return;
+    }
+
+    while (!stream.atEnd()) {
+        QString location;
+        quint64 messageId;
+        Reference reference;
+        stream >> location >> messageId >> reference.path;
+        if (stream.status() != QDataStream::Ok) {
+            qCWarning(lcEmail) << "Attachment store index truncated at offset" << file.pos();
+            break;
+        }
+        reference.messageId = QMailMessageId(messageId);
+        // Never releases anything, a location is written once
+        if (!m_references.contains(location)) {
+            insertReference(location, reference);
+        }
+    }
+}
+
+void AttachmentStore::save()
+{
+    QSaveFile file(m_indexPath);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qCWarning(lcEmail) << "Cannot write attachment store index" << m_indexPath << file.errorString();
+        return;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_6);
+    stream << IndexVersion;
+    for (auto it = m_references.constBegin(); it != m_references.constEnd(); ++it) {
+        stream << it.key() << quint64(it->messageId.toULongLong()) << it->path;
+    }
+
+    if (!file.commit()) {
+        qCWarning(lcEmail) << "Cannot write attachment store index" << m_indexPath << file.errorString();
+    }
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2020 Open Mobile Platform LLC.
+ *
+ * This program is licensed under the terms and conditions of the
+ * Apache License, version 2.0.  The full text of the Apache License is at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ATTACHMENTSTORE_H
+#define ATTACHMENTSTORE_H
+
+#include <QHash>
+#include <QLockFile>
+#include <QObject>
+#include <QStringList>
+
+#include <qmailmessage.h>
+
+// Saved attachments addressed by the MD5 digest of their content, stored as
+// <root>/<digest>/<name>. The same content saved again, also from another
+// message or under another name, is linked to the existing file instead of
+// being written twice. Files are referenced by attachment location and
+// removed once no message refers to them anymore. The index of references
+// is shared by all processes, it is read again under a lock file before
+// every change.
+class AttachmentStore : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit AttachmentStore(const QString &root, QObject *parent = nullptr);
+
+    // Where new files are written before add() moves them into the store
+    QString temporaryDirectory() const;
+
+    // Takes over the written file, returns the path in the store or an
+    // empty string if it could not be stored
+    QString add(const QString &file, const QByteArray &digest, const QString &name,
+                const QMailMessageId &messageId, const QString &attachmentLocation);
+
+private slots:
+    void onMessagesRemoved(const QMailMessageIdList &ids);
+
+private:
+    struct Reference {
+        QMailMessageId messageId;
+        QString path;
+    };
+
+    bool lockIndex();
+    bool releaseRemovedMessages();
+    void insertReference(const QString &attachmentLocation, const Reference &reference);
+    void addReference(const QString &attachmentLocation, const Reference &reference);
+    void releaseReference(const QString &attachmentLocation);
+    void load();
+    void save();
+
+    QString m_root;
+    QString m_indexPath;
+    QLockFile m_indexLock;
+    // Stored file of each attachment location
+    QHash<QString, Reference> m_references;
+    QHash<QString, int> m_referenceCounts;
+    QHash<QMailMessageId, QStringList> m_messageLocations;
+};
+
+#endif
@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2020 Open Mobile Platform LLC.
+ *
+ * This program is licensed under the terms and conditions of the
+ * Apache License, version 2.0.  The full text of the Apache License is at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include <QCryptographicHash>
+#include <QFile>
+#include <QFutureWatcher>
+#include <QtConcurrent>
+
+#include <sys/stat.h>
+
+#include "attachmentverifier.h"
+#include "logging_p.h"
+
+namespace {
+
+struct HashResult {
+    AttachmentVerifier::FileStamp stamp;
+    QString checksum;
+};
+
+HashResult hashFile(const QString &path)
+{
+    HashResult result;
+    const AttachmentVerifier::FileStamp before = AttachmentVerifier::stamp(path);
+    const QString checksum = AttachmentVerifier::checksum(path);
+    // Written to while hashing, the checksum means nothing
+    if (before.isValid() && before == AttachmentVerifier::stamp(path)) {
+        result.stamp = before;
+        result.checksum = checksum;
+    }
+    return result;
+}
+
+}
+
+bool AttachmentVerifier::FileStamp::operator==(const FileStamp &other) const
+{
+    return size == other.size && modified == other.modified && inode == other.inode;
+}
+
+AttachmentVerifier::AttachmentVerifier(QObject *parent)
+    : QObject(parent)
+{
+}
+
+AttachmentVerifier::Result AttachmentVerifier::verify(const QString &path, const QString &expected)
+{
+    const FileStamp fileStamp = stamp(path);
+    if (!fileStamp.isValid()) {
+        return Mismatch;
+    }
+
+    QString known;
+    if (cached(path, fileStamp, &known)) {
+        return known == expected ? Matches : Mismatch;
+    }
+
+    if (!m_hashing.contains(path)) {
+        m_hashing.insert(path);
+        QFutureWatcher<HashResult> *watcher = new QFutureWatcher<HashResult>(this);
+        connect(watcher, &QFutureWatcherBase::finished, this, [this, watcher, path] {
+            const HashResult result = watcher->result();
+            watcher->deleteLater();
+            m_hashing.remove(path);
+            if (result.stamp.isValid()) {
+                Entry &entry = m_cache[path];
+                entry.stamp = result.stamp;
+                entry.checksum = result.checksum;
+            } else {
+                qCDebug(lcEmail) << "Attachment changed while verifying:" << path;
+                m_cache.remove(path);
+            }
+            emit verified(path);
+        });
+        watcher->setFuture(QtConcurrent::run(hashFile, path));
+    }
+    return Pending;
+}
+
+void AttachmentVerifier::insert(const QString &path, const QString &checksum)
+{
+    const FileStamp fileStamp = stamp(path);
+    if (fileStamp.isValid()) {
+        Entry &entry = m_cache[path];
+        entry.stamp = fileStamp;
+        entry.checksum = checksum;
+    }
+}
+
+AttachmentVerifier::FileStamp AttachmentVerifier::stamp(const QString &path)
+{
+    FileStamp fileStamp;
+    struct stat info;
+    if (!path.isEmpty() && ::stat(QFile::encodeName(path).constData(), &info) == 0) {
+        fileStamp.size = info.st_size;
+        fileStamp.modified = qint64(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+        fileStamp.inode = info.st_ino;
+    }
+    return fileStamp;
+}
+
+QString AttachmentVerifier::checksum(const QString &path)
+{
+    QFile f(path);
+    if (f.open(QFile::ReadOnly)) {
+        QCryptographicHash hash(QCryptographicHash::Md5);
+        hash.addData(&f);
+        return QString::fromUtf8(hash.result());
+    }
+    return QString();
+}
+
+bool AttachmentVerifier::cached(const QString &path, const FileStamp &stamp, QString *checksum) const
+{
+    auto it = m_cache.constFind(path);
+    if (it == m_cache.constEnd() || it->stamp != stamp) {
+        return false;
+    }
+    *checksum = it->checksum;
+    return true;
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2020 Open Mobile Platform LLC.
+ *
+ * This program is licensed under the terms and conditions of the
+ * Apache License, version 2.0.  The full text of the Apache License is at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ATTACHMENTVERIFIER_H
+#define ATTACHMENTVERIFIER_H
+
+#include <QHash>
+#include <QObject>
+#include <QSet>
+#include <QString>
+
+// Checksums of saved attachment files, keyed by path and validated with the
+// size, modification time and inode of the file. An unchanged file is never
+// hashed twice. Hashing for verify() runs on the global thread pool and
+// verified() tells when the result is available.
+class AttachmentVerifier : public QObject
+{
+    Q_OBJECT
+
+public:
+    enum Result {
+        Pending,
+        Matches,
+        Mismatch
+    };
+
+    struct FileStamp {
+        qint64 size = -1;
+        qint64 modified = 0; // nanoseconds
+        quint64 inode = 0;
+
+        bool isValid() const { return size >= 0; }
+        bool operator==(const FileStamp &other) const;
+        bool operator!=(const FileStamp &other) const { return !(*this == other); }
+    };
+
+    explicit AttachmentVerifier(QObject *parent = nullptr);
+
+    // Pending if the file needs hashing, verified() follows
+    Result verify(const QString &path, const QString &expected);
+    // Checksum of a file that was just written
+    void insert(const QString &path, const QString &checksum);
+
+    static FileStamp stamp(const QString &path);
+    static QString checksum(const QString &path);
+
+signals:
+    void verified(const QString &path);
+
+private:
+    struct Entry {
+        FileStamp stamp;
+        QString checksum;
+    };
+
+    bool cached(const QString &path, const FileStamp &stamp, QString *checksum) const;
+
+    QHash<QString, Entry> m_cache;
+    QSet<QString> m_hashing;
+};
+
+#endif
@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2020 Open Mobile Platform LLC.
+ *
+ * This program is licensed under the terms and conditions of the
+ * Apache License, version 2.0.  The full text of the Apache License is at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include <functional>
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QFutureWatcher>
+#include <QtConcurrent>
+
+#include "attachmentwriter.h"
+#include "emailutils.h"
+#include "logging_p.h"
+
+namespace {
+
+struct WriteJob {
+    QString partLocation;
+    QMailMessagePart part;
+    QString filename;
+    QSharedPointer<QAtomicInt> cancelled;
+};
+
+struct WriteResult {
+    QString filename;
+    QByteArray digest;
+};
+
+// Decoded output, hashed as it is written. Reports how much has been
+// written and fails the writes once cancelled.
+class HashingFile : public QFile
+{
+public:
+    HashingFile(const QString &name, const std::function<bool(qint64)> &progress)
+        : QFile(name)
+        , m_hash(QCryptographicHash::Md5)
+        , m_progress(progress)
+        , m_written(0)
+    {
+    }
+
+    QByteArray digest() const
+    {
+        return m_hash.result();
+    }
+
+protected:
+    qint64 writeData(const char *data, qint64 len) override
+    {
+        if (!m_progress(m_written)) {
+            return -1;
+        }
+        const qint64 written = QFile::writeData(data, len);
+        if (written > 0) {
+            m_hash.addData(data, int(written));
+            m_written += written;
+        }
+        return written;
+    }
+
+private:
+    QCryptographicHash m_hash;
+    std::function<bool(qint64)> m_progress;
+    qint64 m_written;
+};
+
+WriteResult writePart(AttachmentWriter *writer, WriteJob job)
+{
+    WriteResult result;
+
+    const qint64 total = attachmentSize(job.part);
+    qint64 reported = 0;
+    HashingFile file(job.filename, [&](qint64 position) {
+        if (job.cancelled->load()) {
+            return false;
+        }
+        // Reported in steps of a percent
+        if (total > 0 && (position - reported) * 100 >= total) {
+            reported = position;
+            emit writer->progressChanged(job.partLocation, qMin(1.0, double(position) / total));
+        }
+        return true;
+    });
+    if (!file.open(QIODevice::WriteOnly)) {
+        qCWarning(lcEmail) << "Cannot write attachment" << job.filename << file.errorString();
+        return result;
+    }
+
+    // Read from the stored content and decoded in chunks on the way to the file
+    QDataStream out(&file);
+    const bool streamed = job.part.body().toStream(out, QMailMessageBody::Decoded);
+    file.close();
+
+    if (job.cancelled->load() || !streamed || file.error() != QFileDevice::NoError
+            || out.status() != QDataStream::Ok) {
+        if (!job.cancelled->load()) {
+            qCWarning(lcEmail) << "Failed to write attachment" << job.filename << file.errorString();
+        }
+        QFile::remove(job.filename);
+        return result;
+    }
+
+    emit writer->progressChanged(job.partLocation, 1.0);
+    result.filename = job.filename;
+    result.digest = file.digest();
+    return result;
+}
+
+}
+
+AttachmentWriter::AttachmentWriter(QObject *parent)
+    : QObject(parent)
+{
+}
+
+bool AttachmentWriter::write(const QString &partLocation, const QMailMessagePart &part, const QString &directory)
+{
+    if (m_writing.contains(partLocation)) {
+        return false;
+    }
+
+    QDir().mkpath(directory);
+    QString name = part.displayName().remove('/');
+    if (name.isEmpty()) {
+        name = QStringLiteral("attachment");
+    }
+
+    WriteJob job;
+    job.partLocation = partLocation;
+    // Shared copy, the content is read only by the worker
+    job.part = part;
+    job.filename = reserveFilename(directory, name);
+    job.cancelled.reset(new QAtomicInt(0));
+    m_writing.insert(partLocation, job.cancelled);
+
+    const QString filename = job.filename;
+    QFutureWatcher<WriteResult> *watcher = new QFutureWatcher<WriteResult>(this);
+    connect(watcher, &QFutureWatcherBase::finished, this, [this, watcher, partLocation, filename] {
+        const WriteResult result = watcher->result();
+        watcher->deleteLater();
+        m_reservedFilenames.remove(filename);
+        m_writing.remove(partLocation);
+        emit finished(partLocation, result.filename, result.digest);
+    });
+    watcher->setFuture(QtConcurrent::run(writePart, this, job));
+    return true;
+}
+
+bool AttachmentWriter::isWriting(const QString &partLocation) const
+{
+    return m_writing.contains(partLocation);
+}
+
+void AttachmentWriter::cancel(const QString &partLocation)
+{
+    const QSharedPointer<QAtomicInt> cancelled = m_writing.value(partLocation);
+    if (cancelled) {
+        cancelled->store(1);
+    }
+}
+
+QString AttachmentWriter::reserveFilename(const QString &directory, const QString &name)
+{
+    // Files being written may not exist yet, they are reserved by name
+    const QFileInfo info(name);
+    QString filename = directory + '/' + name;
+    for (int i = 1; QFile::exists(filename) || m_reservedFilenames.contains(filename); ++i) {
+        filename = directory + '/' + info.completeBaseName() + QStringLiteral(" (%1)").arg(i);
+        if (!info.suffix().isEmpty()) {
+            filename += '.' + info.suffix();
+        }
+    }
+    m_reservedFilenames.insert(filename);
+    return filename;
+}
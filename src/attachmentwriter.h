@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2020 Open Mobile Platform LLC.
+ *
+ * This program is licensed under the terms and conditions of the
+ * Apache License, version 2.0.  The full text of the Apache License is at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ATTACHMENTWRITER_H
+#define ATTACHMENTWRITER_H
+
+#include <QAtomicInt>
+#include <QHash>
+#include <QObject>
+#include <QSet>
+#include <QSharedPointer>
+
+#include <qmailmessage.h>
+
+// Saves attachment parts to files on the global thread pool. The stored
+// content is read and its transfer encoding decoded in chunks straight into
+// the file, so no copy of the part is held in memory, and the MD5 digest is
+// computed on the way.
+class AttachmentWriter : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit AttachmentWriter(QObject *parent = nullptr);
+
+    // False if the part is already being written
+    bool write(const QString &partLocation, const QMailMessagePart &part, const QString &directory);
+    bool isWriting(const QString &partLocation) const;
+    void cancel(const QString &partLocation);
+
+signals:
+    void progressChanged(const QString &partLocation, double progress);
+    // Empty filename if writing failed or was cancelled
+    void finished(const QString &partLocation, const QString &filename, const QByteArray &digest);
+
+private:
+    QString reserveFilename(const QString &directory, const QString &name);
+
+    QHash<QString, QSharedPointer<QAtomicInt> > m_writing;
+    QSet<QString> m_reservedFilenames;
+};
+
+#endif
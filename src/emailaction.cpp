@@ -7,10 +7,14 @@
  * http://www.apache.org/licenses/LICENSE-2.0
  */
 
+#include <QSet>
+
 #include "emailaction.h"
 #include "emailagent.h"
 #include "logging_p.h"
 
+namespace {
+
 template<typename T>
 QString idListToString(const QList<T> &ids)
 {
@@ -28,14 +32,74 @@ QString idListToString(const QList<T> &ids)
     return idsList;
 }
 
+template<typename T>
+void appendArgument(QByteArray *arguments, T value)
+{
+    arguments->append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+void appendArgument(QByteArray *arguments, const QString &value)
+{
+    appendArgument(arguments, value.size());
+    arguments->append(reinterpret_cast<const char *>(value.constData()), value.size() * int(sizeof(QChar)));
+}
+
+template<typename T>
+void appendIds(QByteArray *arguments, const QList<T> &ids)
+{
+    arguments->reserve(arguments->size() + ids.size() * int(sizeof(quint64)));
+    for (const T &id : ids) {
+        appendArgument(arguments, quint64(id.toULongLong()));
+    }
+}
+
+// Adds the ids not listed yet, the ids are packed last in the key
+void mergeIds(QMailMessageIdList *ids, EmailActionKey *key, const QMailMessageIdList &newIds)
+{
+    QSet<QMailMessageId> known = ids->toSet();
+    for (const QMailMessageId &id : newIds) {
+        if (!known.contains(id)) {
+            known.insert(id);
+            ids->append(id);
+            appendArgument(&key->arguments, quint64(id.toULongLong()));
+        }
+    }
+}
+
+}
+
+/*
+  EmailActionKey
+*/
+bool EmailActionKey::operator==(const EmailActionKey &other) const
+{
+    return kind == other.kind
+            && accountId == other.accountId
+            && folderId == other.folderId
+            && arguments == other.arguments;
+}
+
+uint qHash(const EmailActionKey &key, uint seed)
+{
+    uint hash = qHash(key.kind, seed);
+    hash ^= qHash(key.accountId, seed) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+    hash ^= qHash(key.folderId, seed) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+    hash ^= qHash(key.arguments, seed) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+    return hash;
+}
+
 /*
   EmailAction
 */
 EmailAction::EmailAction(bool onlineAction)
-    : _description(QString())
-    , _type(Export)
+    : _type(Export)
     , _id(0)
+    , _priority(onlineAction ? BackgroundSyncPriority : InteractivePriority)
+    , _maxRetries(onlineAction ? 3 : 0)
     , _onlineAction(onlineAction)
+    , _enqueueTime(0)
+    , _retryCount(0)
+    , _retryTime(0)
 {
 }
 
@@ -50,22 +114,50 @@ QMailAccountId EmailAction::accountId() const
 
 bool EmailAction::operator==(const EmailAction &action) const
 {
-    if (action._description.isEmpty() || _description.isEmpty()) {
+    if (action._key.isNull() || _key.isNull()) {
         return false;
     }
-    return (action._description == _description);
+    return (action._key == _key);
 }
 
 bool EmailAction::operator!=(const EmailAction &action) const
 {
-    return (action._description != _description);
+    return (action._key != _key);
 }
 
 QString EmailAction::description() const
 {
+    if (_description.isEmpty()) {
+        _description = formatDescription();
+    }
     return _description;
 }
 
+const EmailActionKey &EmailAction::key() const
+{
+    return _key;
+}
+
+bool EmailAction::merge(const EmailAction &action)
+{
+    if (!mergeAction(action)) {
+        return false;
+    }
+    _description.clear();
+    return true;
+}
+
+bool EmailAction::mergeAction(const EmailAction &action)
+{
+    Q_UNUSED(action)
+    return false;
+}
+
+QMailMessageIdList EmailAction::messageIds() const
+{
+    return QMailMessageIdList();
+}
+
 EmailAction::ActionType EmailAction::type() const
 {
     return _type;
@@ -81,6 +173,51 @@ void EmailAction::setId(const quint64 id)
     _id = id;
 }
 
+EmailAction::Priority EmailAction::priority() const
+{
+    return _priority;
+}
+
+void EmailAction::setPriority(Priority priority)
+{
+    _priority = priority;
+}
+
+qint64 EmailAction::enqueueTime() const
+{
+    return _enqueueTime;
+}
+
+void EmailAction::setEnqueueTime(qint64 msecs)
+{
+    _enqueueTime = msecs;
+}
+
+int EmailAction::maxRetries() const
+{
+    return _maxRetries;
+}
+
+int EmailAction::retryCount() const
+{
+    return _retryCount;
+}
+
+void EmailAction::setRetryCount(int count)
+{
+    _retryCount = count;
+}
+
+qint64 EmailAction::retryTime() const
+{
+    return _retryTime;
+}
+
+void EmailAction::setRetryTime(qint64 msecs)
+{
+    _retryTime = msecs;
+}
+
 /*
   CreateStandardFolders
 */
@@ -89,7 +226,8 @@ CreateStandardFolders::CreateStandardFolders(QMailRetrievalAction *retrievalActi
     , _retrievalAction(retrievalAction)
     , _accountId(id)
 {
-    _description = QString("create-standard-folders:account-id=%1").arg(_accountId.toULongLong());
+    _key.kind = QLatin1String("create-standard-folders");
+    _key.accountId = _accountId.toULongLong();
     _type = EmailAction::StandardFolders;
 }
 
@@ -97,6 +235,11 @@ CreateStandardFolders::~CreateStandardFolders()
 {
 }
 
+QString CreateStandardFolders::formatDescription() const
+{
+    return QString("create-standard-folders:account-id=%1").arg(_accountId.toULongLong());
+}
+
 void CreateStandardFolders::execute()
 {
     _retrievalAction->createStandardFolders(_accountId);
@@ -107,6 +250,11 @@ QMailServiceAction* CreateStandardFolders::serviceAction() const
     return _retrievalAction;
 }
 
+void CreateStandardFolders::setServiceAction(QMailServiceAction *serviceAction)
+{
+    _retrievalAction = static_cast<QMailRetrievalAction *>(serviceAction);
+}
+
 QMailAccountId CreateStandardFolders::accountId() const
 {
     return _accountId;
@@ -120,8 +268,8 @@ DeleteMessages::DeleteMessages(QMailStorageAction* storageAction, const QMailMes
     , _storageAction(storageAction)
     , _ids(ids)
 {
-    QString idsList = idListToString(_ids);
-    _description = QString("delete-messages:message-ids=%1").arg(idsList);
+    _key.kind = QLatin1String("delete-messages");
+    appendIds(&_key.arguments, _ids);
     _type = EmailAction::Storage;
 }
 
@@ -129,6 +277,22 @@ DeleteMessages::~DeleteMessages()
 {
 }
 
+QString DeleteMessages::formatDescription() const
+{
+    QString idsList = idListToString(_ids);
+    return QString("delete-messages:message-ids=%1").arg(idsList);
+}
+
+bool DeleteMessages::mergeAction(const EmailAction &action)
+{
+    const DeleteMessages *other = dynamic_cast<const DeleteMessages *>(&action);
+    if (!other) {
+        return false;
+    }
+    mergeIds(&_ids, &_key, other->_ids);
+    return true;
+}
+
 void DeleteMessages::execute()
 {
     _storageAction->deleteMessages(_ids);
@@ -139,6 +303,16 @@ QMailServiceAction* DeleteMessages::serviceAction() const
     return _storageAction;
 }
 
+void DeleteMessages::setServiceAction(QMailServiceAction *serviceAction)
+{
+    _storageAction = static_cast<QMailStorageAction *>(serviceAction);
+}
+
+QMailMessageIdList DeleteMessages::messageIds() const
+{
+    return _ids;
+}
+
 /*
   ExportUpdates
 */
@@ -147,14 +321,22 @@ ExportUpdates::ExportUpdates(QMailRetrievalAction *retrievalAction, const QMailA
     , _retrievalAction(retrievalAction)
     , _accountId(id)
 {
-    _description = QString("exporting-updates:account-id=%1").arg(_accountId.toULongLong());
+    _key.kind = QLatin1String("exporting-updates");
+    _key.accountId = _accountId.toULongLong();
     _type = EmailAction::Export;
+    // local changes are lost to the server if this is given up
+    _maxRetries = 5;
 }
 
 ExportUpdates::~ExportUpdates()
 {
 }
 
+QString ExportUpdates::formatDescription() const
+{
+    return QString("exporting-updates:account-id=%1").arg(_accountId.toULongLong());
+}
+
 void ExportUpdates::execute()
 {
     _retrievalAction->exportUpdates(_accountId);
@@ -165,6 +347,11 @@ QMailServiceAction* ExportUpdates::serviceAction() const
     return _retrievalAction;
 }
 
+void ExportUpdates::setServiceAction(QMailServiceAction *serviceAction)
+{
+    _retrievalAction = static_cast<QMailRetrievalAction *>(serviceAction);
+}
+
 QMailAccountId ExportUpdates::accountId() const
 {
     return _accountId;
@@ -181,9 +368,10 @@ FlagMessages::FlagMessages(QMailStorageAction* storageAction, const QMailMessage
     , _setMask(setMask)
     , _unsetMask(unsetMask)
 {
-    QString idsList = idListToString(_ids);
-    _description = QString("flag-messages:message-ids=%1;setMark=%2;unsetMark=%3").arg(idsList)
-            .arg(_setMask).arg(_unsetMask);
+    _key.kind = QLatin1String("flag-messages");
+    appendArgument(&_key.arguments, _setMask);
+    appendArgument(&_key.arguments, _unsetMask);
+    appendIds(&_key.arguments, _ids);
     _type = EmailAction::Storage;
 }
 
@@ -191,6 +379,23 @@ FlagMessages::~FlagMessages()
 {
 }
 
+QString FlagMessages::formatDescription() const
+{
+    QString idsList = idListToString(_ids);
+    return QString("flag-messages:message-ids=%1;setMark=%2;unsetMark=%3").arg(idsList)
+            .arg(_setMask).arg(_unsetMask);
+}
+
+bool FlagMessages::mergeAction(const EmailAction &action)
+{
+    const FlagMessages *other = dynamic_cast<const FlagMessages *>(&action);
+    if (!other || other->_setMask != _setMask || other->_unsetMask != _unsetMask) {
+        return false;
+    }
+    mergeIds(&_ids, &_key, other->_ids);
+    return true;
+}
+
 void FlagMessages::execute()
 {
     _storageAction->flagMessages(_ids, _setMask, _unsetMask);
@@ -201,6 +406,16 @@ QMailServiceAction* FlagMessages::serviceAction() const
     return _storageAction;
 }
 
+void FlagMessages::setServiceAction(QMailServiceAction *serviceAction)
+{
+    _storageAction = static_cast<QMailStorageAction *>(serviceAction);
+}
+
+QMailMessageIdList FlagMessages::messageIds() const
+{
+    return _ids;
+}
+
 /*
     MoveToFolder
 */
@@ -211,9 +426,9 @@ MoveToFolder::MoveToFolder(QMailStorageAction *storageAction, const QMailMessage
     , _ids(ids)
     , _destinationFolder(folderId)
 {
-    QString idsList = idListToString(_ids);
-    _description = QString("move-messages-to-folder:message-ids=%1;folder-id=%2").arg(idsList)
-            .arg(_destinationFolder.toULongLong());
+    _key.kind = QLatin1String("move-messages-to-folder");
+    _key.folderId = _destinationFolder.toULongLong();
+    appendIds(&_key.arguments, _ids);
     _type = EmailAction::Storage;
 }
 
@@ -221,6 +436,23 @@ MoveToFolder::~MoveToFolder()
 {
 }
 
+QString MoveToFolder::formatDescription() const
+{
+    QString idsList = idListToString(_ids);
+    return QString("move-messages-to-folder:message-ids=%1;folder-id=%2").arg(idsList)
+            .arg(_destinationFolder.toULongLong());
+}
+
+bool MoveToFolder::mergeAction(const EmailAction &action)
+{
+    const MoveToFolder *other = dynamic_cast<const MoveToFolder *>(&action);
+    if (!other || other->_destinationFolder != _destinationFolder) {
+        return false;
+    }
+    mergeIds(&_ids, &_key, other->_ids);
+    return true;
+}
+
 void MoveToFolder::execute()
 {
     _storageAction->moveToFolder(_ids, _destinationFolder);
@@ -231,6 +463,16 @@ QMailServiceAction* MoveToFolder::serviceAction() const
     return _storageAction;
 }
 
+void MoveToFolder::setServiceAction(QMailServiceAction *serviceAction)
+{
+    _storageAction = static_cast<QMailStorageAction *>(serviceAction);
+}
+
+QMailMessageIdList MoveToFolder::messageIds() const
+{
+    return _ids;
+}
+
 /*
    MoveToStandardFolder
 */
@@ -241,9 +483,9 @@ MoveToStandardFolder::MoveToStandardFolder(QMailStorageAction *storageAction,
     , _ids(ids)
     , _standardFolder(standardFolder)
 {
-    QString idsList = idListToString(_ids);
-    _description = QString("move-messages-to-standard-folder:message-ids=%1;standard-folder=%2").arg(idsList)
-            .arg(_standardFolder);
+    _key.kind = QLatin1String("move-messages-to-standard-folder");
+    appendArgument(&_key.arguments, int(_standardFolder));
+    appendIds(&_key.arguments, _ids);
     _type = EmailAction::Storage;
 }
 
@@ -251,6 +493,13 @@ MoveToStandardFolder::~MoveToStandardFolder()
 {
 }
 
+QString MoveToStandardFolder::formatDescription() const
+{
+    QString idsList = idListToString(_ids);
+    return QString("move-messages-to-standard-folder:message-ids=%1;standard-folder=%2").arg(idsList)
+            .arg(_standardFolder);
+}
+
 void MoveToStandardFolder::execute()
 {
     _storageAction->moveToStandardFolder(_ids, _standardFolder);
@@ -261,6 +510,16 @@ QMailServiceAction* MoveToStandardFolder::serviceAction() const
     return _storageAction;
 }
 
+void MoveToStandardFolder::setServiceAction(QMailServiceAction *serviceAction)
+{
+    _storageAction = static_cast<QMailStorageAction *>(serviceAction);
+}
+
+QMailMessageIdList MoveToStandardFolder::messageIds() const
+{
+    return _ids;
+}
+
 /*
   OnlineCreateFolder
 */
@@ -272,21 +531,32 @@ OnlineCreateFolder::OnlineCreateFolder(QMailStorageAction* storageAction, const
     , _accountId(id)
     , _parentId(parentId)
 {
-    QString pId;
-    if (_parentId.isValid()) {
-        pId = _parentId.toULongLong();
-    } else {
-        pId = "NULL";
-    }
-    _description = QString("create-folder:name=%1;account-id=%2;parent-id=%3").arg(_accountId.toULongLong())
-            .arg(_name).arg(pId);
+    _key.kind = QLatin1String("create-folder");
+    _key.accountId = _accountId.toULongLong();
+    _key.folderId = _parentId.toULongLong();
+    appendArgument(&_key.arguments, _name);
     _type = EmailAction::OnlineCreateFolder;
+    _priority = EmailAction::ForegroundRefreshPriority;
+    // failures are reported to the user right away
+    _maxRetries = 0;
 }
 
 OnlineCreateFolder::~OnlineCreateFolder()
 {
 }
 
+QString OnlineCreateFolder::formatDescription() const
+{
+    QString pId;
+    if (_parentId.isValid()) {
+        pId = QString::number(_parentId.toULongLong());
+    } else {
+        pId = "NULL";
+    }
+    return QString("create-folder:name=%1;account-id=%2;parent-id=%3").arg(_name)
+            .arg(_accountId.toULongLong()).arg(pId);
+}
+
 void OnlineCreateFolder::execute()
 {
     _storageAction->onlineCreateFolder(_name, _accountId, _parentId);
@@ -297,6 +567,11 @@ QMailServiceAction* OnlineCreateFolder::serviceAction() const
     return _storageAction;
 }
 
+void OnlineCreateFolder::setServiceAction(QMailServiceAction *serviceAction)
+{
+    _storageAction = static_cast<QMailStorageAction *>(serviceAction);
+}
+
 QMailAccountId OnlineCreateFolder::accountId() const
 {
     return _accountId;
@@ -310,14 +585,22 @@ OnlineDeleteFolder::OnlineDeleteFolder(QMailStorageAction* storageAction, const
     , _storageAction(storageAction)
     , _folderId(folderId)
 {
-    _description = QString("delete-folder:folder-id=%1").arg(_folderId.toULongLong());
+    _key.kind = QLatin1String("delete-folder");
+    _key.folderId = _folderId.toULongLong();
     _type = EmailAction::OnlineDeleteFolder;
+    _priority = EmailAction::ForegroundRefreshPriority;
+    _maxRetries = 0;
 }
 
 OnlineDeleteFolder::~OnlineDeleteFolder()
 {
 }
 
+QString OnlineDeleteFolder::formatDescription() const
+{
+    return QString("delete-folder:folder-id=%1").arg(_folderId.toULongLong());
+}
+
 void OnlineDeleteFolder::execute()
 {
     _storageAction->onlineDeleteFolder(_folderId);
@@ -328,6 +611,11 @@ QMailServiceAction* OnlineDeleteFolder::serviceAction() const
     return _storageAction;
 }
 
+void OnlineDeleteFolder::setServiceAction(QMailServiceAction *serviceAction)
+{
+    _storageAction = static_cast<QMailStorageAction *>(serviceAction);
+}
+
 QMailAccountId OnlineDeleteFolder::accountId() const
 {
     QMailFolder folder(_folderId);
@@ -344,16 +632,24 @@ OnlineMoveMessages::OnlineMoveMessages(QMailStorageAction *storageAction, const
     , _ids(ids)
     , _destinationId(destinationId)
 {
-    QString idsList = idListToString(_ids);
-    _description = QString("move-messages:message-ids=%1;destination-folder=%2").arg(idsList)
-            .arg(_destinationId.toULongLong());
+    _key.kind = QLatin1String("move-messages");
+    _key.folderId = _destinationId.toULongLong();
+    appendIds(&_key.arguments, _ids);
     _type = EmailAction::Storage;
+    _priority = EmailAction::ForegroundRefreshPriority;
 }
 
 OnlineMoveMessages::~OnlineMoveMessages()
 {
 }
 
+QString OnlineMoveMessages::formatDescription() const
+{
+    QString idsList = idListToString(_ids);
+    return QString("move-messages:message-ids=%1;destination-folder=%2").arg(idsList)
+            .arg(_destinationId.toULongLong());
+}
+
 void OnlineMoveMessages::execute()
 {
     _storageAction->onlineMoveMessages(_ids, _destinationId);
@@ -364,6 +660,16 @@ QMailServiceAction* OnlineMoveMessages::serviceAction() const
     return _storageAction;
 }
 
+void OnlineMoveMessages::setServiceAction(QMailServiceAction *serviceAction)
+{
+    _storageAction = static_cast<QMailStorageAction *>(serviceAction);
+}
+
+QMailMessageIdList OnlineMoveMessages::messageIds() const
+{
+    return _ids;
+}
+
 /*
   OnlineRenameFolder
 */
@@ -373,14 +679,23 @@ OnlineRenameFolder::OnlineRenameFolder(QMailStorageAction* storageAction, const
     , _folderId(folderId)
     , _name(name)
 {
-    _description = QString("rename-folder:folder-id=%1;new-name=%2").arg(_folderId.toULongLong()).arg(_name);
+    _key.kind = QLatin1String("rename-folder");
+    _key.folderId = _folderId.toULongLong();
+    appendArgument(&_key.arguments, _name);
     _type = EmailAction::OnlineRenameFolder;
+    _priority = EmailAction::ForegroundRefreshPriority;
+    _maxRetries = 0;
 }
 
 OnlineRenameFolder::~OnlineRenameFolder()
 {
 }
 
+QString OnlineRenameFolder::formatDescription() const
+{
+    return QString("rename-folder:folder-id=%1;new-name=%2").arg(_folderId.toULongLong()).arg(_name);
+}
+
 void OnlineRenameFolder::execute()
 {
     _storageAction->onlineRenameFolder(_folderId, _name);
@@ -391,6 +706,11 @@ QMailServiceAction* OnlineRenameFolder::serviceAction() const
     return _storageAction;
 }
 
+void OnlineRenameFolder::setServiceAction(QMailServiceAction *serviceAction)
+{
+    _storageAction = static_cast<QMailStorageAction *>(serviceAction);
+}
+
 QMailAccountId OnlineRenameFolder::accountId() const
 {
     QMailFolder folder(_folderId);
@@ -406,14 +726,23 @@ OnlineMoveFolder::OnlineMoveFolder(QMailStorageAction* storageAction, const QMai
     , _folderId(folderId)
     , _newParentId(newParentId)
 {
-    _description = QString("move-folder:folder-id=%1;new-parent=%2").arg(_folderId.toULongLong()).arg(_newParentId.toULongLong());
+    _key.kind = QLatin1String("move-folder");
+    _key.folderId = _folderId.toULongLong();
+    appendArgument(&_key.arguments, quint64(_newParentId.toULongLong()));
     _type = EmailAction::OnlineMoveFolder;
+    _priority = EmailAction::ForegroundRefreshPriority;
+    _maxRetries = 0;
 }
 
 OnlineMoveFolder::~OnlineMoveFolder()
 {
 }
 
+QString OnlineMoveFolder::formatDescription() const
+{
+    return QString("move-folder:folder-id=%1;new-parent=%2").arg(_folderId.toULongLong()).arg(_newParentId.toULongLong());
+}
+
 void OnlineMoveFolder::execute()
 {
     _storageAction->onlineMoveFolder(_folderId, _newParentId);
@@ -424,6 +753,11 @@ QMailServiceAction* OnlineMoveFolder::serviceAction() const
     return _storageAction;
 }
 
+void OnlineMoveFolder::setServiceAction(QMailServiceAction *serviceAction)
+{
+    _storageAction = static_cast<QMailStorageAction *>(serviceAction);
+}
+
 QMailAccountId OnlineMoveFolder::accountId() const
 {
     QMailFolder folder(_folderId);
@@ -440,21 +774,28 @@ RetrieveFolderList::RetrieveFolderList(QMailRetrievalAction* retrievalAction, co
     , _accountId(id)
     , _folderId(folderId)
     , _descending(descending)
+{
+    _key.kind = QLatin1String("retrieve-folder-list");
+    _key.accountId = _accountId.toULongLong();
+    _key.folderId = _folderId.toULongLong();
+    _type = EmailAction::RetrieveFolderList;
+}
+
+RetrieveFolderList::~RetrieveFolderList()
+{
+}
+
+QString RetrieveFolderList::formatDescription() const
 {
     QString fId;
     if (_folderId.isValid()) {
-        fId = _folderId.toULongLong();
+        fId = QString::number(_folderId.toULongLong());
     } else {
         fId = "NULL";
     }
-    _description = QString("retrieve-folder-list:account-id=%1;folder-id=%2")
+    return QString("retrieve-folder-list:account-id=%1;folder-id=%2")
             .arg(_accountId.toULongLong())
             .arg(fId);
-    _type = EmailAction::RetrieveFolderList;
-}
-
-RetrieveFolderList::~RetrieveFolderList()
-{
 }
 
 void RetrieveFolderList::execute()
@@ -467,6 +808,11 @@ QMailServiceAction* RetrieveFolderList::serviceAction() const
     return _retrievalAction;
 }
 
+void RetrieveFolderList::setServiceAction(QMailServiceAction *serviceAction)
+{
+    _retrievalAction = static_cast<QMailRetrievalAction *>(serviceAction);
+}
+
 QMailAccountId RetrieveFolderList::accountId() const
 {
     return _accountId;
@@ -484,9 +830,9 @@ RetrieveMessageList::RetrieveMessageList(QMailRetrievalAction* retrievalAction,
     , _minimum(minimum)
     , _sort(sort)
 {
-    _description = QString("retrieve-message-list:account-id=%1;folder-id=%2")
-            .arg(_accountId.toULongLong())
-            .arg(_folderId.toULongLong());
+    _key.kind = QLatin1String("retrieve-message-list");
+    _key.accountId = _accountId.toULongLong();
+    _key.folderId = _folderId.toULongLong();
     _type = EmailAction::Retrieve;
 }
 
@@ -494,6 +840,13 @@ RetrieveMessageList::~RetrieveMessageList()
 {
 }
 
+QString RetrieveMessageList::formatDescription() const
+{
+    return QString("retrieve-message-list:account-id=%1;folder-id=%2")
+            .arg(_accountId.toULongLong())
+            .arg(_folderId.toULongLong());
+}
+
 void RetrieveMessageList::execute()
 {
     _retrievalAction->retrieveMessageList(_accountId, _folderId, _minimum, _sort);
@@ -504,6 +857,11 @@ QMailServiceAction* RetrieveMessageList::serviceAction() const
     return _retrievalAction;
 }
 
+void RetrieveMessageList::setServiceAction(QMailServiceAction *serviceAction)
+{
+    _retrievalAction = static_cast<QMailRetrievalAction *>(serviceAction);
+}
+
 QMailAccountId RetrieveMessageList::accountId() const
 {
     return _accountId;
@@ -521,10 +879,9 @@ RetrieveMessageLists::RetrieveMessageLists(QMailRetrievalAction* retrievalAction
     , _minimum(minimum)
     , _sort(sort)
 {
-    QString ids = idListToString(_folderIds);
-    _description = QString("retrieve-message-lists:account-id=%1;folder-ids=%2")
-            .arg(_accountId.toULongLong())
-            .arg(ids);
+    _key.kind = QLatin1String("retrieve-message-lists");
+    _key.accountId = _accountId.toULongLong();
+    appendIds(&_key.arguments, _folderIds);
     _type = EmailAction::Retrieve;
 }
 
@@ -532,6 +889,14 @@ RetrieveMessageLists::~RetrieveMessageLists()
 {
 }
 
+QString RetrieveMessageLists::formatDescription() const
+{
+    QString ids = idListToString(_folderIds);
+    return QString("retrieve-message-lists:account-id=%1;folder-ids=%2")
+            .arg(_accountId.toULongLong())
+            .arg(ids);
+}
+
 void RetrieveMessageLists::execute()
 {
     _retrievalAction->retrieveMessageLists(_accountId, _folderIds, _minimum, _sort);
@@ -542,6 +907,11 @@ QMailServiceAction* RetrieveMessageLists::serviceAction() const
     return _retrievalAction;
 }
 
+void RetrieveMessageLists::setServiceAction(QMailServiceAction *serviceAction)
+{
+    _retrievalAction = static_cast<QMailRetrievalAction *>(serviceAction);
+}
+
 QMailAccountId RetrieveMessageLists::accountId() const
 {
     return _accountId;
@@ -559,15 +929,22 @@ RetrieveMessagePart::RetrieveMessagePart(QMailRetrievalAction *retrievalAction,
     , _partLocation(partLocation)
     , _isAttachment(isAttachment)
 {
-    _description = QString("retrieve-message-part:partLocation-id=%1")
-            .arg(_partLocation.toString(true));
+    _key.kind = QLatin1String("retrieve-message-part");
+    appendArgument(&_key.arguments, _partLocation.toString(true));
     _type = EmailAction::RetrieveMessagePart;
+    _priority = _isAttachment ? EmailAction::AttachmentPriority : EmailAction::InteractivePriority;
 }
 
 RetrieveMessagePart::~RetrieveMessagePart()
 {
 }
 
+QString RetrieveMessagePart::formatDescription() const
+{
+    return QString("retrieve-message-part:partLocation-id=%1")
+            .arg(_partLocation.toString(true));
+}
+
 void RetrieveMessagePart::execute()
 {
      _retrievalAction->retrieveMessagePart(_partLocation);
@@ -588,6 +965,11 @@ QMailServiceAction* RetrieveMessagePart::serviceAction() const
     return _retrievalAction;
 }
 
+void RetrieveMessagePart::setServiceAction(QMailServiceAction *serviceAction)
+{
+    _retrievalAction = static_cast<QMailRetrievalAction *>(serviceAction);
+}
+
 bool RetrieveMessagePart::isAttachment() const
 {
     return _isAttachment;
@@ -609,16 +991,24 @@ RetrieveMessagePartRange::RetrieveMessagePartRange(QMailRetrievalAction *retriev
     , _partLocation(partLocation)
     , _minimum(minimum)
 {
-    _description = QString("retrieve-message-part:partLocation-id=%1;minimumBytes=%2")
-            .arg(_partLocation.toString(true))
-            .arg(_minimum);
+    _key.kind = QLatin1String("retrieve-message-part-range");
+    appendArgument(&_key.arguments, _minimum);
+    appendArgument(&_key.arguments, _partLocation.toString(true));
     _type = EmailAction::Retrieve;
+    _priority = EmailAction::InteractivePriority;
 }
 
 RetrieveMessagePartRange::~RetrieveMessagePartRange()
 {
 }
 
+QString RetrieveMessagePartRange::formatDescription() const
+{
+    return QString("retrieve-message-part:partLocation-id=%1;minimumBytes=%2")
+            .arg(_partLocation.toString(true))
+            .arg(_minimum);
+}
+
 void RetrieveMessagePartRange::execute()
 {
      _retrievalAction->retrieveMessagePartRange(_partLocation, _minimum);
@@ -629,6 +1019,11 @@ QMailServiceAction* RetrieveMessagePartRange::serviceAction() const
     return _retrievalAction;
 }
 
+void RetrieveMessagePartRange::setServiceAction(QMailServiceAction *serviceAction)
+{
+    _retrievalAction = static_cast<QMailRetrievalAction *>(serviceAction);
+}
+
 QMailAccountId RetrieveMessagePartRange::accountId() const
 {
     QMailMessage message(_partLocation.containingMessageId());
@@ -645,16 +1040,24 @@ RetrieveMessageRange::RetrieveMessageRange(QMailRetrievalAction *retrievalAction
     , _messageId(messageId)
     , _minimum(minimum)
 {
-    _description = QString("retrieve-message-range:message-id=%1;minimumBytes=%2")
-            .arg(_messageId.toULongLong())
-            .arg(_minimum);
+    _key.kind = QLatin1String("retrieve-message-range");
+    appendArgument(&_key.arguments, quint64(_messageId.toULongLong()));
+    appendArgument(&_key.arguments, _minimum);
     _type = EmailAction::Retrieve;
+    _priority = EmailAction::InteractivePriority;
 }
 
 RetrieveMessageRange::~RetrieveMessageRange()
 {
 }
 
+QString RetrieveMessageRange::formatDescription() const
+{
+    return QString("retrieve-message-range:message-id=%1;minimumBytes=%2")
+            .arg(_messageId.toULongLong())
+            .arg(_minimum);
+}
+
 void RetrieveMessageRange::execute()
 {
      _retrievalAction->retrieveMessageRange(_messageId, _minimum);
@@ -665,6 +1068,11 @@ QMailServiceAction* RetrieveMessageRange::serviceAction() const
     return _retrievalAction;
 }
 
+void RetrieveMessageRange::setServiceAction(QMailServiceAction *serviceAction)
+{
+    _retrievalAction = static_cast<QMailRetrievalAction *>(serviceAction);
+}
+
 QMailAccountId RetrieveMessageRange::accountId() const
 {
     QMailMessage message(_messageId);
@@ -682,15 +1090,22 @@ RetrieveMessages::RetrieveMessages(QMailRetrievalAction *retrievalAction,
     , _messageIds(messageIds)
     , _spec(spec)
 {
-    QString idsList = idListToString(_messageIds);
-    _description = QString("retrieve-messages:message-ids=%1").arg(idsList);
+    _key.kind = QLatin1String("retrieve-messages");
+    appendIds(&_key.arguments, _messageIds);
     _type = EmailAction::RetrieveMessages;
+    _priority = EmailAction::InteractivePriority;
 }
 
 RetrieveMessages::~RetrieveMessages()
 {
 }
 
+QString RetrieveMessages::formatDescription() const
+{
+    QString idsList = idListToString(_messageIds);
+    return QString("retrieve-messages:message-ids=%1").arg(idsList);
+}
+
 void RetrieveMessages::execute()
 {
     _retrievalAction->retrieveMessages(_messageIds, _spec);
@@ -701,6 +1116,11 @@ QMailServiceAction* RetrieveMessages::serviceAction() const
     return _retrievalAction;
 }
 
+void RetrieveMessages::setServiceAction(QMailServiceAction *serviceAction)
+{
+    _retrievalAction = static_cast<QMailRetrievalAction *>(serviceAction);
+}
+
 QMailMessageIdList RetrieveMessages::messageIds() const
 {
     return _messageIds;
@@ -722,14 +1142,23 @@ SearchMessages::SearchMessages(QMailSearchAction *searchAction,
     , _sort(sort)
     , _searchBody(searchBody)
 {
-    _description = QString("search-messages:body-text=%1").arg(bodyText);
+    _key.kind = QLatin1String("search-messages");
+    appendArgument(&_key.arguments, _bodyText);
     _type = EmailAction::Search;
+    _priority = EmailAction::InteractivePriority;
+    // the user repeats a failed search if needed
+    _maxRetries = 0;
 }
 
 SearchMessages::~SearchMessages()
 {
 }
 
+QString SearchMessages::formatDescription() const
+{
+    return QString("search-messages:body-text=%1").arg(_bodyText);
+}
+
 void SearchMessages::execute()
 {
     QString bodyText;
@@ -744,6 +1173,11 @@ QMailServiceAction* SearchMessages::serviceAction() const
     return _searchAction;
 }
 
+void SearchMessages::setServiceAction(QMailServiceAction *serviceAction)
+{
+    _searchAction = static_cast<QMailSearchAction *>(serviceAction);
+}
+
 bool SearchMessages::isRemote() const
 {
     return (_spec == QMailSearchAction::Remote);
@@ -763,7 +1197,8 @@ Synchronize::Synchronize(QMailRetrievalAction* retrievalAction, const QMailAccou
         , _accountId(id)
         , _minimum(minimum)
 {
-    _description = QString("synchronize:account-id=%1").arg(_accountId.toULongLong());
+    _key.kind = QLatin1String("synchronize");
+    _key.accountId = _accountId.toULongLong();
     _type = EmailAction::Retrieve;
 }
 
@@ -771,6 +1206,11 @@ Synchronize::~Synchronize()
 {
 }
 
+QString Synchronize::formatDescription() const
+{
+    return QString("synchronize:account-id=%1").arg(_accountId.toULongLong());
+}
+
 void Synchronize::execute()
 {
     _retrievalAction->synchronize(_accountId, _minimum);
@@ -781,6 +1221,11 @@ QMailServiceAction* Synchronize::serviceAction() const
     return _retrievalAction;
 }
 
+void Synchronize::setServiceAction(QMailServiceAction *serviceAction)
+{
+    _retrievalAction = static_cast<QMailRetrievalAction *>(serviceAction);
+}
+
 QMailAccountId Synchronize::accountId() const
 {
     return _accountId;
@@ -794,14 +1239,23 @@ TransmitMessage::TransmitMessage(QMailTransmitAction* transmitAction, const QMai
     , _transmitAction(transmitAction)
     , _messageId(messageId)
 {
-    _description = QString("transmit-message:message-id=%1").arg(_messageId.toULongLong());
+    _key.kind = QLatin1String("transmit-message");
+    appendArgument(&_key.arguments, quint64(_messageId.toULongLong()));
     _type = EmailAction::Transmit;
+    _priority = EmailAction::SendPriority;
+    // the outbox must get out eventually
+    _maxRetries = 5;
 }
 
 TransmitMessage::~TransmitMessage()
 {
 }
 
+QString TransmitMessage::formatDescription() const
+{
+    return QString("transmit-message:message-id=%1").arg(_messageId.toULongLong());
+}
+
 void TransmitMessage::execute()
 {
     _transmitAction->transmitMessage(_messageId);
@@ -812,6 +1266,11 @@ QMailServiceAction* TransmitMessage::serviceAction() const
     return _transmitAction;
 }
 
+void TransmitMessage::setServiceAction(QMailServiceAction *serviceAction)
+{
+    _transmitAction = static_cast<QMailTransmitAction *>(serviceAction);
+}
+
 QMailMessageId TransmitMessage::messageId() const
 {
     return _messageId;
@@ -831,14 +1290,22 @@ TransmitMessages::TransmitMessages(QMailTransmitAction* transmitAction, const QM
     , _transmitAction(transmitAction)
     , _accountId(id)
 {
-    _description = QString("transmit-messages:account-id=%1").arg(_accountId.toULongLong());
+    _key.kind = QLatin1String("transmit-messages");
+    _key.accountId = _accountId.toULongLong();
     _type = EmailAction::Transmit;
+    _priority = EmailAction::SendPriority;
+    _maxRetries = 5;
 }
 
 TransmitMessages::~TransmitMessages()
 {
 }
 
+QString TransmitMessages::formatDescription() const
+{
+    return QString("transmit-messages:account-id=%1").arg(_accountId.toULongLong());
+}
+
 void TransmitMessages::execute()
 {
     _transmitAction->transmitMessages(_accountId);
@@ -849,6 +1316,11 @@ QMailServiceAction* TransmitMessages::serviceAction() const
     return _transmitAction;
 }
 
+void TransmitMessages::setServiceAction(QMailServiceAction *serviceAction)
+{
+    _transmitAction = static_cast<QMailTransmitAction *>(serviceAction);
+}
+
 QMailAccountId TransmitMessages::accountId() const
 {
     return _accountId;
@@ -869,17 +1341,27 @@ EasInvitationResponse::EasInvitationResponse(QMailProtocolAction* protocolAction
     , _messageId(message)
     , _replyMessageId(replyMessage)
 {
-    _description = QString("eas-invitation-response=%1;message-id=%2;reply-message-id=%3")
-            .arg(_response)
-            .arg(_messageId.toULongLong())
-            .arg(_replyMessageId.toULongLong());
+    _key.kind = QLatin1String("eas-invitation-response");
+    _key.accountId = _accountId.toULongLong();
+    appendArgument(&_key.arguments, _response);
+    appendArgument(&_key.arguments, quint64(_messageId.toULongLong()));
+    appendArgument(&_key.arguments, quint64(_replyMessageId.toULongLong()));
     _type = EmailAction::CalendarInvitationResponse;
+    _priority = EmailAction::SendPriority;
 }
 
 EasInvitationResponse::~EasInvitationResponse()
 {
 }
 
+QString EasInvitationResponse::formatDescription() const
+{
+    return QString("eas-invitation-response=%1;message-id=%2;reply-message-id=%3")
+            .arg(_response)
+            .arg(_messageId.toULongLong())
+            .arg(_replyMessageId.toULongLong());
+}
+
 void EasInvitationResponse::execute()
 {
     QString responseString;
@@ -911,6 +1393,11 @@ QMailServiceAction* EasInvitationResponse::serviceAction() const
     return _protocolAction;
 }
 
+void EasInvitationResponse::setServiceAction(QMailServiceAction *serviceAction)
+{
+    _protocolAction = static_cast<QMailProtocolAction *>(serviceAction);
+}
+
 QMailAccountId EasInvitationResponse::accountId() const
 {
     return _accountId;
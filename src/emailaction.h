@@ -10,9 +10,27 @@
 #ifndef EMAILACTION_H
 #define EMAILACTION_H
 
+#include <QByteArray>
+#include <QLatin1String>
 #include <QObject>
 #include <qmailserviceaction.h>
 
+// Identity of an action, equal keys mean the same request
+struct Q_DECL_EXPORT EmailActionKey
+{
+    QLatin1String kind;
+    quint64 accountId = 0;
+    quint64 folderId = 0;
+    // Remaining identifying arguments, e.g. message ids, packed as raw bytes
+    QByteArray arguments;
+
+    bool isNull() const { return kind.size() == 0; }
+    bool operator==(const EmailActionKey &other) const;
+    bool operator!=(const EmailActionKey &other) const { return !(*this == other); }
+};
+
+Q_DECL_EXPORT uint qHash(const EmailActionKey &key, uint seed = 0);
+
 class Q_DECL_EXPORT EmailAction : public QObject
 {
      Q_OBJECT
@@ -36,6 +54,15 @@ public:
         OnlineMoveFolder
     };
 
+    // Higher priorities run first
+    enum Priority {
+        BackgroundSyncPriority = 0,
+        ForegroundRefreshPriority,
+        SendPriority,
+        AttachmentPriority,
+        InteractivePriority
+    };
+
     virtual ~EmailAction();
     bool operator==(const EmailAction &action) const;
     bool operator!=(const EmailAction &action) const;
@@ -43,22 +70,52 @@ public:
     virtual void execute() = 0;
     virtual QMailAccountId accountId() const;
     virtual QMailServiceAction* serviceAction() const = 0;
+    // Moves the action over to a replacement of the same class, e.g. when the
+    // current one no longer responds
+    virtual void setServiceAction(QMailServiceAction *serviceAction) = 0;
+    // Messages the action is about, empty if not about particular messages
+    virtual QMailMessageIdList messageIds() const;
 
     QString description() const;
+    const EmailActionKey &key() const;
     ActionType type() const;
     quint64 id() const;
     void setId(const quint64 id);
     bool needsNetworkConnection() const { return _onlineAction; }
+    Priority priority() const;
+    void setPriority(Priority priority);
+    // Time the action was queued at, used for aging its priority
+    qint64 enqueueTime() const;
+    void setEnqueueTime(qint64 msecs);
+    // Takes over the work of a compatible action, returns false if not compatible
+    bool merge(const EmailAction &action);
+    // Attempts after a transient failure before the action is given up
+    int maxRetries() const;
+    int retryCount() const;
+    void setRetryCount(int count);
+    // Earliest time a failed action may run again, on the clock of enqueueTime()
+    qint64 retryTime() const;
+    void setRetryTime(qint64 msecs);
 
 protected:
     EmailAction(bool onlineAction = true);
 
-    QString _description;
+    // Formatted only when the description is needed, e.g. for logging
+    virtual QString formatDescription() const = 0;
+    virtual bool mergeAction(const EmailAction &action);
+
+    EmailActionKey _key;
     ActionType _type;
     quint64 _id;
+    Priority _priority;
+    int _maxRetries;
 
 private:
+    mutable QString _description;
     bool _onlineAction;
+    qint64 _enqueueTime;
+    int _retryCount;
+    qint64 _retryTime;
 };
 
 class CreateStandardFolders : public EmailAction
@@ -69,9 +126,12 @@ public:
 
     void execute() override;
     QMailServiceAction* serviceAction() const override;
+    void setServiceAction(QMailServiceAction *serviceAction) override;
     QMailAccountId accountId() const override;
 
 private:
+    QString formatDescription() const override;
+
     QMailRetrievalAction* _retrievalAction;
     QMailAccountId _accountId;
 };
@@ -84,8 +144,13 @@ public:
 
     void execute() override;
     QMailServiceAction* serviceAction() const override;
+    void setServiceAction(QMailServiceAction *serviceAction) override;
+    QMailMessageIdList messageIds() const override;
 
 private:
+    QString formatDescription() const override;
+    bool mergeAction(const EmailAction &action) override;
+
     QMailStorageAction* _storageAction;
     QMailMessageIdList _ids;
 };
@@ -98,9 +163,12 @@ public:
 
     void execute() override;
     QMailServiceAction* serviceAction() const override;
+    void setServiceAction(QMailServiceAction *serviceAction) override;
     QMailAccountId accountId() const override;
 
 private:
+    QString formatDescription() const override;
+
     QMailRetrievalAction* _retrievalAction;
     QMailAccountId _accountId;
 };
@@ -114,8 +182,13 @@ public:
 
     void execute() override;
     QMailServiceAction* serviceAction() const override;
+    void setServiceAction(QMailServiceAction *serviceAction) override;
+    QMailMessageIdList messageIds() const override;
 
 private:
+    QString formatDescription() const override;
+    bool mergeAction(const EmailAction &action) override;
+
     QMailStorageAction* _storageAction;
     QMailMessageIdList _ids;
     quint64 _setMask;
@@ -131,8 +204,13 @@ public:
 
     void execute() override;
     QMailServiceAction* serviceAction() const override;
+    void setServiceAction(QMailServiceAction *serviceAction) override;
+    QMailMessageIdList messageIds() const override;
 
 private:
+    QString formatDescription() const override;
+    bool mergeAction(const EmailAction &action) override;
+
     QMailStorageAction* _storageAction;
     QMailMessageIdList _ids;
     QMailFolderId _destinationFolder;
@@ -147,8 +225,12 @@ public:
 
     void execute() override;
     QMailServiceAction* serviceAction() const override;
+    void setServiceAction(QMailServiceAction *serviceAction) override;
+    QMailMessageIdList messageIds() const override;
 
 private:
+    QString formatDescription() const override;
+
     QMailStorageAction* _storageAction;
     QMailMessageIdList _ids;
     QMailFolder::StandardFolder _standardFolder;
@@ -163,9 +245,12 @@ public:
 
     void execute() override;
     QMailServiceAction* serviceAction() const override;
+    void setServiceAction(QMailServiceAction *serviceAction) override;
     QMailAccountId accountId() const override;
 
 private:
+    QString formatDescription() const override;
+
     QMailStorageAction* _storageAction;
     QString _name;
     QMailAccountId _accountId;
@@ -181,9 +266,12 @@ public:
 
     void execute() override;
     QMailServiceAction* serviceAction() const override;
+    void setServiceAction(QMailServiceAction *serviceAction) override;
     QMailAccountId accountId() const override;
 
 private:
+    QString formatDescription() const override;
+
     QMailStorageAction* _storageAction;
     QMailFolderId _folderId;
 };
@@ -197,8 +285,12 @@ public:
 
     void execute() override;
     QMailServiceAction* serviceAction() const override;
+    void setServiceAction(QMailServiceAction *serviceAction) override;
+    QMailMessageIdList messageIds() const override;
 
 private:
+    QString formatDescription() const override;
+
     QMailStorageAction* _storageAction;
     QMailMessageIdList _ids;
     QMailFolderId _destinationId;
@@ -213,9 +305,12 @@ public:
 
     void execute() override;
     QMailServiceAction* serviceAction() const override;
+    void setServiceAction(QMailServiceAction *serviceAction) override;
     QMailAccountId accountId() const override;
 
 private:
+    QString formatDescription() const override;
+
     QMailStorageAction* _storageAction;
     QMailFolderId _folderId;
     QString _name;
@@ -230,9 +325,12 @@ public:
 
     void execute() override;
     QMailServiceAction* serviceAction() const override;
+    void setServiceAction(QMailServiceAction *serviceAction) override;
     QMailAccountId accountId() const override;
 
 private:
+    QString formatDescription() const override;
+
     QMailStorageAction* _storageAction;
     QMailFolderId _folderId;
     QMailFolderId _newParentId;
@@ -247,9 +345,12 @@ public:
 
     void execute() override;
     QMailServiceAction* serviceAction() const override;
+    void setServiceAction(QMailServiceAction *serviceAction) override;
     QMailAccountId accountId() const override;
 
 private:
+    QString formatDescription() const override;
+
     QMailRetrievalAction* _retrievalAction;
     QMailAccountId _accountId;
     QMailFolderId _folderId;
@@ -266,9 +367,12 @@ public:
 
     void execute() override;
     QMailServiceAction* serviceAction() const override;
+    void setServiceAction(QMailServiceAction *serviceAction) override;
     QMailAccountId accountId() const override;
 
 private:
+    QString formatDescription() const override;
+
     QMailRetrievalAction* _retrievalAction;
     QMailAccountId _accountId;
     QMailFolderId _folderId;
@@ -286,9 +390,12 @@ public:
 
     void execute() override;
     QMailServiceAction* serviceAction() const override;
+    void setServiceAction(QMailServiceAction *serviceAction) override;
     QMailAccountId accountId() const override;
 
 private:
+    QString formatDescription() const override;
+
     QMailRetrievalAction* _retrievalAction;
     QMailAccountId _accountId;
     QMailFolderIdList _folderIds;
@@ -305,6 +412,7 @@ public:
 
     void execute() override;
     QMailServiceAction* serviceAction() const override;
+    void setServiceAction(QMailServiceAction *serviceAction) override;
     QMailAccountId accountId() const override;
 
     QMailMessageId messageId() const;
@@ -312,6 +420,8 @@ public:
     bool isAttachment() const;
 
 private:
+    QString formatDescription() const override;
+
     QMailMessageId _messageId;
     QMailRetrievalAction* _retrievalAction;
     QMailMessagePart::Location _partLocation;
@@ -327,9 +437,12 @@ public:
 
     void execute()override;
     QMailServiceAction* serviceAction() const override;
+    void setServiceAction(QMailServiceAction *serviceAction) override;
     QMailAccountId accountId() const override;
 
 private:
+    QString formatDescription() const override;
+
     QMailRetrievalAction* _retrievalAction;
     QMailMessagePart::Location _partLocation;
     uint _minimum;
@@ -344,9 +457,12 @@ public:
 
     void execute() override;
     QMailServiceAction* serviceAction() const override;
+    void setServiceAction(QMailServiceAction *serviceAction) override;
     QMailAccountId accountId() const override;
 
 private:
+    QString formatDescription() const override;
+
     QMailRetrievalAction* _retrievalAction;
     QMailMessageId _messageId;
     uint _minimum;
@@ -362,10 +478,13 @@ public:
 
     void execute() override;
     QMailServiceAction* serviceAction() const override;
+    void setServiceAction(QMailServiceAction *serviceAction) override;
 
-    QMailMessageIdList messageIds() const;
+    QMailMessageIdList messageIds() const override;
 
 private:
+    QString formatDescription() const override;
+
     QMailRetrievalAction* _retrievalAction;
     QMailMessageIdList _messageIds;
     QMailRetrievalAction::RetrievalSpecification _spec;
@@ -382,11 +501,14 @@ public:
 
     void execute() override;
     QMailServiceAction* serviceAction() const override;
+    void setServiceAction(QMailServiceAction *serviceAction) override;
 
     bool isRemote() const;
     QString searchText() const;
 
 private:
+    QString formatDescription() const override;
+
     QMailSearchAction *_searchAction;
     QMailMessageKey _filter;
     QString _bodyText;
@@ -404,9 +526,12 @@ public:
 
     void execute() override;
     QMailServiceAction* serviceAction() const override;
+    void setServiceAction(QMailServiceAction *serviceAction) override;
     QMailAccountId accountId() const override;
 
 private:
+    QString formatDescription() const override;
+
     QMailRetrievalAction* _retrievalAction;
     QMailAccountId _accountId;
     uint _minimum;
@@ -420,10 +545,13 @@ public:
 
     void execute() override;
     QMailServiceAction* serviceAction() const override;
+    void setServiceAction(QMailServiceAction *serviceAction) override;
     QMailMessageId messageId() const;
     QMailAccountId accountId() const;
 
 private:
+    QString formatDescription() const override;
+
     QMailTransmitAction* _transmitAction;
     QMailMessageId _messageId;
 };
@@ -436,9 +564,12 @@ public:
 
     void execute() override;
     QMailServiceAction* serviceAction() const override;
+    void setServiceAction(QMailServiceAction *serviceAction) override;
     QMailAccountId accountId() const override;
 
 private:
+    QString formatDescription() const override;
+
     QMailTransmitAction* _transmitAction;
     QMailAccountId _accountId;
 };
@@ -455,11 +586,14 @@ public:
 
     void execute() override;
     QMailServiceAction* serviceAction() const override;
+    void setServiceAction(QMailServiceAction *serviceAction) override;
     QMailAccountId accountId() const override;
 
     int response() const;
 
 private:
+    QString formatDescription() const override;
+
     QMailProtocolAction* _protocolAction;
     QMailAccountId _accountId;
     int _response;
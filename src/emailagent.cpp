@@ -9,23 +9,32 @@
  */
 
 
+#include <algorithm>
+#include <limits>
+#include <random>
+
 #include <QDBusInterface>
 #include <QDBusObjectPath>
 #include <QDBusPendingCallWatcher>
 #include <QDBusPendingReply>
 #include <QDBusConnectionInterface>
 #include <QFile>
+#include <QGuiApplication>
 #include <QMap>
+#include <QSet>
 #include <QStandardPaths>
 #include <QTimer>
 #include <QNetworkConfigurationManager>
-#include <QCryptographicHash>
 
 #include <qmailnamespace.h>
 #include <qmailaccount.h>
 #include <qmailstore.h>
 #include <qmaildisconnected.h>
 
+#include "actionjournal.h"
+#include "attachmentstore.h"
+#include "attachmentverifier.h"
+#include "attachmentwriter.h"
 #include "emailagent.h"
 #include "emailaction.h"
 #include "emailutils.h"
@@ -45,6 +54,136 @@ QMailAccountId accountForMessageId(const QMailMessageId &msgId)
     return metaData.parentAccountId();
 }
 
+// Sends and exports of local changes are replayed after a restart,
+// other work is rediscovered by the next sync
+bool journalEntry(const EmailAction *action, ActionJournal::Entry *entry)
+{
+    const EmailActionKey key = action->key();
+    if (key.kind == QLatin1String("transmit-message")) {
+        entry->messageId = static_cast<const TransmitMessage *>(action)->messageId();
+    } else if (key.kind != QLatin1String("exporting-updates")
+               && key.kind != QLatin1String("transmit-messages")) {
+        return false;
+    }
+
+    entry->kind = key.kind;
+    entry->accountId = action->accountId();
+    return true;
+}
+
+// Messages can be from several accounts
+QMap<QMailAccountId, QMailMessageIdList> messagesByAccount(const QMailMessageIdList &ids)
+{
+    QMap<QMailAccountId, QMailMessageIdList> accountMap;
+    for (const QMailMessageId &id : ids) {
+        accountMap[accountForMessageId(id)].append(id);
+    }
+    return accountMap;
+}
+
+// Upper limit of accounts executing actions at the same time
+const int MaxRunningLanes = 3;
+// Waiting this long raises the priority of a queued action by one level
+const qint64 PriorityAgingInterval = 20000;
+// Pause in local changes after which they are exported
+const int ExportQuietWindow = 3000;
+// First retry delay after a transient failure, doubled on every attempt
+const qint64 BaseRetryDelay = 5000;
+const qint64 MaxRetryDelay = 10 * 60 * 1000;
+// Consecutive transient failures after which the network actions of an account are held
+const int HoldThreshold = 5;
+const qint64 HoldInterval = 5 * 60 * 1000;
+// Longest time a background network action waits for other work to run with
+const qint64 BatchWindow = 2 * 60 * 1000;
+// Attachments of an account downloaded at the same time
+const int MaxAttachmentDownloads = 2;
+// How often running actions are checked for progress
+const int WatchdogInterval = 10000;
+// Time a stalled action gets to finish after being cancelled, before it is abandoned
+const qint64 StallGracePeriod = 30000;
+
+// Priority raised by the time the action has waited in the queue
+int agedPriority(const EmailAction &action, qint64 now)
+{
+    return action.priority() + int((now - action.enqueueTime()) / PriorityAgingInterval);
+}
+
+// Random delay from 0 to max milliseconds
+qint64 retryJitter(qint64 max)
+{
+    static std::mt19937 generator{std::random_device()()};
+    return std::uniform_int_distribution<qint64>(0, max)(generator);
+}
+
+// Time without any progress after which a running action is considered stuck
+qint64 stallTimeout(const EmailAction &action)
+{
+    switch (action.type()) {
+    case EmailAction::Storage:
+    case EmailAction::Search:
+    case EmailAction::StandardFolders:
+        return 60 * 1000;
+    case EmailAction::Retrieve:
+    case EmailAction::RetrieveFolderList:
+    case EmailAction::Export:
+        return 3 * 60 * 1000;
+    default:
+        return 2 * 60 * 1000;
+    }
+}
+
+// Returns false if the error is not reported, e.g. a cancelled action
+bool syncError(QMailServiceAction::Status::ErrorCode errorCode, bool sendFailed, EmailAgent::SyncErrors *error)
+{
+    switch (errorCode) {
+    case QMailServiceAction::Status::ErrFrameworkFault:
+    case QMailServiceAction::Status::ErrSystemError:
+    case QMailServiceAction::Status::ErrEnqueueFailed:
+    case QMailServiceAction::Status::ErrConnectionInUse:
+    case QMailServiceAction::Status::ErrInternalStateReset:
+    case QMailServiceAction::Status::ErrInvalidAddress:
+    case QMailServiceAction::Status::ErrInvalidData:
+    case QMailServiceAction::Status::ErrNotImplemented:
+        *error = sendFailed ? EmailAgent::SendFailed : EmailAgent::SyncFailed;
+        return true;
+    case QMailServiceAction::Status::ErrLoginFailed:
+        *error = EmailAgent::LoginFailed;
+        return true;
+    case QMailServiceAction::Status::ErrFileSystemFull:
+        *error = EmailAgent::DiskFull;
+        return true;
+    case QMailServiceAction::Status::ErrConfiguration:
+    case QMailServiceAction::Status::ErrNoSslSupport:
+        *error = EmailAgent::InvalidConfiguration;
+        return true;
+    case QMailServiceAction::Status::ErrUntrustedCertificates:
+        *error = EmailAgent::UntrustedCertificates;
+        return true;
+    case QMailServiceAction::Status::ErrCancel:
+        return false;
+    case QMailServiceAction::Status::ErrTimeout:
+        *error = EmailAgent::Timeout;
+        return true;
+    case QMailServiceAction::Status::ErrUnknownResponse:
+    case QMailServiceAction::Status::ErrInternalServer:
+        *error = EmailAgent::ServerError;
+        return true;
+    case QMailServiceAction::Status::ErrNoConnection:
+    case QMailServiceAction::Status::ErrConnectionNotReady:
+        *error = EmailAgent::NotConnected;
+        return true;
+    default:
+        *error = EmailAgent::InternalError;
+        return true;
+    }
+}
+
+// Errors that can go away by trying again later
+bool isTransientError(EmailAgent::SyncErrors error)
+{
+    return error == EmailAgent::Timeout || error == EmailAgent::ServerError || error == EmailAgent::NotConnected;
+}
+
 QString attachmentField(const QMailMessage &message,
                         const QString &attachmentLocation)
 {
@@ -78,36 +217,19 @@ QString attachmentFilename(const QMailMessage &message,
     return filename;
 }
 
-QString md5(const QString &filename)
-{
-    QFile f(filename);
-    if (f.open(QFile::ReadOnly)) {
-        QCryptographicHash hash(QCryptographicHash::Md5);
-        hash.addData(&f);
-        return QString::fromUtf8(hash.result());
-    }
-    return QString();
-}
-
 void setAttachmentFilename(QMailMessage *message,
                            const QString &attachmentLocation,
-                           const QString &filename)
+                           const QString &filename,
+                           const QString &checksum)
 {
     const QString prefix = attachmentField(*message, attachmentLocation);
     message->setCustomField(prefix + "-filename", filename);
-    message->setCustomField(prefix + "-md5", md5(filename));
+    message->setCustomField(prefix + "-md5", checksum);
     QMailMessageMetaData local = *message;
     QTimer::singleShot(0, [local] {
                               QMailStore::instance()->updateMessage((QMailMessageMetaData*)&local);
                           });
 }
-
-bool matchesAttachment(const QString &path, const QString &attachmentMd5)
-{
-    return !path.isEmpty()
-        && ((attachmentMd5.isEmpty() && QFile::exists(path))
-            || (!attachmentMd5.isEmpty() && md5(path) == attachmentMd5));
-}
 }
 
 EmailAgent *EmailAgent::m_instance = 0;
@@ -123,16 +245,19 @@ EmailAgent::EmailAgent(QObject *parent)
     : QObject(parent)
     , m_actionCount(0)
     , m_accountSynchronizing(0)
-    , m_transmitting(false)
-    , m_cancellingSingleAction(false)
     , m_synchronizing(false)
     , m_enqueing(false)
-    , m_retrievalAction(new QMailRetrievalAction(this))
-    , m_storageAction(new QMailStorageAction(this))
-    , m_transmitAction(new QMailTransmitAction(this))
-    , m_searchAction(new QMailSearchAction(this))
-    , m_protocolAction(new QMailProtocolAction(this))
+    , m_batchNetworkActions(false)
+    , m_batchUntil(0)
     , m_nmanager(new QNetworkConfigurationManager(this))
+    , m_attachmentStore(new AttachmentStore(QStandardPaths::writableLocation(QStandardPaths::DownloadLocation)
+                                            + QLatin1String("/mail_attachments/store"), this))
+    , m_attachmentVerifier(new AttachmentVerifier(this))
+    , m_attachmentWriter(new AttachmentWriter(this))
+    , m_localLane(new ActionLane)
+    , m_runningLanes(0)
+    , m_journal(new ActionJournal(QStandardPaths::writableLocation(QStandardPaths::AppDataLocation)
+                                  + QLatin1String("/email-action-journal")))
 {
     connect(QMailStore::instance(), &QMailStore::ipcConnectionEstablished,
             this, &EmailAgent::onIpcConnectionEstablished);
@@ -140,35 +265,62 @@ EmailAgent::EmailAgent(QObject *parent)
     initMailServer();
     setupAccountFlags();
 
-    connect(m_transmitAction.data(), &QMailTransmitAction::progressChanged,
-            this, &EmailAgent::progressChanged);
-
-    connect(m_retrievalAction.data(), &QMailRetrievalAction::activityChanged,
-            this, &EmailAgent::activityChanged);
-
-    connect(m_retrievalAction.data(), &QMailRetrievalAction::progressChanged,
-            this, &EmailAgent::progressChanged);
-
-    connect(m_storageAction.data(), &QMailStorageAction::activityChanged,
-            this, &EmailAgent::activityChanged);
-
-    connect(m_transmitAction.data(), &QMailTransmitAction::activityChanged,
-            this, &EmailAgent::activityChanged);
-
-    connect(m_searchAction.data(), &QMailSearchAction::activityChanged,
-            this, &EmailAgent::activityChanged);
-
-    connect(m_protocolAction.data(), &QMailProtocolAction::activityChanged,
-            this, &EmailAgent::activityChanged);
-
-    connect(m_searchAction.data(), &QMailSearchAction::messageIdsMatched,
-            this, &EmailAgent::searchMessageIdsMatched);
+    // The default lane runs the actions not bound to a single account
+    QSharedPointer<ActionLane> defaultLane(new ActionLane);
+    defaultLane->retrievalAction = new QMailRetrievalAction(this);
+    defaultLane->storageAction = new QMailStorageAction(this);
+    defaultLane->transmitAction = new QMailTransmitAction(this);
+    defaultLane->protocolAction = new QMailProtocolAction(this);
+    defaultLane->searchAction = new QMailSearchAction(this);
+    m_lanes.insert(QMailAccountId(), defaultLane);
+
+    // Local storage changes run at once on their own lane, outside the execution slots
+    m_localLane->storageAction = new QMailStorageAction(this);
+    addServiceAction(m_localLane.data(), m_localLane->storageAction);
+    addServiceAction(defaultLane.data(), defaultLane->retrievalAction);
+    addServiceAction(defaultLane.data(), defaultLane->storageAction);
+    addServiceAction(defaultLane.data(), defaultLane->transmitAction);
+    addServiceAction(defaultLane.data(), defaultLane->searchAction);
+    addServiceAction(defaultLane.data(), defaultLane->protocolAction);
+
+    connect(m_attachmentVerifier, &AttachmentVerifier::verified,
+            this, &EmailAgent::attachmentVerified);
+    connect(m_attachmentWriter, &AttachmentWriter::progressChanged,
+            this, &EmailAgent::attachmentWriteProgressChanged);
+    connect(m_attachmentWriter, &AttachmentWriter::finished,
+            this, &EmailAgent::attachmentWritten);
+
+    connect(QMailStore::instance(), &QMailStore::accountsRemoved,
+            this, &EmailAgent::onAccountsRemoved);
+
+    m_watchdogTimer.setInterval(WatchdogInterval);
+    connect(&m_watchdogTimer, &QTimer::timeout, this, &EmailAgent::checkStalledActions);
+
+    m_retryTimer.setSingleShot(true);
+    connect(&m_retryTimer, &QTimer::timeout, this, &EmailAgent::retryHeldActions);
+
+    m_exportTimer.setSingleShot(true);
+    m_exportTimer.setInterval(ExportQuietWindow);
+    connect(&m_exportTimer, &QTimer::timeout, this, &EmailAgent::flushExports);
+    if (qGuiApp) {
+        connect(qGuiApp, &QGuiApplication::applicationStateChanged,
+                this, [this](Qt::ApplicationState state) {
+            if (state != Qt::ApplicationActive && !m_pendingExports.isEmpty()) {
+                flushExports();
+            }
+        });
+    }
 
     connect(m_nmanager, &QNetworkConfigurationManager::onlineStateChanged,
             this, &EmailAgent::onOnlineStateChanged);
 
+    m_queueClock.start();
     m_waitForIpc = !QMailStore::instance()->isIpcConnectionEstablished();
     m_instance = this;
+
+    // Work left pending by a previous run of the process, read by the journal
+    // when it was created
+    QTimer::singleShot(0, this, &EmailAgent::replayJournal);
 }
 
 EmailAgent::~EmailAgent()
@@ -201,13 +353,55 @@ EmailAgent::AttachmentStatus EmailAgent::attachmentDownloadStatus(const QMailMes
     } else {
         QString checksum;
         const QString path = attachmentFilename(message, attachmentLocation, &checksum);
-        bool matches = matchesAttachment(path, checksum);
-        if (downloadPath && matches) {
+        AttachmentVerifier::Result result = AttachmentVerifier::Mismatch;
+        if (path.isEmpty()) {
+            result = AttachmentVerifier::Mismatch;
+        } else if (checksum.isEmpty()) {
+            result = QFile::exists(path) ? AttachmentVerifier::Matches : AttachmentVerifier::Mismatch;
+        } else {
+            result = m_attachmentVerifier->verify(path, checksum);
+        }
+
+        if (result == AttachmentVerifier::Pending) {
+            // Resolved by attachmentVerified()
+            m_verifyingAttachments[path].insert(attachmentLocation, checksum);
+            return Unknown;
+        }
+        if (downloadPath && result == AttachmentVerifier::Matches) {
             *downloadPath = path;
         }
-        return (matches) ? Downloaded : NotDownloaded;
+        return (result == AttachmentVerifier::Matches) ? Downloaded : NotDownloaded;
+    }
+}
+
+void EmailAgent::attachmentVerified(const QString &path)
+{
+    const QHash<QString, QString> locations = m_verifyingAttachments.take(path);
+    for (auto it = locations.constBegin(); it != locations.constEnd(); ++it) {
+        const AttachmentVerifier::Result result = m_attachmentVerifier->verify(path, it.value());
+        if (result == AttachmentVerifier::Pending) {
+            // Changed while hashing, hashed again
+            m_verifyingAttachments[path].insert(it.key(), it.value());
+        } else if (m_savingAttachments.contains(it.key()) && !m_attachmentWriter->isWriting(it.key())) {
+            // Downloaded and saving, unless cancelled meanwhile
+            if (!m_attachmentDownloadQueue.contains(it.key())) {
+                m_savingAttachments.remove(it.key());
+            } else if (result == AttachmentVerifier::Matches) {
+                m_savingAttachments.remove(it.key());
+                emit attachmentPathChanged(it.key(), path);
+                updateAttachmentDownloadStatus(it.key(), Downloaded);
+            } else {
+                writeAttachment(QMailMessage(m_savingAttachments.value(it.key())), it.key());
+            }
+        } else if (!m_attachmentDownloadQueue.contains(it.key())) {
+            if (result == AttachmentVerifier::Matches) {
+                emit attachmentPathChanged(it.key(), path);
+                emit attachmentDownloadStatusChanged(it.key(), Downloaded);
+            } else {
+                emit attachmentDownloadStatusChanged(it.key(), NotDownloaded);
+            }
+        }
     }
-    return Unknown;
 }
 
 QString EmailAgent::bodyPlainText(const QMailMessage &mailMsg) const
@@ -222,8 +416,9 @@ QString EmailAgent::bodyPlainText(const QMailMessage &mailMsg) const
 void EmailAgent::cancelAction(quint64 actionId)
 {
     // cancel running action
-    if (m_currentAction && (m_currentAction->id() == actionId)) {
-        cancelCurrentAction();
+    ActionLane *lane = m_actionLanes.value(actionId);
+    if (lane && lane->currentAction && (lane->currentAction->id() == actionId)) {
+        cancelCurrentAction(lane);
     } else {
         removeAction(actionId);
     }
@@ -232,24 +427,95 @@ void EmailAgent::cancelAction(quint64 actionId)
 quint64 EmailAgent::downloadMessages(const QMailMessageIdList &messageIds,
                                      QMailRetrievalAction::RetrievalSpecification spec)
 {
-    return enqueue(new RetrieveMessages(m_retrievalAction.data(), messageIds, spec));
+    // Messages from several accounts are retrieved on the default lane
+    const QMap<QMailAccountId, QMailMessageIdList> accountMap = messagesByAccount(messageIds);
+    const QMailAccountId accountId = accountMap.size() == 1 ? accountMap.firstKey() : QMailAccountId();
+    return enqueue(new RetrieveMessages(retrievalAction(accountId), messageIds, spec));
 }
 
 quint64 EmailAgent::downloadMessagePart(const QMailMessagePart::Location &location)
 {
-    return enqueue(new RetrieveMessagePart(m_retrievalAction.data(), location, false));
+    const QMailAccountId accountId = accountForMessageId(location.containingMessageId());
+    return enqueue(new RetrieveMessagePart(retrievalAction(accountId), location, false));
 }
 
 void EmailAgent::exportUpdates(const QMailAccountIdList &accountIdList)
 {
-    if (!m_enqueing && accountIdList.size()) {
+    // Changes made in a row are exported together, once per account,
+    // after a short pause or when the application goes to background
+    for (const QMailAccountId &accountId : accountIdList) {
+        if (accountId.isValid() && !m_pendingExports.contains(accountId)) {
+            m_pendingExports.append(accountId);
+        }
+        journalExport(accountId);
+    }
+    if (!m_pendingExports.isEmpty()) {
+        m_exportTimer.start();
+    }
+}
+
+// Exports asked for explicitly do not wait for more changes
+void EmailAgent::exportUpdatesNow(const QMailAccountIdList &accountIdList)
+{
+    QMailAccountIdList accountIds;
+    for (const QMailAccountId &accountId : accountIdList) {
+        if (accountId.isValid() && !accountIds.contains(accountId)) {
+            m_pendingExports.removeAll(accountId);
+            journalExport(accountId);
+            accountIds.append(accountId);
+        }
+    }
+    if (m_pendingExports.isEmpty()) {
+        m_exportTimer.stop();
+    }
+    enqueueExports(accountIds);
+}
+
+// The export is not queued yet, the journal holds it meanwhile
+void EmailAgent::journalExport(const QMailAccountId &accountId)
+{
+    if (accountId.isValid() && !m_exportJournalIds.contains(accountId)) {
+        ActionJournal::Entry entry;
+        entry.kind = QStringLiteral("exporting-updates");
+        entry.accountId = accountId;
+        const quint64 journalId = newAction();
+        m_journal->add(journalId, entry);
+        m_exportJournalIds.insert(accountId, journalId);
+    }
+}
+
+void EmailAgent::flushExports()
+{
+    m_exportTimer.stop();
+    const QMailAccountIdList accountIds = m_pendingExports;
+    m_pendingExports.clear();
+    enqueueExports(accountIds);
+}
+
+void EmailAgent::enqueueExports(const QMailAccountIdList &accountIdList)
+{
+    // Local changes still being stored get exported once they are done
+    QMailAccountIdList exportIds;
+    for (const QMailAccountId &accountId : accountIdList) {
+        if (m_localLane->queue.isEmpty()) {
+            exportIds.append(accountId);
+        } else if (!m_deferredExports.contains(accountId)) {
+            m_deferredExports.append(accountId);
+        }
+    }
+
+    if (!m_enqueing && exportIds.size()) {
         m_enqueing = true;
     }
-    for (int i = 0; i < accountIdList.size(); i++) {
-        if (i+1 == accountIdList.size()) {
+    for (int i = 0; i < exportIds.size(); i++) {
+        if (i+1 == exportIds.size()) {
             m_enqueing = false;
         }
-        enqueue(new ExportUpdates(m_retrievalAction.data(), accountIdList.at(i)));
+        enqueue(new ExportUpdates(retrievalAction(exportIds.at(i)), exportIds.at(i)));
+        // Journaled now as the queued export, until that finishes
+        if (m_exportJournalIds.contains(exportIds.at(i))) {
+            m_journal->remove(m_exportJournalIds.take(exportIds.at(i)));
+        }
     }
 }
 
@@ -320,31 +586,51 @@ void EmailAgent::searchMessages(const QMailMessageKey &filter,
     // cancel any running or queued
     cancelSearch();
     qCDebug(lcEmail) << "Enqueuing new search:" << bodyText;
-    enqueue(new SearchMessages(m_searchAction.data(), filter, bodyText, spec, limit, searchBody, sort));
+    enqueue(new SearchMessages(lane(QMailAccountId())->searchAction, filter, bodyText, spec, limit, searchBody, sort));
 }
 
 void EmailAgent::cancelSearch()
 {
+    // Searches run on the default lane
+    ActionLane *searchLane = lane(QMailAccountId());
+
     // Starts from 1 since top of the queue will be removed separately
-    for (int i = 1; i < m_actionQueue.size();) {
-        if (m_actionQueue.at(i).data()->type() == EmailAction::Search) {
-            m_actionQueue.removeAt(i);
+    for (int i = 1; i < searchLane->queue.size();) {
+        if (searchLane->queue.at(i).data()->type() == EmailAction::Search) {
+            removeFromQueue(searchLane, i);
             qCDebug(lcEmail) <<  "Search action removed from the queue";
         } else {
             ++i;
         }
     }
     // cancel running action if is search
-    if (m_currentAction && (m_currentAction->type() == EmailAction::Search)) {
-        cancelCurrentAction();
+    if (searchLane->currentAction && (searchLane->currentAction->type() == EmailAction::Search)) {
+        cancelCurrentAction(searchLane);
     }
 }
 
 void EmailAgent::cancelAll()
 {
-    m_actionQueue.clear();
-    if (m_currentAction) {
-        cancelCurrentAction();
+    m_waitingLanes.clear();
+    m_exportTimer.stop();
+    m_retryTimer.stop();
+    m_batchUntil = 0;
+    emit batchChanged();
+    m_pendingExports.clear();
+    m_deferredExports.clear();
+    m_exportJournalIds.clear();
+    m_actionLanes.clear();
+    m_plans.clear();
+    for (AttachmentPipeline &pipeline : m_attachmentPipelines) {
+        pipeline.pending.clear();
+    }
+    m_journal->clear();
+    for (const QSharedPointer<ActionLane> &lane : allLanes()) {
+        lane->queue.clear();
+        lane->keys.clear();
+        if (lane->currentAction) {
+            cancelCurrentAction(lane.data());
+        }
     }
 }
 
@@ -353,11 +639,53 @@ bool EmailAgent::synchronizing() const
     return m_synchronizing;
 }
 
+bool EmailAgent::batchNetworkActions() const
+{
+    return m_batchNetworkActions;
+}
+
+void EmailAgent::setBatchNetworkActions(bool batch)
+{
+    if (m_batchNetworkActions != batch) {
+        m_batchNetworkActions = batch;
+        if (!batch) {
+            flushBatch();
+        }
+        emit batchNetworkActionsChanged();
+    }
+}
+
+int EmailAgent::batchedActionCount() const
+{
+    if (m_batchUntil <= m_queueClock.elapsed()) {
+        return 0;
+    }
+
+    int count = 0;
+    for (const QSharedPointer<ActionLane> &lane : allLanes()) {
+        for (const QSharedPointer<EmailAction> &action : lane->queue) {
+            if (isBatched(*action)) {
+                ++count;
+            }
+        }
+    }
+    return count;
+}
+
+QDateTime EmailAgent::nextBatchFlush() const
+{
+    const qint64 now = m_queueClock.elapsed();
+    if (m_batchUntil <= now) {
+        return QDateTime();
+    }
+    return QDateTime::currentDateTime().addMSecs(m_batchUntil - now);
+}
+
 void EmailAgent::flagMessages(const QMailMessageIdList &ids, quint64 setMask, quint64 unsetMask)
 {
     Q_ASSERT(!ids.empty());
 
-    enqueue(new FlagMessages(m_storageAction.data(), ids, setMask, unsetMask));
+    enqueue(new FlagMessages(m_localLane->storageAction, ids, setMask, unsetMask));
 }
 
 void EmailAgent::moveMessages(const QMailMessageIdList &ids, const QMailFolderId &destinationId)
@@ -375,14 +703,14 @@ void EmailAgent::moveMessages(const QMailMessageIdList &ids, const QMailFolderId
 void EmailAgent::sendMessage(const QMailMessageId &messageId)
 {
     if (messageId.isValid()) {
-        enqueue(new TransmitMessage(m_transmitAction.data(), messageId));
+        enqueue(new TransmitMessage(transmitAction(accountForMessageId(messageId)), messageId));
     }
 }
 
 void EmailAgent::sendMessages(const QMailAccountId &accountId)
 {
     if (accountId.isValid()) {
-        enqueue(new TransmitMessages(m_transmitAction.data(), accountId));
+        enqueue(new TransmitMessages(transmitAction(accountId), accountId));
     }
 }
 
@@ -415,9 +743,39 @@ void EmailAgent::activityChanged(QMailServiceAction::Activity activity)
     QMailServiceAction *action = static_cast<QMailServiceAction*>(sender());
     const QMailServiceAction::Status status(action->status());
 
+    ActionLane *lane = m_serviceLanes.value(action);
+    if (!lane || lane->currentAction.isNull()) {
+        qCDebug(lcEmail) << Q_FUNC_INFO << "Activity" << activity << "without a current action, sender:" << sender();
+        return;
+    }
+    QSharedPointer<EmailAction> currentAction = lane->currentAction;
+
     switch (activity) {
     case QMailServiceAction::Failed: {
-        if (m_cancellingSingleAction) {
+        if (lane->preempting) {
+            // Stays in the queue and runs again after the more urgent actions
+            qCDebug(lcEmail) << "Action preempted:" << currentAction->description();
+            processNextAction(lane);
+            break;
+        }
+
+        if (lane->stalled) {
+            lane->stalled = false;
+            if (scheduleRetry(currentAction)) {
+                qCDebug(lcEmail) << "Stalled action rescheduled:" << currentAction->description();
+                processNextAction(lane);
+                scheduleRetryTimer();
+                break;
+            }
+        } else if (!lane->cancellingSingleAction && retryLater(lane, currentAction, status.errorCode)) {
+            // Stays in the queue, held until the retry time
+            qCDebug(lcEmail) << "Action failed with a transient error" << status.errorCode << status.text;
+            processNextAction(lane);
+            scheduleRetryTimer();
+            break;
+        }
+
+        if (lane->cancellingSingleAction) {
             qDebug(lcEmail) << Q_FUNC_INFO << "operation finished as failed while canceling. sender:" << sender();
         } else {
             // See qmailserviceaction.h for ErrorCodes
@@ -426,95 +784,34 @@ void EmailAgent::activityChanged(QMailServiceAction::Activity activity)
                                << "connection status:" << action->connectivity() << "sender:" << sender();
         }
 
-        dequeue();
-
-        bool sendFailed = false;
-
-        // TODO: need to handle some more cancel cases without warnings?
-        if (m_currentAction->type() == EmailAction::Transmit) {
-            m_transmitting = false;
-            sendFailed = true;
-            emit sendCompleted(false);
-            qCWarning(lcEmail) << "Error: Send failed";
-
-        } else if (m_currentAction->type() == EmailAction::Search) {
-            if (m_cancellingSingleAction) {
-                qCDebug(lcEmail) << "Search canceled by the user";
-                emitSearchStatusChanges(m_currentAction, EmailAgent::SearchCanceled);
-            } else {
-                qCWarning(lcEmail) << "Error: Search failed";
-                emitSearchStatusChanges(m_currentAction, EmailAgent::SearchFailed);
-            }
-
-        } else if (m_currentAction->type() == EmailAction::RetrieveMessagePart) {
-            RetrieveMessagePart* messagePartAction = static_cast<RetrieveMessagePart *>(m_currentAction.data());
-            if (messagePartAction->isAttachment()) {
-                // we assume cancelAttachmentDownload() does the status change signal
-                if (!m_cancellingSingleAction) {
-                    updateAttachmentDownloadStatus(messagePartAction->partLocation(), Failed);
-                    qCWarning(lcEmail) << "Attachment download failed for " << messagePartAction->partLocation();
-                }
-            } else {
-                emit messagePartDownloaded(messagePartAction->messageId(), messagePartAction->partLocation(), false);
-                qCWarning(lcEmail) << "Failed to download message part!!";
-            }
-
-        } else if (m_currentAction->type() == EmailAction::RetrieveMessages) {
-            RetrieveMessages* retrieveMessagesAction = static_cast<RetrieveMessages *>(m_currentAction.data());
-            emit messagesDownloaded(retrieveMessagesAction->messageIds(), false);
-            qCWarning(lcEmail) << "Failed to download messages";
-
-        } else if (m_currentAction->type() == EmailAction::CalendarInvitationResponse) {
-            if (m_currentAction->description().startsWith("eas-invitation-response")) {
-                EasInvitationResponse* responseAction = static_cast<EasInvitationResponse *>(m_currentAction.data());
-                if (responseAction) {
-                    emit calendarInvitationResponded(
-                                (CalendarInvitationResponse) responseAction->response(), false);
-                }
-            } else {
-                emit calendarInvitationResponded(InvitationResponseUnspecified, false);
-            }
-        }
-
-        if (m_currentAction->type() == EmailAction::OnlineCreateFolder) {
-            emit onlineFolderActionCompleted(ActionOnlineCreateFolder, false);
-        } else if (m_currentAction->type() == EmailAction::OnlineDeleteFolder) {
-            emit onlineFolderActionCompleted(ActionOnlineDeleteFolder, false);
-        } else if (m_currentAction->type() == EmailAction::OnlineRenameFolder) {
-            emit onlineFolderActionCompleted(ActionOnlineRenameFolder, false);
-        } else if (m_currentAction->type() == EmailAction::OnlineMoveFolder) {
-            emit onlineFolderActionCompleted(ActionOnlineMoveFolder, false);
-        } else if (!m_cancellingSingleAction && status.errorCode != QMailServiceAction::Status::ErrUnknownResponse) {
-            reportError(status.accountId, status.errorCode, sendFailed);
-        }
-
-        m_cancellingSingleAction = false;
-        processNextAction();
+        failCurrentAction(lane, status);
         break;
     }
     case QMailServiceAction::Successful:
-        dequeue();
+        dequeue(lane);
+        if (currentAction->needsNetworkConnection()) {
+            m_accountHealth.remove(lane->accountId);
+        }
 
-        if (m_currentAction->type() == EmailAction::Transmit) {
-            qCDebug(lcEmail) << "Finished sending for accountId:" << m_currentAction->accountId();
-            m_transmitting = false;
+        if (currentAction->type() == EmailAction::Transmit) {
+            qCDebug(lcEmail) << "Finished sending for accountId:" << currentAction->accountId();
             emit sendCompleted(true);
 
-        } else if (m_currentAction->type() == EmailAction::Search) {
+        } else if (currentAction->type() == EmailAction::Search) {
             qCDebug(lcEmail) << "Search done";
-            emitSearchStatusChanges(m_currentAction, EmailAgent::SearchDone);
+            emitSearchStatusChanges(currentAction, EmailAgent::SearchDone);
 
-        } else if (m_currentAction->type() == EmailAction::StandardFolders) {
-            QMailAccount *account = new QMailAccount(m_currentAction->accountId());
+        } else if (currentAction->type() == EmailAction::StandardFolders) {
+            QMailAccount *account = new QMailAccount(currentAction->accountId());
             account->setStatus(QMailAccount::statusMask("StandardFoldersRetrieved"), true);
             QMailStore::instance()->updateAccount(account);
-            emit standardFoldersCreated(m_currentAction->accountId());
+            emit standardFoldersCreated(currentAction->accountId());
 
-        } else if (m_currentAction->type() == EmailAction::RetrieveFolderList) {
-            emit folderRetrievalCompleted(m_currentAction->accountId());
+        } else if (currentAction->type() == EmailAction::RetrieveFolderList) {
+            emit folderRetrievalCompleted(currentAction->accountId());
 
-        } else if (m_currentAction->type() == EmailAction::RetrieveMessagePart) {
-            RetrieveMessagePart* messagePartAction = static_cast<RetrieveMessagePart *>(m_currentAction.data());
+        } else if (currentAction->type() == EmailAction::RetrieveMessagePart) {
+            RetrieveMessagePart* messagePartAction = static_cast<RetrieveMessagePart *>(currentAction.data());
             if (messagePartAction->isAttachment()) {
                 // Message and part structure can be updated during
                 // attachment download. It is safer to reload everything
@@ -524,53 +821,178 @@ void EmailAgent::activityChanged(QMailServiceAction::Activity activity)
                 emit messagePartDownloaded(messagePartAction->messageId(), messagePartAction->partLocation(), true);
             }
 
-        } else if (m_currentAction->type() == EmailAction::RetrieveMessages) {
-            RetrieveMessages* retrieveMessagesAction = static_cast<RetrieveMessages *>(m_currentAction.data());
+        } else if (currentAction->type() == EmailAction::RetrieveMessages) {
+            RetrieveMessages* retrieveMessagesAction = static_cast<RetrieveMessages *>(currentAction.data());
             emit messagesDownloaded(retrieveMessagesAction->messageIds(), true);
 
-        } else if (m_currentAction->type() == EmailAction::CalendarInvitationResponse) {
-            if (m_currentAction->description().startsWith("eas-invitation-response")) {
-                EasInvitationResponse* responseAction = static_cast<EasInvitationResponse *>(m_currentAction.data());
-                if (responseAction) {
-                    emit calendarInvitationResponded(
-                                (CalendarInvitationResponse) responseAction->response(), true);
-                }
+        } else if (currentAction->type() == EmailAction::CalendarInvitationResponse) {
+            EasInvitationResponse* responseAction = dynamic_cast<EasInvitationResponse *>(currentAction.data());
+            if (responseAction) {
+                emit calendarInvitationResponded(
+                            (CalendarInvitationResponse) responseAction->response(), true);
             } else {
                 emit calendarInvitationResponded(InvitationResponseUnspecified, true);
             }
 
-        } else if (m_currentAction->type() == EmailAction::OnlineCreateFolder) {
+        } else if (currentAction->type() == EmailAction::OnlineCreateFolder) {
             emit onlineFolderActionCompleted(ActionOnlineCreateFolder, true);
-        } else if (m_currentAction->type() == EmailAction::OnlineDeleteFolder) {
+        } else if (currentAction->type() == EmailAction::OnlineDeleteFolder) {
             emit onlineFolderActionCompleted(ActionOnlineDeleteFolder, true);
-        } else if (m_currentAction->type() == EmailAction::OnlineRenameFolder) {
+        } else if (currentAction->type() == EmailAction::OnlineRenameFolder) {
             emit onlineFolderActionCompleted(ActionOnlineRenameFolder, true);
-        } else if (m_currentAction->type() == EmailAction::OnlineMoveFolder) {
+        } else if (currentAction->type() == EmailAction::OnlineMoveFolder) {
             emit onlineFolderActionCompleted(ActionOnlineMoveFolder, true);
         }
 
-        processNextAction();
+        processNextAction(lane);
+        // Dependent steps are enqueued only once the lane has moved on
+        finishPlanStep(currentAction->id(), true);
         break;
 
     default:
         // emit activity changed here
         qCDebug(lcEmail) << "Activity State Changed:" << activity;
+        lane->lastActivity = m_queueClock.elapsed();
         break;
     }
 }
 
-void EmailAgent::onIpcConnectionEstablished()
+// Notifies about the failure of the current action and moves on to the next
+void EmailAgent::failCurrentAction(ActionLane *lane, const QMailServiceAction::Status &status)
 {
-    if (m_waitForIpc) {
-        m_waitForIpc = false;
-        if (m_currentAction.isNull())
-            m_currentAction = getNext();
+    const QSharedPointer<EmailAction> currentAction = lane->currentAction;
+    dequeue(lane);
+
+    bool sendFailed = false;
+
+    // TODO: need to handle some more cancel cases without warnings?
+    if (currentAction->type() == EmailAction::Transmit) {
+        sendFailed = true;
+        emit sendCompleted(false);
+        qCWarning(lcEmail) << "Error: Send failed";
+
+    } else if (currentAction->type() == EmailAction::Search) {
+        if (lane->cancellingSingleAction) {
+            qCDebug(lcEmail) << "Search canceled by the user";
+            emitSearchStatusChanges(currentAction, EmailAgent::SearchCanceled);
+        } else {
+            qCWarning(lcEmail) << "Error: Search failed";
+            emitSearchStatusChanges(currentAction, EmailAgent::SearchFailed);
+        }
+
+    } else if (currentAction->type() == EmailAction::RetrieveMessagePart) {
+        RetrieveMessagePart* messagePartAction = static_cast<RetrieveMessagePart *>(currentAction.data());
+        if (messagePartAction->isAttachment()) {
+            // we assume cancelAttachmentDownload() does the status change signal
+            if (!lane->cancellingSingleAction) {
+                updateAttachmentDownloadStatus(messagePartAction->partLocation(), Failed);
+                qCWarning(lcEmail) << "Attachment download failed for " << messagePartAction->partLocation();
+            }
+        } else {
+            emit messagePartDownloaded(messagePartAction->messageId(), messagePartAction->partLocation(), false);
+            qCWarning(lcEmail) << "Failed to download message part!!";
+        }
+
+    } else if (currentAction->type() == EmailAction::RetrieveMessages) {
+        RetrieveMessages* retrieveMessagesAction = static_cast<RetrieveMessages *>(currentAction.data());
+        emit messagesDownloaded(retrieveMessagesAction->messageIds(), false);
+        qCWarning(lcEmail) << "Failed to download messages";
+
+    } else if (currentAction->type() == EmailAction::CalendarInvitationResponse) {
+        EasInvitationResponse* responseAction = dynamic_cast<EasInvitationResponse *>(currentAction.data());
+        if (responseAction) {
+            emit calendarInvitationResponded(
+                        (CalendarInvitationResponse) responseAction->response(), false);
+        } else {
+            emit calendarInvitationResponded(InvitationResponseUnspecified, false);
+        }
+    }
+
+    if (currentAction->type() == EmailAction::OnlineCreateFolder) {
+        emit onlineFolderActionCompleted(ActionOnlineCreateFolder, false);
+    } else if (currentAction->type() == EmailAction::OnlineDeleteFolder) {
+        emit onlineFolderActionCompleted(ActionOnlineDeleteFolder, false);
+    } else if (currentAction->type() == EmailAction::OnlineRenameFolder) {
+        emit onlineFolderActionCompleted(ActionOnlineRenameFolder, false);
+    } else if (currentAction->type() == EmailAction::OnlineMoveFolder) {
+        emit onlineFolderActionCompleted(ActionOnlineMoveFolder, false);
+    } else if (!lane->cancellingSingleAction && status.errorCode != QMailServiceAction::Status::ErrUnknownResponse) {
+        reportError(status.accountId, status.errorCode, sendFailed);
+    }
+
+    lane->cancellingSingleAction = false;
+    processNextAction(lane);
+    finishPlanStep(currentAction->id(), false);
+}
+
+void EmailAgent::onAccountsRemoved(const QMailAccountIdList &ids)
+{
+    for (const QMailAccountId &accountId : ids) {
+        m_pendingExports.removeAll(accountId);
+        m_deferredExports.removeAll(accountId);
+        if (m_exportJournalIds.contains(accountId)) {
+            m_journal->remove(m_exportJournalIds.take(accountId));
+        }
+
+        for (QHash<QMailAccountId, QSharedPointer<ActionLane> > *lanes : { &m_lanes, &m_sendLanes }) {
+            const QSharedPointer<ActionLane> lane = lanes->take(accountId);
+            if (lane) {
+                retireLane(lane);
+            }
+        }
+
+        auto pipeline = m_attachmentPipelines.find(accountId);
+        if (pipeline != m_attachmentPipelines.end()) {
+            const QList<PendingAttachment> pending = pipeline->pending;
+            const QList<QSharedPointer<ActionLane> > attachmentLanes = pipeline->lanes;
+            m_attachmentPipelines.erase(pipeline);
+            for (const PendingAttachment &attachment : pending) {
+                updateAttachmentDownloadStatus(attachment.partLocation, Canceled);
+            }
+            for (const QSharedPointer<ActionLane> &lane : attachmentLanes) {
+                retireLane(lane);
+            }
+        }
+    }
+}
+
+// Lane of a removed account, a busy one is kept until its current action has finished
+void EmailAgent::retireLane(const QSharedPointer<ActionLane> &lane)
+{
+    if (lane->currentAction.isNull()) {
+        releaseLane(lane.data());
+        return;
+    }
+
+    lane->removed = true;
+    m_removedLanes.append(lane);
+    while (!lane->queue.isEmpty() && lane->queue.last() != lane->currentAction) {
+        removeFromQueue(lane.data(), lane->queue.size() - 1);
+    }
+    cancelCurrentAction(lane.data());
+}
 
-        if (m_currentAction.isNull()) {
-            qCDebug(lcEmail) << "Ipc connection established, but no action in the queue.";
+void EmailAgent::releaseLane(ActionLane *lane)
+{
+    while (!lane->queue.isEmpty()) {
+        removeFromQueue(lane, 0);
+    }
+    m_waitingLanes.removeAll(lane);
+    for (auto it = m_serviceLanes.begin(); it != m_serviceLanes.end();) {
+        if (it.value() == lane) {
+            it.key()->deleteLater();
+            it = m_serviceLanes.erase(it);
         } else {
-            executeCurrent();
+            ++it;
         }
+    }
+}
+
+void EmailAgent::onIpcConnectionEstablished()
+{
+    if (m_waitForIpc) {
+        m_waitForIpc = false;
+        resumeLanes();
         emit ipcConnectionEstablished();
     }
 }
@@ -579,14 +1001,7 @@ void EmailAgent::onOnlineStateChanged(bool isOnline)
 {
     qCDebug(lcEmail) << Q_FUNC_INFO << "Online State changed, device is now connected?" << isOnline;
     if (isOnline) {
-        if (m_currentAction.isNull())
-            m_currentAction = getNext();
-
-        if (m_currentAction.isNull()) {
-            qCDebug(lcEmail) << "Network connection established, but no action in the queue.";
-        } else {
-            executeCurrent();
-        }
+        resumeLanes();
     } else {
         if (m_synchronizing) {
             qCDebug(lcEmail) <<  "Canceling synchronizing";
@@ -597,9 +1012,12 @@ void EmailAgent::onOnlineStateChanged(bool isOnline)
             m_accountSynchronizing = 0;
             emit currentSynchronizingAccountIdChanged();
         }
-        if (!m_currentAction.isNull() && m_currentAction->needsNetworkConnection() && m_currentAction->serviceAction()->isRunning()) {
-            // TODO: should this be responsibility of the backend? cancelOperation is kind of hinted being a user initiated action.
-            m_currentAction->serviceAction()->cancelOperation();
+        for (const QSharedPointer<ActionLane> &lane : allLanes()) {
+            const QSharedPointer<EmailAction> &currentAction = lane->currentAction;
+            if (!currentAction.isNull() && currentAction->needsNetworkConnection() && currentAction->serviceAction()->isRunning()) {
+                // TODO: should this be responsibility of the backend? cancelOperation is kind of hinted being a user initiated action.
+                currentAction->serviceAction()->cancelOperation();
+            }
         }
     }
 }
@@ -607,9 +1025,15 @@ void EmailAgent::onOnlineStateChanged(bool isOnline)
 // Note: values from here are not byte sizes, it's something like "indicative size" which qmf defines internally as size in kilobytes
 void EmailAgent::progressChanged(uint value, uint total)
 {
+    ActionLane *lane = m_serviceLanes.value(static_cast<QMailServiceAction *>(sender()));
+    if (!lane || lane->currentAction.isNull()) {
+        return;
+    }
+    lane->lastActivity = m_queueClock.elapsed();
+
     // Attachment download, do not spam the UI check should be done here
-    if (value < total && m_currentAction->type() == EmailAction::RetrieveMessagePart) {
-        RetrieveMessagePart* messagePartAction = static_cast<RetrieveMessagePart *>(m_currentAction.data());
+    if (value < total && lane->currentAction->type() == EmailAction::RetrieveMessagePart) {
+        RetrieveMessagePart* messagePartAction = static_cast<RetrieveMessagePart *>(lane->currentAction.data());
         if (messagePartAction->isAttachment()) {
             QString location = messagePartAction->partLocation();
             if (m_attachmentDownloadQueue.contains(location)) {
@@ -674,7 +1098,7 @@ void EmailAgent::createFolder(const QString &name, int mailAccountId, int parent
 
         QMailFolderId parentId(parentFolderId);
 
-        enqueue(new OnlineCreateFolder(m_storageAction.data(), name, accountId, parentId));
+        enqueue(new OnlineCreateFolder(storageAction(accountId), name, accountId, parentId));
     }
 }
 
@@ -683,7 +1107,7 @@ void EmailAgent::deleteFolder(int folderId)
     QMailFolderId id(folderId);
     Q_ASSERT(id.isValid());
 
-    enqueue(new OnlineDeleteFolder(m_storageAction.data(), id));
+    enqueue(new OnlineDeleteFolder(storageAction(QMailFolder(id).parentAccountId()), id));
 }
 
 void EmailAgent::deleteMessage(int messageId)
@@ -716,7 +1140,7 @@ void EmailAgent::deleteMessages(const QMailMessageIdList &ids)
 {
     Q_ASSERT(!ids.isEmpty());
 
-    if (m_transmitting) {
+    if (isTransmitting()) {
         // Do not delete messages from the outbox folder while we're sending
         QMailMessageKey outboxFilter(QMailMessageKey::status(QMailMessage::Outbox));
         if (QMailStore::instance()->countMessages(QMailMessageKey::id(ids) & outboxFilter)) {
@@ -725,20 +1149,9 @@ void EmailAgent::deleteMessages(const QMailMessageIdList &ids)
         }
     }
 
-    bool exptUpdates;
+    bool exptUpdates = false;
 
-    QMap<QMailAccountId, QMailMessageIdList> accountMap;
-    // Messages can be from several accounts
-    for (const QMailMessageId &id : ids) {
-        QMailAccountId accountId = accountForMessageId(id);
-        if (accountMap.contains(accountId)) {
-            QMailMessageIdList idList = accountMap.value(accountId);
-            idList.append(id);
-            accountMap.insert(accountId, idList);
-        } else {
-            accountMap.insert(accountId, QMailMessageIdList() << id);
-        }
-    }
+    const QMap<QMailAccountId, QMailMessageIdList> accountMap = messagesByAccount(ids);
 
     // If any of these messages are not yet trash, then we're only moved to trash
     QMailMessageKey idFilter(QMailMessageKey::id(ids));
@@ -756,8 +1169,7 @@ void EmailAgent::deleteMessages(const QMailMessageIdList &ids)
             idsToRemove = (ids.toSet().subtract(localOnlyIds.toSet())).toList();
         }
         if (!idsToRemove.isEmpty()) {
-            m_enqueing = true;
-            enqueue(new DeleteMessages(m_storageAction.data(), idsToRemove));
+            enqueue(new DeleteMessages(m_localLane->storageAction, idsToRemove));
             exptUpdates = true;
         }
     } else {
@@ -771,12 +1183,8 @@ void EmailAgent::deleteMessages(const QMailMessageIdList &ids)
                 qCDebug(lcEmail) << "Trash folder not found using local storage";
                 trashFolderId = QMailFolderId::LocalStorageFolderId;
             }
-            m_enqueing = true;
-            enqueue(new MoveToFolder(m_storageAction.data(), iter.value(), trashFolderId));
-            enqueue(new FlagMessages(m_storageAction.data(), iter.value(), QMailMessage::Trash, 0));
-            if (!iter.hasNext()) {
-                m_enqueing = false;
-            }
+            enqueue(new MoveToFolder(m_localLane->storageAction, iter.value(), trashFolderId));
+            enqueue(new FlagMessages(m_localLane->storageAction, iter.value(), QMailMessage::Trash, 0));
         }
         exptUpdates = true;
     }
@@ -791,20 +1199,10 @@ void EmailAgent::deleteMessages(const QMailMessageIdList &ids)
 
 void EmailAgent::expungeMessages(const QMailMessageIdList &ids)
 {
-    m_enqueing = true;
-    enqueue(new DeleteMessages(m_storageAction.data(), ids));
-
-    QMailAccountIdList accountList;
-    // Messages can be from several accounts
-    for (const QMailMessageId &id : ids) {
-        QMailAccountId accountId = accountForMessageId(id);
-        if (!accountList.contains(accountId)) {
-            accountList.append(accountId);
-        }
-    }
+    enqueue(new DeleteMessages(m_localLane->storageAction, ids));
 
     // Export updates for all accounts that we deleted messages from
-    exportUpdates(accountList);
+    exportUpdates(messagesByAccount(ids).keys());
 }
 
 /*!
@@ -829,7 +1227,7 @@ bool EmailAgent::downloadAttachment(QMailMessage *message, const QString &attach
         } else {
             qCDebug(lcEmail) << "Start Download for:" << attachmentLocation;
             location.setContainingMessageId(message->id());
-            enqueue(new RetrieveMessagePart(m_retrievalAction.data(), location, true));
+            enqueueAttachment(*message, location);
         }
     } else {
         qCDebug(lcEmail) << "ERROR: Attachment location not found:" << attachmentLocation;
@@ -840,7 +1238,21 @@ bool EmailAgent::downloadAttachment(QMailMessage *message, const QString &attach
 void EmailAgent::cancelAttachmentDownload(const QString &attachmentLocation)
 {
     if (m_attachmentDownloadQueue.contains(attachmentLocation)) {
-        cancelAction(m_attachmentDownloadQueue.value(attachmentLocation).actionId);
+        const quint64 actionId = m_attachmentDownloadQueue.value(attachmentLocation).actionId;
+        if (actionId) {
+            cancelAction(actionId);
+        } else {
+            // Still waiting for a free lane
+            for (AttachmentPipeline &pipeline : m_attachmentPipelines) {
+                for (int i = 0; i < pipeline.pending.size(); ++i) {
+                    if (pipeline.pending.at(i).partLocation == attachmentLocation) {
+                        pipeline.pending.removeAt(i);
+                        break;
+                    }
+                }
+            }
+        }
+        m_attachmentWriter->cancel(attachmentLocation);
         updateAttachmentDownloadStatus(attachmentLocation, Canceled);
     }
 }
@@ -850,7 +1262,7 @@ void EmailAgent::exportUpdates(int accountId)
     QMailAccountId acctId(accountId);
 
     if (acctId.isValid()) {
-        exportUpdates(QMailAccountIdList() << acctId);
+        exportUpdatesNow(QMailAccountIdList() << acctId);
     }
 }
 
@@ -862,7 +1274,10 @@ void EmailAgent::getMoreMessages(int folderId, uint minimum)
         QMailMessageKey countKey(QMailMessageKey::parentFolderId(foldId));
         countKey &= ~QMailMessageKey::status(QMailMessage::Temporary);
         minimum += QMailStore::instance()->countMessages(countKey);
-        enqueue(new RetrieveMessageList(m_retrievalAction.data(), folder.parentAccountId(), foldId, minimum));
+        EmailAction *action = new RetrieveMessageList(retrievalAction(folder.parentAccountId()),
+                                                      folder.parentAccountId(), foldId, minimum);
+        action->setPriority(EmailAction::ForegroundRefreshPriority);
+        enqueue(action);
     }
 }
 
@@ -967,7 +1382,7 @@ void EmailAgent::moveFolder(int folderId, int parentFolderId)
         qCDebug(lcEmail) << "Error: Invalid folderId specified for moveFolder: " << folderId;
     } else {
         QMailFolderId parentId(parentFolderId);
-        enqueue(new OnlineMoveFolder(m_storageAction.data(), id, parentId));
+        enqueue(new OnlineMoveFolder(storageAction(QMailFolder(id).parentAccountId()), id, parentId));
     }
 }
 
@@ -979,7 +1394,7 @@ void EmailAgent::renameFolder(int folderId, const QString &name)
         QMailFolderId id(folderId);
         Q_ASSERT(id.isValid());
 
-        enqueue(new OnlineRenameFolder(m_storageAction.data(),id, name));
+        enqueue(new OnlineRenameFolder(storageAction(QMailFolder(id).parentAccountId()), id, name));
     }
 }
 
@@ -989,7 +1404,7 @@ void EmailAgent::retrieveFolderList(int accountId, int folderId, bool descending
     QMailFolderId foldId(folderId);
 
     if (acctId.isValid()) {
-        enqueue(new RetrieveFolderList(m_retrievalAction.data(), acctId, foldId, descending));
+        enqueue(new RetrieveFolderList(retrievalAction(acctId), acctId, foldId, descending));
     }
 }
 
@@ -999,14 +1414,16 @@ void EmailAgent::retrieveMessageList(int accountId, int folderId, uint minimum)
     QMailFolderId foldId(folderId);
 
     if (acctId.isValid()) {
-        enqueue(new RetrieveMessageList(m_retrievalAction.data(), acctId, foldId, minimum));
+        EmailAction *action = new RetrieveMessageList(retrievalAction(acctId), acctId, foldId, minimum);
+        action->setPriority(EmailAction::ForegroundRefreshPriority);
+        enqueue(action);
     }
 }
 
 void EmailAgent::retrieveMessageRange(int messageId, uint minimum)
 {
     QMailMessageId id(messageId);
-    enqueue(new RetrieveMessageRange(m_retrievalAction.data(), id, minimum));
+    enqueue(new RetrieveMessageRange(retrievalAction(accountForMessageId(id)), id, minimum));
 }
 
 void EmailAgent::processSendingQueue(int accountId)
@@ -1029,11 +1446,11 @@ void EmailAgent::synchronize(int accountId, uint minimum)
     if (messagesToSend) {
         m_enqueing = true;
     }
-    enqueue(new Synchronize(m_retrievalAction.data(), acctId, minimum));
+    enqueue(new Synchronize(retrievalAction(acctId), acctId, minimum));
     if (messagesToSend) {
         m_enqueing = false;
         // Send any message waiting in the outbox
-        enqueue(new TransmitMessages(m_transmitAction.data(), acctId));
+        enqueue(new TransmitMessages(transmitAction(acctId), acctId));
     }
 }
 
@@ -1047,52 +1464,33 @@ void EmailAgent::synchronizeInbox(int accountId, uint minimum)
 
     QMailAccount account(acctId);
     QMailFolderId foldId = account.standardFolder(QMailFolder::InboxFolder);
+    QSharedPointer<SyncPlan> plan(new SyncPlan);
     if (foldId.isValid()) {
-        bool messagesToSend = hasMessagesInOutbox(acctId);
-        m_enqueing = true;
-        enqueue(new ExportUpdates(m_retrievalAction.data(), acctId));
-        enqueue(new RetrieveFolderList(m_retrievalAction.data(), acctId, QMailFolderId(), true));
-        if (!messagesToSend) {
-            m_enqueing = false;
-        }
-        enqueue(new RetrieveMessageList(m_retrievalAction.data(), acctId, foldId, minimum));
-        if (messagesToSend) {
-            m_enqueing = false;
+        // Local changes go to the server before the inbox is fetched again,
+        // the folder list and the outbox do not depend on anything
+        const int exportStep = plan->addStep(new ExportUpdates(retrievalAction(acctId), acctId));
+        plan->addStep(new RetrieveFolderList(retrievalAction(acctId), acctId, QMailFolderId(), true));
+        plan->addStep(new RetrieveMessageList(retrievalAction(acctId), acctId, foldId, minimum),
+                      QList<int>() << exportStep);
+        if (hasMessagesInOutbox(acctId)) {
             // send any message in the outbox
-            enqueue(new TransmitMessages(m_transmitAction.data(), acctId));
+            plan->addStep(new TransmitMessages(transmitAction(acctId), acctId));
         }
 
     } else { //Account was never synced, retrieve list of folders and come back here.
-
-        connect(this, &EmailAgent::standardFoldersCreated,
-                this, [=](const QMailAccountId &acctId) {
-                    QMailAccount account(acctId);
-                    QMailFolderId foldId = account.standardFolder(QMailFolder::InboxFolder);
-                    if (foldId.isValid()) {
-                        synchronizeInbox(acctId.toULongLong(), minimum);
-                    } else {
-                        qCCritical(lcEmail) << "Error: Inbox not found!!!";
-                    }
-                });
-        m_enqueing = true;
-        enqueue(new RetrieveFolderList(m_retrievalAction.data(), acctId, QMailFolderId(), true));
-        m_enqueing = false;
-        enqueue(new CreateStandardFolders(m_retrievalAction.data(), acctId));
-    }
-}
-
-static bool isAncestorFolder(const QMailFolder &folder, const QMailFolderId &ancestor)
-{
-    if (folder.status() & QMailFolder::NonMail) {
-        return false;
-    }
-    QMailFolderId parentId = folder.parentFolderId();
-    if (!parentId.isValid()) {
-        return false;
-    } else {
-        return parentId == ancestor
-            || isAncestorFolder(QMailFolder(parentId), ancestor);
+        const int folderListStep = plan->addStep(new RetrieveFolderList(retrievalAction(acctId), acctId, QMailFolderId(), true));
+        plan->addStep(new CreateStandardFolders(retrievalAction(acctId), acctId),
+                      QList<int>() << folderListStep);
+        plan->completed = [=]() {
+            QMailAccount account(acctId);
+            if (account.standardFolder(QMailFolder::InboxFolder).isValid()) {
+                synchronizeInbox(accountId, minimum);
+            } else {
+                qCCritical(lcEmail) << "Error: Inbox not found!!!";
+            }
+        };
     }
+    startPlan(plan);
 }
 
 void EmailAgent::respondToCalendarInvitation(int messageId, CalendarInvitationResponse response,
@@ -1195,40 +1593,184 @@ bool EmailAgent::easCalendarInvitationResponse(const QMailMessage &message,
         return true;
     }
 
-    enqueue(new EasInvitationResponse(m_protocolAction.data(), message.parentAccountId(),
+    enqueue(new EasInvitationResponse(protocolAction(message.parentAccountId()), message.parentAccountId(),
                                       response, message.id(), responseMsg.id()));
-    exportUpdates(QMailAccountIdList() << message.parentAccountId());
+    exportUpdatesNow(QMailAccountIdList() << message.parentAccountId());
     return true;
 }
 
 // ############## Private API #########################
 
-bool EmailAgent::actionInQueue(QSharedPointer<EmailAction> action) const
+EmailAgent::ActionLane *EmailAgent::lane(const QMailAccountId &accountId)
 {
-    // check current first, there's chances that
+    QSharedPointer<ActionLane> &accountLane = m_lanes[accountId];
+    if (accountLane.isNull()) {
+        accountLane.reset(new ActionLane);
+        accountLane->accountId = accountId;
+        accountLane->retrievalAction = new QMailRetrievalAction(this);
+        accountLane->storageAction = new QMailStorageAction(this);
+        accountLane->protocolAction = new QMailProtocolAction(this);
+        addServiceAction(accountLane.data(), accountLane->retrievalAction);
+        addServiceAction(accountLane.data(), accountLane->storageAction);
+        addServiceAction(accountLane.data(), accountLane->protocolAction);
+        qCDebug(lcEmail) << "Created action lane for account:" << accountId;
+    }
+    return accountLane.data();
+}
+
+EmailAgent::ActionLane *EmailAgent::sendLane(const QMailAccountId &accountId)
+{
+    if (!accountId.isValid()) {
+        return lane(accountId);
+    }
+
+    QSharedPointer<ActionLane> &accountLane = m_sendLanes[accountId];
+    if (accountLane.isNull()) {
+        accountLane.reset(new ActionLane);
+        accountLane->accountId = accountId;
+        accountLane->transmitAction = new QMailTransmitAction(this);
+        addServiceAction(accountLane.data(), accountLane->transmitAction);
+        qCDebug(lcEmail) << "Created send lane for account:" << accountId;
+    }
+    return accountLane.data();
+}
+
+void EmailAgent::addServiceAction(ActionLane *lane, QMailServiceAction *serviceAction)
+{
+    m_serviceLanes.insert(serviceAction, lane);
+    if (QMailSearchAction *searchAction = qobject_cast<QMailSearchAction *>(serviceAction)) {
+        connect(searchAction, &QMailSearchAction::messageIdsMatched,
+                this, &EmailAgent::searchMessageIdsMatched);
+    }
+    connect(serviceAction, &QMailServiceAction::activityChanged,
+            this, &EmailAgent::activityChanged);
+    connect(serviceAction, &QMailServiceAction::progressChanged,
+            this, &EmailAgent::progressChanged);
+}
+
+// Leaves behind a service action that does not finish even when cancelled,
+// the lane and the actions queued on it continue on a new one
+void EmailAgent::replaceServiceAction(ActionLane *lane, QMailServiceAction *serviceAction)
+{
+    QMailServiceAction *replacement = nullptr;
+    if (serviceAction == lane->retrievalAction) {
+        lane->retrievalAction = new QMailRetrievalAction(this);
+        replacement = lane->retrievalAction;
+    } else if (serviceAction == lane->storageAction) {
+        lane->storageAction = new QMailStorageAction(this);
+        replacement = lane->storageAction;
+    } else if (serviceAction == lane->transmitAction) {
+        lane->transmitAction = new QMailTransmitAction(this);
+        replacement = lane->transmitAction;
+    } else if (serviceAction == lane->protocolAction) {
+        lane->protocolAction = new QMailProtocolAction(this);
+        replacement = lane->protocolAction;
+    } else if (serviceAction == lane->searchAction) {
+        lane->searchAction = new QMailSearchAction(this);
+        replacement = lane->searchAction;
+    } else {
+        qCWarning(lcEmail) << Q_FUNC_INFO << "Service action not in the lane:" << serviceAction;
+        return;
+    }
+
+    m_serviceLanes.remove(serviceAction);
+    disconnect(serviceAction, nullptr, this, nullptr);
+    serviceAction->deleteLater();
+    addServiceAction(lane, replacement);
+
+    for (const QSharedPointer<EmailAction> &action : lane->queue) {
+        if (action->serviceAction() == serviceAction) {
+            action->setServiceAction(replacement);
+        }
+    }
+}
+
+QMailRetrievalAction *EmailAgent::retrievalAction(const QMailAccountId &accountId)
+{
+    return lane(accountId)->retrievalAction;
+}
+
+QMailStorageAction *EmailAgent::storageAction(const QMailAccountId &accountId)
+{
+    return lane(accountId)->storageAction;
+}
+
+QMailTransmitAction *EmailAgent::transmitAction(const QMailAccountId &accountId)
+{
+    return sendLane(accountId)->transmitAction;
+}
+
+QMailProtocolAction *EmailAgent::protocolAction(const QMailAccountId &accountId)
+{
+    return lane(accountId)->protocolAction;
+}
+
+bool EmailAgent::actionInQueue(ActionLane *lane, QSharedPointer<EmailAction> action) const
+{
+    // check current first, there's chances that
     // user taps same action several times.
-    if (!m_currentAction.isNull()
-        && *(m_currentAction.data()) == *(action.data())) {
+    if (!lane->currentAction.isNull()
+        && *(lane->currentAction.data()) == *(action.data())) {
         return true;
     } else {
-        return actionInQueueId(action) != quint64(0);
+        return actionInQueueId(lane, action) != quint64(0);
+    }
+}
+
+quint64 EmailAgent::actionInQueueId(ActionLane *lane, QSharedPointer<EmailAction> action) const
+{
+    return lane->keys.value(action->key());
+}
+
+void EmailAgent::dequeue(ActionLane *lane)
+{
+    if (!lane->queue.isEmpty()) {
+        removeFromQueue(lane, 0);
     }
 }
 
-quint64 EmailAgent::actionInQueueId(QSharedPointer<EmailAction> action) const
+// Returns the id of the queued action the given one was merged into, 0 if not merged
+quint64 EmailAgent::coalesce(ActionLane *lane, QSharedPointer<EmailAction> action)
 {
-    for (const QSharedPointer<EmailAction> &a : m_actionQueue) {
-        if (*(a.data()) == *(action.data())) {
-            return a.data()->id();
+    // Merged with the newest compatible action, as long as no action in
+    // between is about the same messages, so the changes keep their order
+    QSet<QMailMessageId> messageIds;
+    for (const QMailMessageId &id : action->messageIds()) {
+        messageIds.insert(id);
+    }
+
+    for (int i = lane->queue.size() - 1; i >= 0; --i) {
+        const QSharedPointer<EmailAction> &queued = lane->queue.at(i);
+        if (queued == lane->currentAction) {
+            return 0;
+        }
+
+        const EmailActionKey key = queued->key();
+        if (key.kind == action->key().kind && queued->accountId() == action->accountId()
+                && queued->merge(*action)) {
+            lane->keys.remove(key);
+            lane->keys.insert(queued->key(), queued->id());
+            qCDebug(lcEmail) << "Merged into queued action:" << queued->description();
+            return queued->id();
+        }
+
+        for (const QMailMessageId &id : queued->messageIds()) {
+            if (messageIds.contains(id)) {
+                return 0;
+            }
         }
     }
-    return quint64(0);
+    return 0;
 }
 
-void EmailAgent::dequeue()
+void EmailAgent::removeFromQueue(ActionLane *lane, int index)
 {
-    if (!m_actionQueue.isEmpty()) {
-        m_actionQueue.removeFirst();
+    const QSharedPointer<EmailAction> action = lane->queue.takeAt(index);
+    lane->keys.remove(action->key());
+    m_actionLanes.remove(action->id());
+    m_journal->remove(action->id());
+    if (isBatched(*action) && m_batchUntil > m_queueClock.elapsed()) {
+        emit batchChanged();
     }
 }
 
@@ -1236,7 +1778,8 @@ quint64 EmailAgent::enqueue(EmailAction *actionPointer)
 {
     Q_ASSERT(actionPointer);
     QSharedPointer<EmailAction> action(actionPointer);
-    bool foundAction = actionInQueue(action);
+    ActionLane *actionLane = m_serviceLanes.value(action->serviceAction(), lane(QMailAccountId()));
+    bool foundAction = actionInQueue(actionLane, action);
 
     static bool forceOffline = false;
     static bool forceOfflineChecked = false;
@@ -1262,31 +1805,81 @@ quint64 EmailAgent::enqueue(EmailAction *actionPointer)
             return quint64(0);
         }
 
+        // Pending local changes of the same kind are stored in one go
+        if (actionLane == m_localLane.data()) {
+            if (const quint64 mergedId = coalesce(actionLane, action)) {
+                return mergedId;
+            }
+        }
+
         // It's a new action.
         action->setId(newAction());
+        action->setEnqueueTime(m_queueClock.elapsed());
 
         // Attachment download
         if (action->type() == EmailAction::RetrieveMessagePart) {
             RetrieveMessagePart* messagePartAction = static_cast<RetrieveMessagePart *>(action.data());
             if (messagePartAction->isAttachment()) {
-                AttachmentInfo attInfo;
-                attInfo.status = Queued;
+                AttachmentInfo &attInfo = m_attachmentDownloadQueue[messagePartAction->partLocation()];
                 attInfo.actionId = action->id();
-                m_attachmentDownloadQueue.insert(messagePartAction->partLocation(), attInfo);
-                emit attachmentDownloadStatusChanged(messagePartAction->partLocation(), attInfo.status);
+                // Reported already when it started waiting for a free lane
+                if (attInfo.status != Queued) {
+                    attInfo.status = Queued;
+                    emit attachmentDownloadStatusChanged(messagePartAction->partLocation(), attInfo.status);
+                }
+            }
+        }
+
+        actionLane->queue.append(action);
+        actionLane->keys.insert(action->key(), action->id());
+        m_actionLanes.insert(action->id(), actionLane);
+
+        ActionJournal::Entry entry;
+        if (journalEntry(action.data(), &entry)) {
+            m_journal->add(action->id(), entry);
+        }
+
+        if (isBatched(*action)) {
+            const qint64 now = m_queueClock.elapsed();
+            if (m_batchUntil <= now && !isNetworkActive()) {
+                // Nothing keeps the radio up now, wait for more work to go with this
+                m_batchUntil = now + BatchWindow;
+                scheduleRetryTimer();
+            }
+            if (m_batchUntil > now) {
+                emit batchChanged();
             }
         }
 
-        m_actionQueue.append(action);
+        preemptFor(actionLane, action);
+    } else {
+        // Asked for again, maybe more urgently this time
+        const quint64 queuedId = actionInQueueId(actionLane, action);
+        for (const QSharedPointer<EmailAction> &queued : actionLane->queue) {
+            if ((queued->id() == queuedId || queued == actionLane->currentAction)
+                    && *queued == *action && queued->priority() < action->priority()) {
+                qCDebug(lcEmail) << "Raising priority of queued action:" << queued->description();
+                queued->setPriority(action->priority());
+                preemptFor(actionLane, queued);
+                break;
+            }
+        }
     }
 
-    if (!m_enqueing && (m_currentAction.isNull() || !m_currentAction->serviceAction()->isRunning())) {
-        // Nothing is running or current action is in waiting state, start first action.
-        QSharedPointer<EmailAction> nextAction = getNext();
-        if (m_currentAction.isNull()
-                || (!nextAction.isNull() && (*(m_currentAction.data()) != *(nextAction.data())))) {
-            m_currentAction = nextAction;
-            executeCurrent();
+    if (!m_enqueing) {
+        // A batch enqueued with m_enqueing can span several lanes, start them all
+        for (const QSharedPointer<ActionLane> &lane : allLanes()) {
+            if (lane->currentAction.isNull() || !lane->currentAction->serviceAction()->isRunning()) {
+                // Nothing is running or current action is in waiting state, start first action.
+                QSharedPointer<EmailAction> nextAction = getNext(lane.data());
+                if (lane->currentAction.isNull()
+                        || (!nextAction.isNull() && (*(lane->currentAction.data()) != *(nextAction.data())))) {
+                    lane->currentAction = nextAction;
+                    if (!nextAction.isNull()) {
+                        executeCurrent(lane.data());
+                    }
+                }
+            }
         }
     }
 
@@ -1294,80 +1887,334 @@ quint64 EmailAgent::enqueue(EmailAction *actionPointer)
         return action->id();
     } else {
         qCDebug(lcEmail) << "This request already exists in the queue:" << action->description();
-        qCDebug(lcEmail) << "Number of actions in the queue:" << m_actionQueue.size();
-        return actionInQueueId(action);
+        qCDebug(lcEmail) << "Number of actions in the queue:" << actionLane->queue.size();
+        return actionInQueueId(actionLane, action);
     }
 }
 
-void EmailAgent::executeCurrent()
+// Background work yields to what the user is waiting for, it is queued again
+void EmailAgent::preemptFor(ActionLane *lane, const QSharedPointer<EmailAction> &action)
 {
-    Q_ASSERT (!m_currentAction.isNull());
+    const QSharedPointer<EmailAction> currentAction = lane->currentAction;
+    if (action->priority() >= EmailAction::AttachmentPriority && !currentAction.isNull()
+            && currentAction != action
+            && agedPriority(*currentAction, m_queueClock.elapsed()) <= EmailAction::BackgroundSyncPriority
+            && currentAction->serviceAction()->isRunning() && !lane->cancellingSingleAction
+            && !lane->preempting && !lane->stalled) {
+        qCDebug(lcEmail) << "Preempting action:" << currentAction->description()
+                         << "for:" << action->description();
+        lane->preempting = true;
+        currentAction->serviceAction()->cancelOperation();
+    }
+}
+
+void EmailAgent::replayJournal()
+{
+    const QList<ActionJournal::Entry> entries = m_journal->takePending();
+    for (const ActionJournal::Entry &entry : entries) {
+        if (entry.accountId.isValid()
+                && !QMailStore::instance()->countAccounts(QMailAccountKey::id(entry.accountId))) {
+            continue;
+        }
+
+        qCDebug(lcEmail) << "Resuming journaled action:" << entry.kind << entry.accountId << entry.messageId;
+        if (entry.kind == QLatin1String("exporting-updates")) {
+            enqueue(new ExportUpdates(retrievalAction(entry.accountId), entry.accountId));
+        } else if (entry.kind == QLatin1String("transmit-messages")) {
+            enqueue(new TransmitMessages(transmitAction(entry.accountId), entry.accountId));
+        } else if (entry.kind == QLatin1String("transmit-message")
+                   && QMailStore::instance()->countMessages(QMailMessageKey::id(entry.messageId)
+                                                            & QMailMessageKey::status(QMailMessage::Outbox))) {
+            // Left the outbox if it was sent before the process ended
+            enqueue(new TransmitMessage(transmitAction(accountForMessageId(entry.messageId)), entry.messageId));
+        }
+    }
+}
+
+int EmailAgent::SyncPlan::addStep(EmailAction *action, const QList<int> &dependencies)
+{
+    PlanStep step;
+    step.action = action;
+    step.dependencies = dependencies;
+    steps.append(step);
+    return steps.size() - 1;
+}
+
+void EmailAgent::startPlan(const QSharedPointer<SyncPlan> &plan)
+{
+    m_plans.append(plan);
+    runPlan(plan);
+}
+
+void EmailAgent::runPlan(const QSharedPointer<SyncPlan> &plan)
+{
+    // Dependencies always point to earlier steps, a single pass
+    // sees failures propagate down to every dependent step
+    bool finished = true;
+    bool succeeded = true;
+    for (PlanStep &step : plan->steps) {
+        if (step.state == PlanStep::Waiting) {
+            bool ready = true;
+            for (int dependency : step.dependencies) {
+                const PlanStep::State state = plan->steps.at(dependency).state;
+                if (state == PlanStep::Failed) {
+                    qCDebug(lcEmail) << "Dropping plan step after a failed dependency:" << step.action->description();
+                    delete step.action;
+                    step.action = nullptr;
+                    step.state = PlanStep::Failed;
+                    ready = false;
+                    break;
+                } else if (state != PlanStep::Succeeded) {
+                    ready = false;
+                }
+            }
+
+            if (ready) {
+                EmailAction *action = step.action;
+                step.action = nullptr;
+                step.actionId = enqueue(action);
+                step.state = step.actionId ? PlanStep::Queued : PlanStep::Failed;
+            }
+        }
+
+        if (step.state == PlanStep::Waiting || step.state == PlanStep::Queued) {
+            finished = false;
+        } else if (step.state == PlanStep::Failed) {
+            succeeded = false;
+        }
+    }
+
+    if (finished) {
+        m_plans.removeAll(plan);
+        if (succeeded && plan->completed) {
+            plan->completed();
+        }
+    }
+}
+
+void EmailAgent::finishPlanStep(quint64 actionId, bool success)
+{
+    // Finishing a plan can start a new one
+    const QList<QSharedPointer<SyncPlan> > plans = m_plans;
+    for (const QSharedPointer<SyncPlan> &plan : plans) {
+        bool changed = false;
+        for (PlanStep &step : plan->steps) {
+            if (step.state == PlanStep::Queued && step.actionId == actionId) {
+                step.state = success ? PlanStep::Succeeded : PlanStep::Failed;
+                changed = true;
+            }
+        }
+        if (changed) {
+            runPlan(plan);
+        }
+    }
+}
+
+void EmailAgent::executeCurrent(ActionLane *lane)
+{
+    Q_ASSERT (!lane->currentAction.isNull());
+    const QSharedPointer<EmailAction> currentAction = lane->currentAction;
 
     if (!QMailStore::instance()->isIpcConnectionEstablished()) {
         qCWarning(lcEmail) << "Ipc connection not established, can't execute service action";
         m_waitForIpc = true;
-    } else if (m_currentAction->needsNetworkConnection() && !isOnline()) {
+    } else if (currentAction->needsNetworkConnection() && !isOnline()) {
         qCDebug(lcEmail) << "Current action not executed, waiting for network";
+    } else if (heldUntil(lane, *currentAction) > m_queueClock.elapsed()) {
+        qCDebug(lcEmail) << "Current action held after failures:" << currentAction->description();
+    } else if (usesSlot(lane) && !lane->running && m_runningLanes >= MaxRunningLanes) {
+        if (!m_waitingLanes.contains(lane)) {
+            qCDebug(lcEmail) << "All action lanes busy, waiting:" << currentAction->description();
+            // Lanes with something the user waits for get the next free slot
+            if (currentAction->priority() >= EmailAction::AttachmentPriority) {
+                m_waitingLanes.prepend(lane);
+            } else {
+                m_waitingLanes.append(lane);
+            }
+        }
     } else {
+        if (usesSlot(lane) && !lane->running) {
+            lane->running = true;
+            ++m_runningLanes;
+        }
+        m_waitingLanes.removeAll(lane);
+
         if (!m_synchronizing) {
             m_synchronizing = true;
             emit synchronizingChanged();
         }
 
-        QMailAccountId aId = m_currentAction->accountId();
+        QMailAccountId aId = currentAction->accountId();
         if (aId.isValid() && m_accountSynchronizing != aId.toULongLong()) {
             m_accountSynchronizing = aId.toULongLong();
             emit currentSynchronizingAccountIdChanged();
         }
 
-        qCDebug(lcEmail) << "Executing action:" << m_currentAction->description();
+        qCDebug(lcEmail) << "Executing action:" << currentAction->description();
 
         // Attachment download
-        if (m_currentAction->type() == EmailAction::RetrieveMessagePart) {
-            RetrieveMessagePart* messagePartAction = static_cast<RetrieveMessagePart *>(m_currentAction.data());
+        if (currentAction->type() == EmailAction::RetrieveMessagePart) {
+            RetrieveMessagePart* messagePartAction = static_cast<RetrieveMessagePart *>(currentAction.data());
             if (messagePartAction->isAttachment()) {
                 updateAttachmentDownloadStatus(messagePartAction->partLocation(), Downloading);
             }
-        } else if (m_currentAction->type() == EmailAction::Transmit) {
-            m_transmitting = true;
         }
-        m_currentAction->execute();
+        lane->lastActivity = m_queueClock.elapsed();
+        if (!m_watchdogTimer.isActive()) {
+            m_watchdogTimer.start();
+        }
+        currentAction->execute();
+
+        if (currentAction->needsNetworkConnection() && m_batchUntil) {
+            // The radio is up now, the batched actions go along
+            flushBatch();
+        }
     }
 }
 
-QSharedPointer<EmailAction> EmailAgent::getNext()
+QSharedPointer<EmailAction> EmailAgent::getNext(ActionLane *lane)
 {
-    if (m_actionQueue.isEmpty())
+    if (lane->queue.isEmpty())
         return QSharedPointer<EmailAction>();
 
-    QSharedPointer<EmailAction> firstAction = m_actionQueue.first();
-    // if we are offline move the first offline action to the top of the queue if one exists
-    if (!isOnline() && firstAction->needsNetworkConnection() && m_actionQueue.size() > 1) {
-        for (int i = 1; i < m_actionQueue.size(); i++) {
-            QSharedPointer<EmailAction> action = m_actionQueue.at(i);
-            if (!action->needsNetworkConnection()) {
-                m_actionQueue.move(i, 0);
-                return action;
-            }
+    // Pick the highest priority, raised by the time waited so that background work is not starved.
+    // If we are offline prefer actions not needing the network, and actions not held after
+    // failures in any case. Equal ones keep the queue order.
+    const bool online = isOnline();
+    const qint64 now = m_queueClock.elapsed();
+    int next = -1;
+    int nextPriority = 0;
+    bool nextRunnable = false;
+    for (int i = 0; i < lane->queue.size(); ++i) {
+        const QSharedPointer<EmailAction> &action = lane->queue.at(i);
+        const bool runnable = (online || !action->needsNetworkConnection())
+                && heldUntil(lane, *action) <= now;
+        const int priority = agedPriority(*action, now);
+        if (next < 0 || (runnable && !nextRunnable)
+                || (runnable == nextRunnable && priority > nextPriority)) {
+            next = i;
+            nextPriority = priority;
+            nextRunnable = runnable;
         }
     }
-    return firstAction;
+
+    // The current action stays first in the queue
+    if (next > 0) {
+        lane->queue.move(next, 0);
+    }
+    return lane->queue.first();
 }
 
-void EmailAgent::cancelCurrentAction()
+void EmailAgent::cancelCurrentAction(ActionLane *lane)
 {
-    if (m_currentAction->serviceAction()->isRunning()) {
-        m_cancellingSingleAction = true;
-        m_currentAction->serviceAction()->cancelOperation();
+    if (lane->currentAction->serviceAction()->isRunning()) {
+        lane->cancellingSingleAction = true;
+        lane->currentAction->serviceAction()->cancelOperation();
     } else {
-        processNextAction();
+        processNextAction(lane);
     }
 }
 
-void EmailAgent::processNextAction()
+void EmailAgent::processNextAction(ActionLane *lane)
 {
-    m_currentAction = getNext();
-    if (m_currentAction.isNull()) {
+    lane->preempting = false;
+    lane->stalled = false;
+    if (lane->running) {
+        lane->running = false;
+        --m_runningLanes;
+    }
+
+    if (lane->removed) {
+        // Account is gone, the lane goes with its last action
+        lane->currentAction.clear();
+        releaseLane(lane);
+        for (int i = 0; i < m_removedLanes.size(); ++i) {
+            if (m_removedLanes.at(i).data() == lane) {
+                m_removedLanes.removeAt(i);
+                break;
+            }
+        }
+        startWaitingLanes();
+        updateSynchronizingState();
+        return;
+    }
+
+    lane->currentAction = getNext(lane);
+    if (!lane->currentAction.isNull()) {
+        if (m_waitingLanes.isEmpty() || !usesSlot(lane)) {
+            executeCurrent(lane);
+        } else if (!m_waitingLanes.contains(lane)) {
+            // Let the lanes waiting for a slot go first
+            m_waitingLanes.append(lane);
+        }
+    } else if (lane->attachments) {
+        dispatchAttachments(lane->accountId);
+    } else if (lane == m_localLane.data() && !m_deferredExports.isEmpty()) {
+        // Local changes are stored, export them behind the network work of each account
+        const QMailAccountIdList accountIds = m_deferredExports;
+        m_deferredExports.clear();
+        enqueueExports(accountIds);
+    }
+
+    startWaitingLanes();
+    updateSynchronizingState();
+}
+
+QList<QSharedPointer<EmailAgent::ActionLane> > EmailAgent::allLanes() const
+{
+    QList<QSharedPointer<ActionLane> > lanes = m_lanes.values() + m_sendLanes.values() + m_removedLanes;
+    for (const AttachmentPipeline &pipeline : m_attachmentPipelines) {
+        lanes += pipeline.lanes;
+    }
+    return lanes << m_localLane;
+}
+
+void EmailAgent::resumeLanes()
+{
+    bool queued = false;
+    for (const QSharedPointer<ActionLane> &lane : allLanes()) {
+        if (lane->currentAction.isNull())
+            lane->currentAction = getNext(lane.data());
+
+        if (!lane->currentAction.isNull()) {
+            queued = true;
+            if (!lane->currentAction->serviceAction()->isRunning()) {
+                executeCurrent(lane.data());
+            }
+        }
+    }
+
+    if (!queued) {
+        qCDebug(lcEmail) << "No action in the queue to resume.";
+    }
+}
+
+void EmailAgent::startWaitingLanes()
+{
+    while (m_runningLanes < MaxRunningLanes && !m_waitingLanes.isEmpty()) {
+        ActionLane *lane = m_waitingLanes.takeFirst();
+        if (lane->currentAction.isNull()) {
+            lane->currentAction = getNext(lane);
+        }
+        if (!lane->currentAction.isNull()) {
+            executeCurrent(lane);
+        }
+    }
+}
+
+void EmailAgent::updateSynchronizingState()
+{
+    // Actions held after failures do not count as synchronizing
+    const qint64 now = m_queueClock.elapsed();
+    ActionLane *busyLane = nullptr;
+    for (const QSharedPointer<ActionLane> &lane : allLanes()) {
+        if (!lane->currentAction.isNull() && heldUntil(lane.data(), *lane->currentAction) <= now
+                && (!busyLane || lane->accountId.toULongLong() == m_accountSynchronizing)) {
+            busyLane = lane.data();
+        }
+    }
+
+    if (!busyLane) {
         qCDebug(lcEmail) << "Sync completed.";
         bool wasSynchronizing = m_synchronizing;
         m_synchronizing = false;
@@ -1377,9 +2224,21 @@ void EmailAgent::processNextAction()
         }
         if (wasSynchronizing)
             emit synchronizingChanged();
-    } else {
-        executeCurrent();
+    } else if (busyLane->accountId.isValid() && busyLane->accountId.toULongLong() != m_accountSynchronizing) {
+        m_accountSynchronizing = busyLane->accountId.toULongLong();
+        emit currentSynchronizingAccountIdChanged();
+    }
+}
+
+bool EmailAgent::isTransmitting() const
+{
+    for (const QSharedPointer<ActionLane> &lane : allLanes()) {
+        if (!lane->currentAction.isNull() && lane->currentAction->type() == EmailAction::Transmit
+                && lane->currentAction->serviceAction()->isRunning()) {
+            return true;
+        }
     }
+    return false;
 }
 
 quint64 EmailAgent::newAction()
@@ -1389,65 +2248,287 @@ quint64 EmailAgent::newAction()
 
 void EmailAgent::reportError(const QMailAccountId &accountId, const QMailServiceAction::Status::ErrorCode &errorCode, bool sendFailed)
 {
-    switch (errorCode) {
-    case QMailServiceAction::Status::ErrFrameworkFault:
-    case QMailServiceAction::Status::ErrSystemError:
-    case QMailServiceAction::Status::ErrEnqueueFailed:
-    case QMailServiceAction::Status::ErrConnectionInUse:
-    case QMailServiceAction::Status::ErrInternalStateReset:
-    case QMailServiceAction::Status::ErrInvalidAddress:
-    case QMailServiceAction::Status::ErrInvalidData:
-    case QMailServiceAction::Status::ErrNotImplemented:
-        if (sendFailed) {
-            emit error(accountId.toULongLong(), SendFailed);
-        } else {
-            emit error(accountId.toULongLong(), SyncFailed);
+    SyncErrors accountError;
+    if (syncError(errorCode, sendFailed, &accountError)) {
+        emit error(accountId.toULongLong(), accountError);
+    }
+}
+
+bool EmailAgent::retryLater(ActionLane *lane, const QSharedPointer<EmailAction> &action,
+                            const QMailServiceAction::Status::ErrorCode &errorCode)
+{
+    SyncErrors accountError;
+    if (!syncError(errorCode, false, &accountError) || !isTransientError(accountError)) {
+        return false;
+    }
+
+    const qint64 now = m_queueClock.elapsed();
+    if (lane->accountId.isValid()) {
+        AccountHealth &health = m_accountHealth[lane->accountId];
+        if (++health.failures >= HoldThreshold) {
+            qCWarning(lcEmail) << "Account" << lane->accountId << "keeps failing, holding its network actions for"
+                               << HoldInterval << "ms";
+            health.holdUntil = now + HoldInterval;
         }
-        break;
-    case QMailServiceAction::Status::ErrLoginFailed:
-        emit error(accountId.toULongLong(), LoginFailed);
-        break;
-    case QMailServiceAction::Status::ErrFileSystemFull:
-        emit error(accountId.toULongLong(), DiskFull);
-        break;
-    case QMailServiceAction::Status::ErrConfiguration:
-    case QMailServiceAction::Status::ErrNoSslSupport:
-        emit error(accountId.toULongLong(), InvalidConfiguration);
-        break;
-    case QMailServiceAction::Status::ErrUntrustedCertificates:
-        emit error(accountId.toULongLong(), UntrustedCertificates);
-        break;
-    case QMailServiceAction::Status::ErrCancel:
-        break;
-    case QMailServiceAction::Status::ErrTimeout:
-        emit error(accountId.toULongLong(), Timeout);
-        break;
-    case QMailServiceAction::Status::ErrUnknownResponse:
-    case QMailServiceAction::Status::ErrInternalServer:
-        emit error(accountId.toULongLong(), ServerError);
-        break;
-    case QMailServiceAction::Status::ErrNoConnection:
-    case QMailServiceAction::Status::ErrConnectionNotReady:
-        emit error(accountId.toULongLong(), NotConnected);
-        break;
-    default:
-        emit error(accountId.toULongLong(), InternalError);
-        break;
+    }
+
+    return scheduleRetry(action);
+}
+
+bool EmailAgent::scheduleRetry(const QSharedPointer<EmailAction> &action)
+{
+    const int attempt = action->retryCount();
+    if (attempt >= action->maxRetries()) {
+        return false;
+    }
+
+    // Half of the delay is random so that clients failing together do not retry together
+    const qint64 delay = qMin(MaxRetryDelay, BaseRetryDelay << attempt);
+    const qint64 wait = delay / 2 + retryJitter(delay / 2);
+    action->setRetryCount(attempt + 1);
+    action->setRetryTime(m_queueClock.elapsed() + wait);
+    qCDebug(lcEmail) << "Retrying in" << wait << "ms, attempt" << attempt + 1 << "of" << action->maxRetries()
+                     << ":" << action->description();
+
+    if (action->type() == EmailAction::RetrieveMessagePart) {
+        RetrieveMessagePart *messagePartAction = static_cast<RetrieveMessagePart *>(action.data());
+        if (messagePartAction->isAttachment()) {
+            updateAttachmentDownloadStatus(messagePartAction->partLocation(), Queued);
+        }
+    }
+    return true;
+}
+
+qint64 EmailAgent::heldUntil(ActionLane *lane, const EmailAction &action) const
+{
+    qint64 until = action.retryTime();
+    // Whatever the user asks for explicitly gets through to probe the account
+    if (action.needsNetworkConnection() && action.priority() < EmailAction::ForegroundRefreshPriority) {
+        until = qMax(until, m_accountHealth.value(lane->accountId).holdUntil);
+    }
+    if (isBatched(action)) {
+        until = qMax(until, m_batchUntil);
+    }
+    return until;
+}
+
+bool EmailAgent::isBatched(const EmailAction &action) const
+{
+    return m_batchNetworkActions && action.needsNetworkConnection()
+            && action.priority() < EmailAction::ForegroundRefreshPriority;
+}
+
+bool EmailAgent::isNetworkActive() const
+{
+    for (const QSharedPointer<ActionLane> &lane : allLanes()) {
+        const QSharedPointer<EmailAction> &currentAction = lane->currentAction;
+        if (!currentAction.isNull() && currentAction->needsNetworkConnection()
+                && currentAction->serviceAction()->isRunning()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void EmailAgent::flushBatch()
+{
+    if (!m_batchUntil) {
+        return;
+    }
+
+    qCDebug(lcEmail) << "Flushing batched network actions";
+    m_batchUntil = 0;
+    emit batchChanged();
+    // Not started from here, the flush can happen while a lane is being started
+    m_retryTimer.start(0);
+}
+
+void EmailAgent::scheduleRetryTimer()
+{
+    const qint64 now = m_queueClock.elapsed();
+    qint64 next = -1;
+    for (const QSharedPointer<ActionLane> &lane : allLanes()) {
+        for (const QSharedPointer<EmailAction> &action : lane->queue) {
+            const qint64 until = heldUntil(lane.data(), *action);
+            if (until > now && (next < 0 || until < next)) {
+                next = until;
+            }
+        }
+    }
+
+    if (next < 0) {
+        m_retryTimer.stop();
+    } else {
+        m_retryTimer.start(int(next - now));
+    }
+}
+
+void EmailAgent::checkStalledActions()
+{
+    const qint64 now = m_queueClock.elapsed();
+    bool running = false;
+    for (const QSharedPointer<ActionLane> &lane : allLanes()) {
+        const QSharedPointer<EmailAction> currentAction = lane->currentAction;
+        if (currentAction.isNull() || !currentAction->serviceAction()->isRunning()) {
+            continue;
+        }
+
+        running = true;
+        const qint64 stalledFor = now - lane->lastActivity;
+        if (lane->stalled) {
+            if (stalledFor >= StallGracePeriod) {
+                abandonStalledAction(lane.data());
+            }
+            continue;
+        }
+        if (lane->preempting || lane->cancellingSingleAction || stalledFor < stallTimeout(*currentAction)) {
+            continue;
+        }
+
+        // Blocks everything queued behind it, cancel it and run it again later
+        qCWarning(lcEmail) << "Action made no progress in" << stalledFor << "ms, cancelling:"
+                           << currentAction->description();
+        emit actionStalled(currentAction->id(), currentAction->description(), stalledFor);
+        lane->stalled = true;
+        // The grace period for cancelling starts now
+        lane->lastActivity = now;
+        currentAction->serviceAction()->cancelOperation();
+    }
+
+    if (!running) {
+        m_watchdogTimer.stop();
     }
 }
 
+void EmailAgent::abandonStalledAction(ActionLane *lane)
+{
+    const QSharedPointer<EmailAction> currentAction = lane->currentAction;
+    qCWarning(lcEmail) << "Action did not finish after cancelling, abandoning:" << currentAction->description();
+    lane->stalled = false;
+    replaceServiceAction(lane, currentAction->serviceAction());
+
+    if (scheduleRetry(currentAction)) {
+        processNextAction(lane);
+        scheduleRetryTimer();
+    } else {
+        failCurrentAction(lane, QMailServiceAction::Status(QMailServiceAction::Status::ErrTimeout, QString(),
+                                                           currentAction->accountId(), QMailFolderId(),
+                                                           QMailMessageId()));
+    }
+}
+
+void EmailAgent::retryHeldActions()
+{
+    if (m_batchUntil && m_batchUntil <= m_queueClock.elapsed()) {
+        // Batch window is over, the batched actions run now
+        m_batchUntil = 0;
+        emit batchChanged();
+    }
+
+    for (const QSharedPointer<ActionLane> &lane : allLanes()) {
+        if (lane->currentAction.isNull() || !lane->currentAction->serviceAction()->isRunning()) {
+            lane->currentAction = getNext(lane.data());
+            if (!lane->currentAction.isNull()) {
+                executeCurrent(lane.data());
+            }
+        }
+    }
+    scheduleRetryTimer();
+}
+
 void EmailAgent::removeAction(quint64 actionId)
 {
-    for (int i = 0; i < m_actionQueue.size();) {
-        if (m_actionQueue.at(i).data()->id() == actionId) {
-            m_actionQueue.removeAt(i);
+    ActionLane *lane = m_actionLanes.value(actionId);
+    if (!lane) {
+        return;
+    }
+
+    for (int i = 0; i < lane->queue.size(); ++i) {
+        if (lane->queue.at(i)->id() == actionId) {
+            removeFromQueue(lane, i);
+            finishPlanStep(actionId, false);
             return;
-        } else {
-            ++i;
         }
     }
 }
 
+void EmailAgent::enqueueAttachment(const QMailMessage &message, const QMailMessagePart::Location &location)
+{
+    const QString partLocation = location.toString(true);
+    if (m_attachmentDownloadQueue.contains(partLocation)) {
+        qCDebug(lcEmail) << "Attachment already queued for download:" << partLocation;
+        return;
+    }
+
+    PendingAttachment attachment;
+    attachment.location = location;
+    attachment.partLocation = partLocation;
+    // Sizes only indicated are in kilobytes, unknown sizes go last
+    const QMailMessagePart &part = message.partAt(location);
+    int size = attachmentSize(part);
+    if (size < 0 && part.indicativeSize() > 0) {
+        size = int(part.indicativeSize()) * 1024;
+    }
+    attachment.size = size < 0 ? std::numeric_limits<uint>::max() : uint(size);
+
+    AttachmentPipeline &pipeline = m_attachmentPipelines[message.parentAccountId()];
+    auto position = std::upper_bound(pipeline.pending.begin(), pipeline.pending.end(), attachment,
+                                     [](const PendingAttachment &a, const PendingAttachment &b) {
+        return a.size < b.size;
+    });
+    pipeline.pending.insert(position, attachment);
+
+    AttachmentInfo attInfo;
+    attInfo.status = Queued;
+    m_attachmentDownloadQueue.insert(partLocation, attInfo);
+    emit attachmentDownloadStatusChanged(partLocation, attInfo.status);
+
+    dispatchAttachments(message.parentAccountId());
+}
+
+void EmailAgent::dispatchAttachments(const QMailAccountId &accountId)
+{
+    auto it = m_attachmentPipelines.find(accountId);
+    if (it == m_attachmentPipelines.end()) {
+        return;
+    }
+
+    AttachmentPipeline &pipeline = *it;
+    while (!pipeline.pending.isEmpty()) {
+        ActionLane *freeLane = nullptr;
+        for (const QSharedPointer<ActionLane> &lane : pipeline.lanes) {
+            if (lane->queue.isEmpty()) {
+                freeLane = lane.data();
+                break;
+            }
+        }
+
+        if (!freeLane && pipeline.lanes.size() < MaxAttachmentDownloads) {
+            QSharedPointer<ActionLane> lane(new ActionLane);
+            lane->accountId = accountId;
+            lane->attachments = true;
+            lane->retrievalAction = new QMailRetrievalAction(this);
+            addServiceAction(lane.data(), lane->retrievalAction);
+            pipeline.lanes.append(lane);
+            freeLane = lane.data();
+            qCDebug(lcEmail) << "Created attachment lane for account:" << accountId;
+        }
+
+        if (!freeLane) {
+            break;
+        }
+
+        // enqueue() records the action id for cancelling
+        const PendingAttachment next = pipeline.pending.takeFirst();
+        enqueue(new RetrieveMessagePart(freeLane->retrievalAction, next.location, true));
+    }
+}
+
+bool EmailAgent::usesSlot(ActionLane *lane) const
+{
+    return lane != m_localLane.data() && !lane->attachments;
+}
+
 bool EmailAgent::saveAttachmentToDownloads(QMailMessage *message, const QString &attachmentLocation)
 {
     const QMailMessagePart::Location location(attachmentLocation);
@@ -1457,21 +2538,94 @@ bool EmailAgent::saveAttachmentToDownloads(QMailMessage *message, const QString
     }
     QString checksum;
     QString filename = attachmentFilename(*message, attachmentLocation, &checksum);
-    if (!matchesAttachment(filename, checksum)) {
-        const QString path = QStandardPaths::writableLocation(QStandardPaths::DownloadLocation);
-        filename = message->partAt(location).writeBodyTo(path);
-        if (filename.isEmpty()) {
-            qCDebug(lcEmail) << "ERROR: Failed to save attachment file to location:" << path;
-            updateAttachmentDownloadStatus(attachmentLocation, FailedToSave);
-            return false;
+    if (!filename.isEmpty() && !checksum.isEmpty()) {
+        switch (m_attachmentVerifier->verify(filename, checksum)) {
+        case AttachmentVerifier::Matches:
+            emit attachmentPathChanged(attachmentLocation, filename);
+            updateAttachmentDownloadStatus(attachmentLocation, Downloaded);
+            return true;
+        case AttachmentVerifier::Pending:
+            // Saved file is hashed in the background, finished in attachmentVerified()
+            m_verifyingAttachments[filename].insert(attachmentLocation, checksum);
+            m_savingAttachments.insert(attachmentLocation, message->id());
+            return true;
+        case AttachmentVerifier::Mismatch:
+            break;
         }
-        setAttachmentFilename(message, attachmentLocation, filename);
+    } else if (!filename.isEmpty() && QFile::exists(filename)) {
+        emit attachmentPathChanged(attachmentLocation, filename);
+        updateAttachmentDownloadStatus(attachmentLocation, Downloaded);
+        return true;
+    }
+
+    if (!m_attachmentWriter->isWriting(attachmentLocation)) {
+        writeAttachment(*message, attachmentLocation);
     }
-    emit attachmentPathChanged(attachmentLocation, filename);
-    updateAttachmentDownloadStatus(attachmentLocation, Downloaded);
     return true;
 }
 
+// Written in the background, finished in attachmentWritten()
+void EmailAgent::writeAttachment(const QMailMessage &message, const QString &attachmentLocation)
+{
+    const QMailMessagePart::Location location(attachmentLocation);
+    if (!message.contains(location)) {
+        qCDebug(lcEmail) << "ERROR: Can't save attachment, location not found:" << attachmentLocation;
+        m_savingAttachments.remove(attachmentLocation);
+        updateAttachmentDownloadStatus(attachmentLocation, FailedToSave);
+        return;
+    }
+
+    if (!m_attachmentDownloadQueue.contains(attachmentLocation)) {
+        m_attachmentDownloadQueue.insert(attachmentLocation, AttachmentInfo());
+    }
+    updateAttachmentDownloadStatus(attachmentLocation, Downloading);
+    m_savingAttachments.insert(attachmentLocation, message.id());
+    m_attachmentWriter->write(attachmentLocation, message.partAt(location),
+                              m_attachmentStore->temporaryDirectory());
+}
+
+void EmailAgent::attachmentWritten(const QString &attachmentLocation, const QString &filename, const QByteArray &digest)
+{
+    const QMailMessageId messageId = m_savingAttachments.take(attachmentLocation);
+    if (!m_attachmentDownloadQueue.contains(attachmentLocation)) {
+        // Cancelled while writing
+        if (!filename.isEmpty()) {
+            QFile::remove(filename);
+        }
+        return;
+    }
+
+    if (filename.isEmpty()) {
+        qCDebug(lcEmail) << "ERROR: Failed to save attachment file for location:" << attachmentLocation;
+        updateAttachmentDownloadStatus(attachmentLocation, FailedToSave);
+        return;
+    }
+
+    QMailMessage message(messageId);
+    const QMailMessagePart::Location location(attachmentLocation);
+    const QString name = message.contains(location) ? message.partAt(location).displayName() : QString();
+    const QString path = m_attachmentStore->add(filename, digest, name, messageId, attachmentLocation);
+    if (path.isEmpty()) {
+        updateAttachmentDownloadStatus(attachmentLocation, FailedToSave);
+        return;
+    }
+
+    const QString checksum = QString::fromUtf8(digest);
+    m_attachmentVerifier->insert(path, checksum);
+    setAttachmentFilename(&message, attachmentLocation, path, checksum);
+    emit attachmentPathChanged(attachmentLocation, path);
+    updateAttachmentDownloadStatus(attachmentLocation, Downloaded);
+}
+
+void EmailAgent::attachmentWriteProgressChanged(const QString &attachmentLocation, double progress)
+{
+    auto it = m_attachmentDownloadQueue.find(attachmentLocation);
+    if (it != m_attachmentDownloadQueue.end()) {
+        it->progress = progress;
+        emit attachmentDownloadProgressChanged(attachmentLocation, progress);
+    }
+}
+
 void EmailAgent::updateAttachmentDownloadStatus(const QString &attachmentLocation, AttachmentStatus status)
 {
     if (status == Failed || status == FailedToSave || status == Canceled || status == Downloaded) {
@@ -1494,8 +2648,9 @@ void EmailAgent::emitSearchStatusChanges(QSharedPointer<EmailAction> action, Ema
     SearchMessages* searchAction = static_cast<SearchMessages *>(action.data());
     if (searchAction) {
         qCDebug(lcEmail) << "Search completed for" << searchAction->searchText();
-        emit searchCompleted(searchAction->searchText(), m_searchAction->matchingMessageIds(),
-                             searchAction->isRemote(), m_searchAction->remainingMessagesCount(), status);
+        QMailSearchAction *serviceAction = static_cast<QMailSearchAction *>(searchAction->serviceAction());
+        emit searchCompleted(searchAction->searchText(), serviceAction->matchingMessageIds(),
+                             searchAction->isRemote(), serviceAction->remainingMessagesCount(), status);
     } else {
         qCDebug(lcEmail) << "Error: Invalid search action.";
     }
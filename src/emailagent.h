@@ -11,7 +11,13 @@
 #ifndef EMAILAGENT_H
 #define EMAILAGENT_H
 
+#include <functional>
+
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QHash>
 #include <QSharedPointer>
+#include <QTimer>
 #include <QNetworkConfigurationManager>
 
 #include <qmailaccount.h>
@@ -20,6 +26,10 @@
 
 #include "emailaction.h"
 
+class ActionJournal;
+class AttachmentStore;
+class AttachmentVerifier;
+class AttachmentWriter;
 class FolderAccessor;
 
 class Q_DECL_EXPORT EmailAgent : public QObject
@@ -33,6 +43,9 @@ class Q_DECL_EXPORT EmailAgent : public QObject
     Q_ENUMS(OnlineFolderAction)
     Q_PROPERTY(bool synchronizing READ synchronizing NOTIFY synchronizingChanged)
     Q_PROPERTY(int currentSynchronizingAccountId READ currentSynchronizingAccountId NOTIFY currentSynchronizingAccountIdChanged)
+    Q_PROPERTY(bool batchNetworkActions READ batchNetworkActions WRITE setBatchNetworkActions NOTIFY batchNetworkActionsChanged)
+    Q_PROPERTY(int batchedActionCount READ batchedActionCount NOTIFY batchChanged)
+    Q_PROPERTY(QDateTime nextBatchFlush READ nextBatchFlush NOTIFY batchChanged)
 
 public:
     enum AttachmentStatus {
@@ -105,6 +118,12 @@ public:
     void cancelSearch();
     void cancelAll();
     bool synchronizing() const;
+    // Background network actions wait to run together with something
+    // urgent, or at most until the batch is flushed
+    bool batchNetworkActions() const;
+    void setBatchNetworkActions(bool batch);
+    int batchedActionCount() const;
+    QDateTime nextBatchFlush() const;
     void flagMessages(const QMailMessageIdList &ids, quint64 setMask, quint64 unsetMask);
     void moveMessages(const QMailMessageIdList &ids, const QMailFolderId &destinationId);
     void sendMessage(const QMailMessageId &messageId);
@@ -170,43 +189,136 @@ signals:
     void sendCompleted(bool success);
     void standardFoldersCreated(const QMailAccountId &accountId);
     void synchronizingChanged();
+    void batchNetworkActionsChanged();
+    void batchChanged();
     void networkConnectionRequested();
     void searchMessageIdsMatched(const QMailMessageIdList &ids);
     void searchCompleted(const QString &search, const QMailMessageIdList &matchedIds, bool isRemote,
                          int remainingMessagesOnRemote, EmailAgent::SearchStatus status);
     void calendarInvitationResponded(CalendarInvitationResponse response, bool success);
     void onlineFolderActionCompleted(OnlineFolderAction action, bool success);
+    // Diagnostics, the action made no progress for stalledMsecs and was cancelled
+    void actionStalled(quint64 actionId, const QString &description, qint64 stalledMsecs);
 
 private slots:
     void activityChanged(QMailServiceAction::Activity activity);
+    void onAccountsRemoved(const QMailAccountIdList &ids);
     void onIpcConnectionEstablished();
     void onOnlineStateChanged(bool isOnline);
     void progressChanged(uint value, uint total);
+    void flushExports();
+    void retryHeldActions();
+    void checkStalledActions();
+    void attachmentVerified(const QString &path);
+    void attachmentWritten(const QString &attachmentLocation, const QString &filename, const QByteArray &digest);
+    void attachmentWriteProgressChanged(const QString &attachmentLocation, double progress);
 
 private:
     static EmailAgent *m_instance;
 
     uint m_actionCount;
     quint64 m_accountSynchronizing;
-    bool m_transmitting;
-    bool m_cancellingSingleAction;
     bool m_synchronizing;
     bool m_enqueing;
+    bool m_batchNetworkActions;
+    qint64 m_batchUntil;
     bool m_waitForIpc;
 
     QMailAccountIdList m_enabledAccounts;
 
-    QScopedPointer<QMailRetrievalAction> const m_retrievalAction;
-    QScopedPointer<QMailStorageAction> const m_storageAction;
-    QScopedPointer<QMailTransmitAction> const m_transmitAction;
-    QScopedPointer<QMailSearchAction> const m_searchAction;
-    QScopedPointer<QMailProtocolAction> const m_protocolAction;
-    QMailRetrievalAction *m_attachmentRetrievalAction;
-
     QNetworkConfigurationManager *m_nmanager;
+    AttachmentStore *m_attachmentStore;
+    AttachmentVerifier *m_attachmentVerifier;
+    // Locations and expected checksums of the files being verified, by path
+    QHash<QString, QHash<QString, QString> > m_verifyingAttachments;
+    AttachmentWriter *m_attachmentWriter;
+    // Messages of the attachments being verified or written for saving, by location
+    QHash<QString, QMailMessageId> m_savingAttachments;
+
+    // Actions of one account run in order on the service actions of its lane,
+    // lanes of different accounts run in parallel. Sending of an account has
+    // a lane of its own so that the outbox does not wait behind a sync.
+    // Actions not bound to an account use the default lane with the shared
+    // service actions.
+    struct ActionLane {
+        QMailAccountId accountId;
+        QMailRetrievalAction *retrievalAction = nullptr;
+        QMailStorageAction *storageAction = nullptr;
+        QMailTransmitAction *transmitAction = nullptr;
+        QMailProtocolAction *protocolAction = nullptr;
+        QMailSearchAction *searchAction = nullptr;
+        // the current action stays first in the queue until it has finished
+        QList<QSharedPointer<EmailAction> > queue;
+        // ids of the queued actions by identity, for finding duplicates
+        QHash<EmailActionKey, quint64> keys;
+        QSharedPointer<EmailAction> currentAction;
+        bool cancellingSingleAction = false;
+        bool preempting = false; // current action is cancelled to be run later
+        bool stalled = false; // current action is cancelled by the watchdog
+        bool attachments = false; // downloads attachments outside the execution slots
+        qint64 lastActivity = 0; // last start or progress of the current action
+        bool running = false; // holds an execution slot
+        bool removed = false; // account is gone, released once the current action has finished
+    };
+
+    QHash<QMailAccountId, QSharedPointer<ActionLane> > m_lanes;
+    QHash<QMailAccountId, QSharedPointer<ActionLane> > m_sendLanes;
+    QHash<QMailServiceAction *, ActionLane *> m_serviceLanes;
+    // Lanes of removed accounts still finishing their current action
+    QList<QSharedPointer<ActionLane> > m_removedLanes;
+    // Lanes with an action ready to run but no free execution slot
+    QList<ActionLane *> m_waitingLanes;
+    // Lane of each queued action
+    QHash<quint64, ActionLane *> m_actionLanes;
+    // Local storage changes, executed right away
+    QSharedPointer<ActionLane> m_localLane;
+    // Accounts to export once the local lane is done
+    QMailAccountIdList m_deferredExports;
+    // Accounts to export after the quiet window
+    QMailAccountIdList m_pendingExports;
+    // Journal records of the exports not queued yet, by account
+    QHash<QMailAccountId, quint64> m_exportJournalIds;
+    QTimer m_exportTimer;
+    int m_runningLanes;
+    QElapsedTimer m_queueClock;
+
+    // Steps of a multi-step operation. A step is enqueued once all the steps
+    // it depends on have succeeded and is dropped when one of them fails.
+    struct PlanStep {
+        enum State {
+            Waiting,
+            Queued,
+            Succeeded,
+            Failed
+        };
+
+        EmailAction *action = nullptr; // owned until enqueued
+        QList<int> dependencies; // indexes of earlier steps
+        quint64 actionId = 0;
+        State state = Waiting;
+    };
+
+    struct SyncPlan {
+        ~SyncPlan() { for (const PlanStep &step : steps) delete step.action; }
+        int addStep(EmailAction *action, const QList<int> &dependencies = QList<int>());
 
-    QList<QSharedPointer<EmailAction> > m_actionQueue;
-    QSharedPointer<EmailAction> m_currentAction;
+        QList<PlanStep> steps;
+        // called when every step has succeeded
+        std::function<void()> completed;
+    };
+
+    // Consecutive transient failures of an account, too many of them hold
+    // its network actions for a while
+    struct AccountHealth {
+        int failures = 0;
+        qint64 holdUntil = 0;
+    };
+
+    QHash<QMailAccountId, AccountHealth> m_accountHealth;
+    QTimer m_retryTimer;
+    QTimer m_watchdogTimer;
+    QList<QSharedPointer<SyncPlan> > m_plans;
+    QScopedPointer<ActionJournal> m_journal;
     struct AttachmentInfo {
         AttachmentInfo()
             : status(Unknown),
@@ -221,19 +333,74 @@ private:
     // Holds a list of the attachments currently downloading or queued for download
     QHash<QString, AttachmentInfo> m_attachmentDownloadQueue;
 
+    // Attachment downloads of an account run on a few lanes of their own, so that
+    // they neither wait for nor hold up the sync. Downloads wait here, smallest
+    // part first, until one of the lanes is free.
+    struct PendingAttachment {
+        QMailMessagePart::Location location;
+        QString partLocation;
+        uint size;
+    };
+
+    struct AttachmentPipeline {
+        QList<QSharedPointer<ActionLane> > lanes;
+        QList<PendingAttachment> pending;
+    };
+
+    QHash<QMailAccountId, AttachmentPipeline> m_attachmentPipelines;
+
     void accountsSync(bool syncOnlyInbox = false, uint minimum = 20);
-    bool actionInQueue(QSharedPointer<EmailAction> action) const;
-    quint64 actionInQueueId(QSharedPointer<EmailAction> action) const;
-    void dequeue();
+    ActionLane *lane(const QMailAccountId &accountId);
+    ActionLane *sendLane(const QMailAccountId &accountId);
+    void addServiceAction(ActionLane *lane, QMailServiceAction *serviceAction);
+    void replaceServiceAction(ActionLane *lane, QMailServiceAction *serviceAction);
+    void retireLane(const QSharedPointer<ActionLane> &lane);
+    void releaseLane(ActionLane *lane);
+    QMailRetrievalAction *retrievalAction(const QMailAccountId &accountId);
+    QMailStorageAction *storageAction(const QMailAccountId &accountId);
+    QMailTransmitAction *transmitAction(const QMailAccountId &accountId);
+    QMailProtocolAction *protocolAction(const QMailAccountId &accountId);
+    bool actionInQueue(ActionLane *lane, QSharedPointer<EmailAction> action) const;
+    quint64 actionInQueueId(ActionLane *lane, QSharedPointer<EmailAction> action) const;
+    void dequeue(ActionLane *lane);
+    void removeFromQueue(ActionLane *lane, int index);
+    quint64 coalesce(ActionLane *lane, QSharedPointer<EmailAction> action);
+    void exportUpdatesNow(const QMailAccountIdList &accountIdList);
+    void journalExport(const QMailAccountId &accountId);
+    void enqueueExports(const QMailAccountIdList &accountIdList);
     quint64 enqueue(EmailAction *action);
-    void executeCurrent();
-    QSharedPointer<EmailAction> getNext();
-    void cancelCurrentAction();
-    void processNextAction();
+    void preemptFor(ActionLane *lane, const QSharedPointer<EmailAction> &action);
+    void replayJournal();
+    void startPlan(const QSharedPointer<SyncPlan> &plan);
+    void runPlan(const QSharedPointer<SyncPlan> &plan);
+    void finishPlanStep(quint64 actionId, bool success);
+    void executeCurrent(ActionLane *lane);
+    QSharedPointer<EmailAction> getNext(ActionLane *lane);
+    void cancelCurrentAction(ActionLane *lane);
+    void failCurrentAction(ActionLane *lane, const QMailServiceAction::Status &status);
+    void abandonStalledAction(ActionLane *lane);
+    void processNextAction(ActionLane *lane);
+    QList<QSharedPointer<ActionLane> > allLanes() const;
+    void resumeLanes();
+    void startWaitingLanes();
+    void updateSynchronizingState();
+    bool isTransmitting() const;
     quint64 newAction();
     void reportError(const QMailAccountId &accountId, const QMailServiceAction::Status::ErrorCode &errorCode, bool sendFailed);
+    bool retryLater(ActionLane *lane, const QSharedPointer<EmailAction> &action,
+                    const QMailServiceAction::Status::ErrorCode &errorCode);
+    bool scheduleRetry(const QSharedPointer<EmailAction> &action);
+    qint64 heldUntil(ActionLane *lane, const EmailAction &action) const;
+    bool isBatched(const EmailAction &action) const;
+    bool isNetworkActive() const;
+    void flushBatch();
+    void scheduleRetryTimer();
     void removeAction(quint64 actionId);
+    void enqueueAttachment(const QMailMessage &message, const QMailMessagePart::Location &location);
+    void dispatchAttachments(const QMailAccountId &accountId);
+    bool usesSlot(ActionLane *lane) const;
     bool saveAttachmentToDownloads(QMailMessage *message, const QString &attachmentLocation);
+    void writeAttachment(const QMailMessage &message, const QString &attachmentLocation);
     void updateAttachmentDownloadStatus(const QString &attachmentLocation, AttachmentStatus status);
     void emitSearchStatusChanges(QSharedPointer<EmailAction> action, EmailAgent::SearchStatus status);
     bool easCalendarInvitationResponse(const QMailMessage &message, CalendarInvitationResponse response,
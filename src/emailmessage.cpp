@@ -503,25 +503,35 @@ QStringList EmailMessage::attachmentLocations() const
 }
 
 AttachmentListModel::Attachment EmailMessage::attachment(const QString &location) const
+{
+    AttachmentListModel::Attachment attachment = attachmentPart(location);
+
+    if (!attachment.location.isEmpty()) {
+        QString path;
+        attachment.status = EmailAgent::instance()->attachmentDownloadStatus(m_msg, location, &path);
+        if (!path.isEmpty()) {
+            attachment.url = QUrl::fromLocalFile(path).toString();
+        }
+        attachment.progressInfo = EmailAgent::instance()->attachmentDownloadProgress(location);
+    }
+
+    return attachment;
+}
+
+AttachmentListModel::Attachment EmailMessage::attachmentPart(const QString &location) const
 {
     AttachmentListModel::Attachment attachment;
 
     QMailMessagePartContainer::Location partLocation(location);
     if (m_id.isValid() && m_msg.contains(partLocation)) {
-        QString path;
         QMailMessagePart part = m_msg.partAt(partLocation);
         attachment.location = location;
         attachment.displayName = attachmentName(part);
         attachment.downloaded = attachmentPartDownloaded(part);
-        attachment.status = EmailAgent::instance()->attachmentDownloadStatus(m_msg, location, &path);
         attachment.mimeType = QString::fromLatin1(part.contentType().content());
         attachment.size = attachmentSize(part);
         attachment.title = attachmentTitle(part);
         attachment.type = (isEmailPart(part)) ? AttachmentListModel::Email : AttachmentListModel::Other;
-        if (!path.isEmpty()) {
-            attachment.url = QUrl::fromLocalFile(path).toString();
-        }
-        attachment.progressInfo = EmailAgent::instance()->attachmentDownloadProgress(location);
     }
 
     return attachment;
@@ -213,6 +213,8 @@ public:
     QStringList toEmailAddresses() const;
     QStringList attachmentLocations() const;
     AttachmentListModel::Attachment attachment(const QString &location) const;
+    // Only the properties of the part, without the download state
+    AttachmentListModel::Attachment attachmentPart(const QString &location) const;
 
 signals:
     void sendEnqueued(bool success);
@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2020 Open Mobile Platform LLC.
+ *
+ * This program is licensed under the terms and conditions of the
+ * Apache License, version 2.0.  The full text of the Apache License is at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include <QPair>
+#include <QVector>
+
+#include <qmailstore.h>
+
+#include "folderhierarchy.h"
+#include "logging_p.h"
+
+FolderHierarchy *FolderHierarchy::instance()
+{
+    static FolderHierarchy *hierarchy = nullptr;
+    if (!hierarchy) {
+        hierarchy = new FolderHierarchy(QMailStore::instance());
+    }
+    return hierarchy;
+}
+
+FolderHierarchy::FolderHierarchy(QObject *parent)
+    : QObject(parent)
+{
+    connect(QMailStore::instance(), &QMailStore::foldersAdded,
+            this, &FolderHierarchy::onFoldersAdded);
+    connect(QMailStore::instance(), &QMailStore::foldersUpdated,
+            this, &FolderHierarchy::onFoldersUpdated);
+    connect(QMailStore::instance(), &QMailStore::foldersRemoved,
+            this, &FolderHierarchy::onFoldersRemoved);
+}
+
+bool FolderHierarchy::isAncestor(const QMailFolderId &folderId, const QMailFolderId &ancestorId)
+{
+    if (!folderId.isValid() || !ancestorId.isValid() || folderId == ancestorId) {
+        return false;
+    }
+
+    QMailAccountId accountId;
+    const Label folder = label(folderId, &accountId);
+    const Label ancestor = label(accountId, ancestorId);
+    if (folder.pre < 0 || ancestor.pre < 0) {
+        return false;
+    }
+    return ancestor.pre < folder.pre && folder.post < ancestor.post;
+}
+
+bool FolderHierarchy::isMailDescendantOrSelf(const QMailFolderId &folderId, const QMailFolderId &ancestorId)
+{
+    if (!folderId.isValid()) {
+        return false;
+    } else if (folderId == ancestorId) {
+        return true;
+    }
+
+    QMailAccountId accountId;
+    const Label folder = label(folderId, &accountId);
+    const Label ancestor = label(accountId, ancestorId);
+    if (folder.pre < 0 || ancestor.pre < 0) {
+        return false;
+    }
+    // Any NonMail folder strictly below the ancestor breaks the chain
+    return ancestor.pre < folder.pre && folder.post < ancestor.post
+            && folder.nonMailDepth <= ancestor.depth;
+}
+
+int FolderHierarchy::depth(const QMailFolderId &folderId)
+{
+    const Label folder = label(folderId);
+    return folder.pre < 0 ? -1 : folder.depth;
+}
+
+void FolderHierarchy::onFoldersAdded(const QMailFolderIdList &ids)
+{
+    for (const QMailFolderId &id : ids) {
+        const QMailFolder folder(id);
+        invalidate(folder.parentAccountId());
+    }
+}
+
+void FolderHierarchy::onFoldersUpdated(const QMailFolderIdList &ids)
+{
+    // Folders get updated often during sync, e.g. server counts.
+    // Only a changed parent or NonMail status affects the labels.
+    for (const QMailFolderId &id : ids) {
+        const QMailAccountId accountId = m_folderAccounts.value(id);
+        if (!accountId.isValid()) {
+            continue;
+        }
+
+        const Label current = m_trees.value(accountId).labels.value(id);
+        const QMailFolder folder(id);
+        if (folder.parentFolderId() != current.parentId
+                || bool(folder.status() & QMailFolder::NonMail) != current.nonMail
+                || folder.parentAccountId() != accountId) {
+            invalidate(accountId);
+            invalidate(folder.parentAccountId());
+        }
+    }
+}
+
+void FolderHierarchy::onFoldersRemoved(const QMailFolderIdList &ids)
+{
+    for (const QMailFolderId &id : ids) {
+        invalidate(m_folderAccounts.value(id));
+    }
+}
+
+FolderHierarchy::Label FolderHierarchy::label(const QMailFolderId &folderId, QMailAccountId *accountId)
+{
+    if (!folderId.isValid()) {
+        return Label();
+    }
+
+    QMailAccountId folderAccountId = m_folderAccounts.value(folderId);
+    if (!folderAccountId.isValid()) {
+        // Not labelled yet, either the account tree was not built or the folder is new
+        folderAccountId = QMailFolder(folderId).parentAccountId();
+        if (!folderAccountId.isValid()) {
+            return Label();
+        }
+        build(folderAccountId);
+    }
+
+    if (accountId) {
+        *accountId = folderAccountId;
+    }
+    return m_trees.value(folderAccountId).labels.value(folderId);
+}
+
+FolderHierarchy::Label FolderHierarchy::label(const QMailAccountId &accountId, const QMailFolderId &folderId)
+{
+    if (!accountId.isValid() || !folderId.isValid()) {
+        return Label();
+    }
+    return m_trees.value(accountId).labels.value(folderId);
+}
+
+void FolderHierarchy::build(const QMailAccountId &accountId)
+{
+    invalidate(accountId);
+    AccountTree &tree = m_trees[accountId];
+
+    const QMailFolderIdList ids = QMailStore::instance()->queryFolders(QMailFolderKey::parentAccountId(accountId));
+    for (const QMailFolderId &id : ids) {
+        const QMailFolder folder(id);
+        Label label;
+        label.parentId = folder.parentFolderId();
+        label.nonMail = folder.status() & QMailFolder::NonMail;
+        tree.labels.insert(id, label);
+        m_folderAccounts.insert(id, accountId);
+    }
+
+    QHash<QMailFolderId, QMailFolderIdList> children;
+    QMailFolderIdList topLevel;
+    for (const QMailFolderId &id : ids) {
+        const QMailFolderId parentId = tree.labels.value(id).parentId;
+        if (parentId.isValid() && tree.labels.contains(parentId)) {
+            children[parentId].append(id);
+        } else {
+            topLevel.append(id);
+        }
+    }
+
+    // Iterative depth-first walk, folder trees can be deep.
+    // Folders in a parent cycle are never reached and stay unlabelled.
+    int counter = 0;
+    QVector<QPair<QMailFolderId, int> > stack;
+    for (const QMailFolderId &id : topLevel) {
+        Label &top = tree.labels[id];
+        top.pre = counter++;
+        top.depth = 0;
+        top.nonMailDepth = top.nonMail ? 0 : -1;
+        stack.append(qMakePair(id, 0));
+
+        while (!stack.isEmpty()) {
+            const QMailFolderId currentId = stack.last().first;
+            const QMailFolderIdList currentChildren = children.value(currentId);
+            const int next = stack.last().second;
+            if (next < currentChildren.size()) {
+                stack.last().second++;
+                const Label parent = tree.labels.value(currentId);
+                const QMailFolderId childId = currentChildren.at(next);
+                Label &child = tree.labels[childId];
+                child.pre = counter++;
+                child.depth = parent.depth + 1;
+                child.nonMailDepth = child.nonMail ? child.depth : parent.nonMailDepth;
+                stack.append(qMakePair(childId, 0));
+            } else {
+                tree.labels[currentId].post = counter++;
+                stack.removeLast();
+            }
+        }
+    }
+
+    qCDebug(lcEmail) << "Labelled" << counter / 2 << "folders for account" << accountId;
+}
+
+void FolderHierarchy::invalidate(const QMailAccountId &accountId)
+{
+    auto it = m_trees.find(accountId);
+    if (it == m_trees.end()) {
+        return;
+    }
+
+    for (auto label = it->labels.constBegin(); label != it->labels.constEnd(); ++label) {
+        m_folderAccounts.remove(label.key());
+    }
+    m_trees.erase(it);
+}
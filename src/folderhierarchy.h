@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2020 Open Mobile Platform LLC.
+ *
+ * This program is licensed under the terms and conditions of the
+ * Apache License, version 2.0.  The full text of the Apache License is at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef FOLDERHIERARCHY_H
+#define FOLDERHIERARCHY_H
+
+#include <QHash>
+#include <QObject>
+
+#include <qmailfolder.h>
+#include <qmailaccount.h>
+
+// Pre/post-order interval labels of the folder tree of each account.
+// With the labels "is folder A under folder B" is two integer comparisons instead
+// of loading every folder on the parent chain. The labels of an account are dropped
+// when its folders are added, moved or removed, and rebuilt on next use.
+class FolderHierarchy : public QObject
+{
+    Q_OBJECT
+
+public:
+    static FolderHierarchy *instance();
+
+    // True if ancestorId is a strict ancestor of folderId
+    bool isAncestor(const QMailFolderId &folderId, const QMailFolderId &ancestorId);
+    // True if folderId is ancestorId or below it without any NonMail folder in between
+    bool isMailDescendantOrSelf(const QMailFolderId &folderId, const QMailFolderId &ancestorId);
+    // Number of parents up to the top level folder, -1 for unknown folders
+    int depth(const QMailFolderId &folderId);
+
+private slots:
+    void onFoldersAdded(const QMailFolderIdList &ids);
+    void onFoldersUpdated(const QMailFolderIdList &ids);
+    void onFoldersRemoved(const QMailFolderIdList &ids);
+
+private:
+    explicit FolderHierarchy(QObject *parent = nullptr);
+
+    struct Label {
+        QMailFolderId parentId;
+        bool nonMail = false;
+        int pre = -1;
+        int post = -1;
+        int depth = 0;
+        // depth of the deepest NonMail folder on the path to the top, -1 if none
+        int nonMailDepth = -1;
+    };
+
+    struct AccountTree {
+        QHash<QMailFolderId, Label> labels;
+    };
+
+    Label label(const QMailFolderId &folderId, QMailAccountId *accountId = nullptr);
+    Label label(const QMailAccountId &accountId, const QMailFolderId &folderId);
+    void build(const QMailAccountId &accountId);
+    void invalidate(const QMailAccountId &accountId);
+
+    QHash<QMailAccountId, AccountTree> m_trees;
+    QHash<QMailFolderId, QMailAccountId> m_folderAccounts;
+};
+
+#endif
@@ -7,7 +7,10 @@
  * http://www.apache.org/licenses/LICENSE-2.0
  */
 
-#include <QTimerEvent>
+#include <QHash>
+#include <QTimer>
+
+#include <algorithm>
 
 #include "folderlistfiltertypemodel.h"
 #include "folderlistmodel.h"
@@ -16,7 +19,11 @@ FolderListFilterTypeModel::FolderListFilterTypeModel(QObject *parent)
     : QSortFilterProxyModel(parent)
     , m_count(0)
     , m_syncFolderList()
-    , updateSyncFolderListTimer(-1)
+    , m_syncFolderListDirty(false)
+    , m_nameMatch(PrefixMatch)
+    , m_searchIndexDirty(true)
+    , m_nameMatchesDirty(true)
+    , m_refilterQueued(false)
 {
     // Default to email folders
     m_typeFilter << EmailFolder::NormalFolder
@@ -28,6 +35,14 @@ FolderListFilterTypeModel::FolderListFilterTypeModel(QObject *parent)
                  << EmailFolder::JunkFolder;
 
     m_folderModel = new FolderListModel(this);
+    // Connected before the proxy's own connections, filtering never sees a stale name index
+    connect(m_folderModel, &FolderListModel::rowsInserted, this, &FolderListFilterTypeModel::invalidateSearchIndex);
+    connect(m_folderModel, &FolderListModel::rowsRemoved, this, &FolderListFilterTypeModel::invalidateSearchIndex);
+    connect(m_folderModel, &FolderListModel::rowsMoved, this, &FolderListFilterTypeModel::invalidateSearchIndex);
+    connect(m_folderModel, &FolderListModel::layoutChanged, this, &FolderListFilterTypeModel::invalidateSearchIndex);
+    connect(m_folderModel, &FolderListModel::modelReset, this, &FolderListFilterTypeModel::invalidateSearchIndex);
+    connect(m_folderModel, &FolderListModel::dataChanged, this, &FolderListFilterTypeModel::updateSearchEntries);
+
     setSourceModel(m_folderModel);
     connect(m_folderModel, &FolderListModel::accountKeyChanged, this, &FolderListFilterTypeModel::accountKeyChanged);
     connect(m_folderModel, &FolderListModel::rowsInserted, this, &FolderListFilterTypeModel::updateData);
@@ -35,6 +50,14 @@ FolderListFilterTypeModel::FolderListFilterTypeModel(QObject *parent)
     connect(m_folderModel, &FolderListModel::dataChanged, this, &FolderListFilterTypeModel::updateData);
     connect(m_folderModel, &FolderListModel::rowsMoved, this, &FolderListFilterTypeModel::updateData);
     connect(m_folderModel, &FolderListModel::modelReset, this, &FolderListFilterTypeModel::updateData);
+
+    // Sync folder list follows the changed rows only
+    connect(m_folderModel, &FolderListModel::rowsInserted, this, &FolderListFilterTypeModel::onSourceRowsInserted);
+    connect(m_folderModel, &FolderListModel::rowsRemoved, this, &FolderListFilterTypeModel::onSourceRowsRemoved);
+    connect(m_folderModel, &FolderListModel::dataChanged, this, &FolderListFilterTypeModel::onSourceDataChanged);
+    connect(m_folderModel, &FolderListModel::rowsMoved, this, &FolderListFilterTypeModel::resetSyncFolders);
+    connect(m_folderModel, &FolderListModel::layoutChanged, this, &FolderListFilterTypeModel::resetSyncFolders);
+    connect(m_folderModel, &FolderListModel::modelReset, this, &FolderListFilterTypeModel::resetSyncFolders);
 }
 
 bool FolderListFilterTypeModel::filterAcceptsRow(int source_row, const QModelIndex &source_parent) const
@@ -44,7 +67,14 @@ bool FolderListFilterTypeModel::filterAcceptsRow(int source_row, const QModelInd
     if (sourceModel()) {
         EmailFolder::FolderType type = static_cast<EmailFolder::FolderType>
                 (sourceModel()->index(source_row, 0).data(FolderListModel::FolderType).toInt());
-        return m_typeFilter.contains(type);
+        if (!m_typeFilter.contains(type)) {
+            return false;
+        } else if (m_nameFilter.isEmpty()) {
+            return true;
+        }
+
+        ensureNameMatches();
+        return source_row < m_nameMatches.count() && m_nameMatches.at(source_row);
     }
     return false;
 }
@@ -60,44 +90,296 @@ void FolderListFilterTypeModel::updateData()
         m_count = rowCount();
         emit countChanged();
     }
+}
+
+void FolderListFilterTypeModel::onSourceRowsInserted(const QModelIndex &parent, int first, int last)
+{
+    Q_UNUSED(parent)
 
-    if (updateSyncFolderListTimer != -1) {
-        killTimer(updateSyncFolderListTimer);
+    bool changed = false;
+    for (int row = first; row <= last; ++row) {
+        const SyncFolder folder = syncFolder(row);
+        m_syncFolders.insert(row, folder);
+        changed |= isListed(folder);
+    }
+
+    if (m_syncFolders.count() != sourceModel()->rowCount()) {
+        resetSyncFolders();
+    } else if (changed) {
+        m_syncFolderListDirty = true;
+        emit syncFolderListChanged();
     }
-    // Avoid updating the sync folder list on every signal
-    updateSyncFolderListTimer = startTimer(100);
 }
 
-void FolderListFilterTypeModel::timerEvent(QTimerEvent * event)
+void FolderListFilterTypeModel::onSourceRowsRemoved(const QModelIndex &parent, int first, int last)
 {
-    if (event->timerId() == updateSyncFolderListTimer) {
-        killTimer(updateSyncFolderListTimer);
-        updateSyncFolderListTimer = -1;
-        updateSyncFolderList();
+    Q_UNUSED(parent)
+
+    if (first < 0 || last >= m_syncFolders.count()) {
+        resetSyncFolders();
+        return;
+    }
+
+    bool changed = false;
+    for (int row = first; row <= last; ++row) {
+        changed |= isListed(m_syncFolders.at(row));
+    }
+    m_syncFolders.remove(first, last - first + 1);
+
+    if (changed) {
+        m_syncFolderListDirty = true;
+        emit syncFolderListChanged();
     }
 }
 
-void FolderListFilterTypeModel::updateSyncFolderList()
+void FolderListFilterTypeModel::onSourceDataChanged(const QModelIndex &topLeft, const QModelIndex &bottomRight,
+                                                    const QVector<int> &roles)
 {
-    QStringList syncFolderList;
-    for (int i = 0; i < sourceModel()->rowCount(); ++i) {
-        bool sync = sourceModel()->index(i, 0).data(FolderListModel::FolderSyncEnabled).toBool();
-        if (sync) {
-            EmailFolder::FolderType type = static_cast<EmailFolder::FolderType>
-                    (sourceModel()->index(i, 0).data(FolderListModel::FolderType).toInt());
-            if (m_typeFilter.contains(type)) {
-                QString name = sourceModel()->index(i, 0).data(FolderListModel::FolderName).toString();
-                syncFolderList += name;
+    if (!roles.isEmpty() && !roles.contains(FolderListModel::FolderSyncEnabled)
+            && !roles.contains(FolderListModel::FolderName) && !roles.contains(FolderListModel::FolderType)) {
+        return;
+    }
+
+    // Source can reload its rows without insert or remove notifications
+    const int first = topLeft.row();
+    const int last = bottomRight.row();
+    if (first < 0 || last >= m_syncFolders.count() || m_syncFolders.count() != sourceModel()->rowCount()) {
+        resetSyncFolders();
+        return;
+    }
+
+    bool changed = false;
+    for (int row = first; row <= last; ++row) {
+        SyncFolder &folder = m_syncFolders[row];
+        const bool wasListed = isListed(folder);
+        const QString oldName = folder.name;
+        if (roles.count() == 1 && roles.first() == FolderListModel::FolderSyncEnabled) {
+            // Usual case of toggling sync on a folder, avoid reading the other roles
+            const QModelIndex sourceIndex = sourceModel()->index(row, 0);
+            folder.syncEnabled = sourceIndex.data(FolderListModel::FolderSyncEnabled).toBool();
+            // Names are only kept for synced folders, the one enabled now may have none
+            if (!wasListed && isListed(folder)) {
+                folder.name = sourceIndex.data(FolderListModel::FolderName).toString();
             }
+        } else {
+            folder = syncFolder(row);
         }
+        const bool listed = isListed(folder);
+        changed |= (wasListed != listed) || (listed && oldName != folder.name);
     }
 
-    if (m_syncFolderList != syncFolderList) {
-        m_syncFolderList = syncFolderList;
+    if (changed) {
+        m_syncFolderListDirty = true;
         emit syncFolderListChanged();
     }
 }
 
+void FolderListFilterTypeModel::resetSyncFolders()
+{
+    const QStringList previous = syncFolderList();
+
+    QVector<SyncFolder> syncFolders;
+    const int rows = sourceModel()->rowCount();
+    syncFolders.reserve(rows);
+    for (int row = 0; row < rows; ++row) {
+        syncFolders.append(syncFolder(row));
+    }
+    m_syncFolders = syncFolders;
+    m_syncFolderListDirty = true;
+    if (previous != syncFolderList()) {
+        emit syncFolderListChanged();
+    }
+}
+
+FolderListFilterTypeModel::SyncFolder FolderListFilterTypeModel::syncFolder(int sourceRow) const
+{
+    const QModelIndex sourceIndex = sourceModel()->index(sourceRow, 0);
+    SyncFolder folder;
+    folder.syncEnabled = sourceIndex.data(FolderListModel::FolderSyncEnabled).toBool();
+    folder.type = static_cast<EmailFolder::FolderType>(sourceIndex.data(FolderListModel::FolderType).toInt());
+    if (folder.syncEnabled) {
+        folder.name = sourceIndex.data(FolderListModel::FolderName).toString();
+    }
+    return folder;
+}
+
+bool FolderListFilterTypeModel::isListed(const SyncFolder &folder) const
+{
+    return folder.syncEnabled && m_typeFilter.contains(folder.type);
+}
+
+void FolderListFilterTypeModel::invalidateSearchIndex()
+{
+    m_searchIndexDirty = true;
+    queueRefilter();
+}
+
+void FolderListFilterTypeModel::updateSearchEntries(const QModelIndex &topLeft, const QModelIndex &bottomRight,
+                                                    const QVector<int> &roles)
+{
+    // Index is only kept while filtering by name
+    if ((!roles.isEmpty() && !roles.contains(FolderListModel::FolderName)
+            && !roles.contains(FolderListModel::FolderParentId)) || m_nameFilter.isEmpty() || m_searchIndexDirty) {
+        return;
+    }
+
+    const int first = topLeft.row();
+    const int last = bottomRight.row();
+    if (first < 0 || last >= m_searchEntries.count() || m_searchEntries.count() != sourceModel()->rowCount()) {
+        invalidateSearchIndex();
+        return;
+    }
+
+    // Source reloads all rows on any folder change, only renamed ones are taken again
+    bool changed = false;
+    for (int row = first; row <= last; ++row) {
+        const QModelIndex sourceIndex = sourceModel()->index(row, 0);
+        SearchEntry &entry = m_searchEntries[row];
+        if (sourceIndex.data(FolderListModel::FolderId).toULongLong() != entry.folderId
+                || sourceIndex.data(FolderListModel::FolderParentId).toULongLong() != entry.parentId) {
+            // Reordered or moved rows, parent rows need to be resolved again
+            invalidateSearchIndex();
+            return;
+        }
+        const QString name = sourceIndex.data(FolderListModel::FolderName).toString().toLower();
+        if (name != entry.name) {
+            entry.name = name;
+            changed = true;
+        }
+    }
+
+    if (changed) {
+        updateSearchPaths();
+        m_nameMatchesDirty = true;
+        queueRefilter();
+    }
+}
+
+void FolderListFilterTypeModel::queueRefilter()
+{
+    if (!m_nameFilter.isEmpty() && !m_refilterQueued) {
+        // Ancestors of the changed rows may need to appear or disappear,
+        // refilter once the proxy has processed the source change
+        m_refilterQueued = true;
+        QTimer::singleShot(0, this, [this] {
+            m_refilterQueued = false;
+            if (!m_nameFilter.isEmpty()) {
+                invalidateFilter();
+                updateData();
+            }
+        });
+    }
+}
+
+void FolderListFilterTypeModel::ensureNameMatches() const
+{
+    if (m_searchIndexDirty || m_searchEntries.count() != sourceModel()->rowCount()) {
+        buildSearchIndex();
+        m_nameMatchesDirty = true;
+    }
+    if (m_nameMatchesDirty) {
+        updateNameMatches();
+        m_nameMatchesDirty = false;
+    }
+}
+
+void FolderListFilterTypeModel::buildSearchIndex() const
+{
+    const int rows = sourceModel()->rowCount();
+    QVector<SearchEntry> entries(rows);
+    QHash<quint64, int> folderRows;
+
+    for (int row = 0; row < rows; ++row) {
+        const QModelIndex sourceIndex = sourceModel()->index(row, 0);
+        SearchEntry &entry = entries[row];
+        entry.name = sourceIndex.data(FolderListModel::FolderName).toString().toLower();
+        entry.folderId = sourceIndex.data(FolderListModel::FolderId).toULongLong();
+        entry.parentId = sourceIndex.data(FolderListModel::FolderParentId).toULongLong();
+        // Local folders share the same id, the first one is enough for parent lookups
+        if (!folderRows.contains(entry.folderId)) {
+            folderRows.insert(entry.folderId, row);
+        }
+    }
+
+    for (int row = 0; row < rows; ++row) {
+        const quint64 parentId = entries.at(row).parentId;
+        const int parentRow = parentId ? folderRows.value(parentId, -1) : -1;
+        entries[row].parentRow = (parentRow != row) ? parentRow : -1;
+    }
+
+    m_searchEntries = entries;
+    updateSearchPaths();
+    m_searchIndexDirty = false;
+}
+
+void FolderListFilterTypeModel::updateSearchPaths() const
+{
+    QVector<SearchEntry> &entries = m_searchEntries;
+    const int rows = entries.count();
+    for (SearchEntry &entry : entries) {
+        entry.path.clear();
+    }
+
+    // Full paths, resolving the parent chain of each row once
+    for (int row = 0; row < rows; ++row) {
+        QVector<int> chain;
+        int current = row;
+        while (current >= 0 && entries.at(current).path.isEmpty() && chain.count() <= rows) {
+            chain.append(current);
+            current = entries.at(current).parentRow;
+        }
+        QString path = current >= 0 ? entries.at(current).path : QString();
+        for (int i = chain.count() - 1; i >= 0; --i) {
+            SearchEntry &entry = entries[chain.at(i)];
+            path = path.isEmpty() ? entry.name : path + QLatin1Char('/') + entry.name;
+            entry.path = path;
+        }
+    }
+
+    QVector<QPair<QString, int> > prefixIndex;
+    prefixIndex.reserve(rows * 2);
+    for (int row = 0; row < rows; ++row) {
+        prefixIndex.append(qMakePair(entries.at(row).name, row));
+        if (entries.at(row).path != entries.at(row).name) {
+            prefixIndex.append(qMakePair(entries.at(row).path, row));
+        }
+    }
+    std::sort(prefixIndex.begin(), prefixIndex.end());
+    m_prefixIndex = prefixIndex;
+}
+
+void FolderListFilterTypeModel::updateNameMatches() const
+{
+    const QString text = m_nameFilter.toLower();
+    const int rows = m_searchEntries.count();
+    m_nameMatches.fill(false, rows);
+
+    // Accepts the row and its ancestors for context
+    auto accept = [this, rows](int row) {
+        for (int depth = 0; row >= 0 && !m_nameMatches.at(row) && depth < rows; ++depth) {
+            m_nameMatches[row] = true;
+            row = m_searchEntries.at(row).parentRow;
+        }
+    };
+
+    if (m_nameMatch == PrefixMatch) {
+        auto it = std::lower_bound(m_prefixIndex.constBegin(), m_prefixIndex.constEnd(), text,
+                                   [](const QPair<QString, int> &entry, const QString &text) {
+            return entry.first < text;
+        });
+        for (; it != m_prefixIndex.constEnd() && it->first.startsWith(text); ++it) {
+            accept(it->second);
+        }
+    } else {
+        for (int row = 0; row < rows; ++row) {
+            const SearchEntry &entry = m_searchEntries.at(row);
+            if (entry.name.contains(text) || entry.path.contains(text)) {
+                accept(row);
+            }
+        }
+    }
+}
+
 void FolderListFilterTypeModel::setAccountKey(int id)
 {
     m_folderModel->setAccountKey(id);
@@ -110,9 +392,23 @@ int FolderListFilterTypeModel::accountKey() const
 
 const QStringList & FolderListFilterTypeModel::syncFolderList() const
 {
+    if (m_syncFolderListDirty) {
+        m_syncFolderListDirty = false;
+        m_syncFolderList.clear();
+        for (const SyncFolder &folder : m_syncFolders) {
+            if (isListed(folder)) {
+                m_syncFolderList.append(folder.name);
+            }
+        }
+    }
     return m_syncFolderList;
 }
 
+bool FolderListFilterTypeModel::setSyncEnabled(const QVariantList &folderIds, bool enabled)
+{
+    return m_folderModel->setSyncEnabled(folderIds, enabled);
+}
+
 QList<int> FolderListFilterTypeModel::typeFilter() const
 {
     QList<int> types;
@@ -137,5 +433,53 @@ void FolderListFilterTypeModel::setTypeFilter(QList<int> typeFilter)
         emit typeFilterChanged();
         invalidateFilter();
         updateData();
+
+        const QStringList previous = syncFolderList();
+        m_syncFolderListDirty = true;
+        if (previous != syncFolderList()) {
+            emit syncFolderListChanged();
+        }
+    }
+}
+
+QString FolderListFilterTypeModel::nameFilter() const
+{
+    return m_nameFilter;
+}
+
+void FolderListFilterTypeModel::setNameFilter(const QString &nameFilter)
+{
+    if (nameFilter != m_nameFilter) {
+        m_nameFilter = nameFilter;
+        m_nameMatchesDirty = true;
+        if (m_nameFilter.isEmpty()) {
+            // Built again for the next name filter
+            m_searchEntries.clear();
+            m_prefixIndex.clear();
+            m_nameMatches.clear();
+            m_searchIndexDirty = true;
+        }
+
+        emit nameFilterChanged();
+        invalidateFilter();
+        updateData();
+    }
+}
+
+FolderListFilterTypeModel::NameMatch FolderListFilterTypeModel::nameMatch() const
+{
+    return m_nameMatch;
+}
+
+void FolderListFilterTypeModel::setNameMatch(NameMatch nameMatch)
+{
+    if (nameMatch != m_nameMatch) {
+        m_nameMatch = nameMatch;
+        m_nameMatchesDirty = true;
+        if (!m_nameFilter.isEmpty()) {
+            invalidateFilter();
+            updateData();
+        }
+        emit nameMatchChanged();
     }
 }
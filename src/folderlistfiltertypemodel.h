@@ -10,9 +10,11 @@
 #ifndef FOLDERLISTFILTERTYPEMODEL_H
 #define FOLDERLISTFILTERTYPEMODEL_H
 
+#include <QPair>
 #include <QSet>
 #include <QStringList>
 #include <QSortFilterProxyModel>
+#include <QVector>
 
 #include <emailfolder.h>
 
@@ -20,15 +22,24 @@ class FolderListModel;
 
 // Filters the folder list by type
 // By default shows only the email folders
+// Optionally filters by folder name, keeping the ancestors of matching folders
 class Q_DECL_EXPORT FolderListFilterTypeModel : public QSortFilterProxyModel
 {
     Q_OBJECT
+    Q_ENUMS(NameMatch)
     Q_PROPERTY(int count READ count NOTIFY countChanged)
     Q_PROPERTY(QStringList syncFolderList READ syncFolderList NOTIFY syncFolderListChanged)
     Q_PROPERTY(int accountKey READ accountKey WRITE setAccountKey NOTIFY accountKeyChanged FINAL)
     Q_PROPERTY(QList<int> typeFilter READ typeFilter WRITE setTypeFilter NOTIFY typeFilterChanged FINAL)
+    Q_PROPERTY(QString nameFilter READ nameFilter WRITE setNameFilter NOTIFY nameFilterChanged FINAL)
+    Q_PROPERTY(NameMatch nameMatch READ nameMatch WRITE setNameMatch NOTIFY nameMatchChanged FINAL)
 
 public:
+    enum NameMatch {
+        PrefixMatch = 0, // display name or full path starts with the filter
+        SubstringMatch   // display name or full path contains the filter
+    };
+
     explicit FolderListFilterTypeModel(QObject *parent = nullptr);
 
     bool filterAcceptsRow(int source_row, const QModelIndex &source_parent) const override;
@@ -39,28 +50,72 @@ public:
     const QStringList &syncFolderList() const;
     QList<int> typeFilter() const;
     void setTypeFilter(QList<int> typeFilter);
+    QString nameFilter() const;
+    void setNameFilter(const QString &nameFilter);
+    NameMatch nameMatch() const;
+    void setNameMatch(NameMatch nameMatch);
+
+    Q_INVOKABLE bool setSyncEnabled(const QVariantList &folderIds, bool enabled);
 
 signals:
     void accountKeyChanged();
     void countChanged();
     void syncFolderListChanged();
     void typeFilterChanged();
+    void nameFilterChanged();
+    void nameMatchChanged();
 
 private slots:
     void updateData();
-
-protected:
-    void timerEvent(QTimerEvent * event) override;
+    void onSourceRowsInserted(const QModelIndex &parent, int first, int last);
+    void onSourceRowsRemoved(const QModelIndex &parent, int first, int last);
+    void onSourceDataChanged(const QModelIndex &topLeft, const QModelIndex &bottomRight, const QVector<int> &roles);
+    void resetSyncFolders();
+    void invalidateSearchIndex();
+    void updateSearchEntries(const QModelIndex &topLeft, const QModelIndex &bottomRight, const QVector<int> &roles);
 
 private:
-    void updateSyncFolderList();
+    // Mirror of the source rows for the sync folder list
+    struct SyncFolder {
+        QString name;
+        EmailFolder::FolderType type = EmailFolder::InvalidFolder;
+        bool syncEnabled = false;
+    };
+
+    SyncFolder syncFolder(int sourceRow) const;
+    bool isListed(const SyncFolder &folder) const;
+
+    // Lower case display name and full path of each source row for the name filter
+    struct SearchEntry {
+        QString name;
+        QString path;
+        quint64 folderId = 0;
+        quint64 parentId = 0;
+        int parentRow = -1;
+    };
+
+    void queueRefilter();
+    void ensureNameMatches() const;
+    void buildSearchIndex() const;
+    void updateSearchPaths() const;
+    void updateNameMatches() const;
 
 private:
     int m_count;
-    QStringList m_syncFolderList;
+    mutable QStringList m_syncFolderList;
+    mutable bool m_syncFolderListDirty;
+    QVector<SyncFolder> m_syncFolders;
     FolderListModel *m_folderModel;
     QSet<EmailFolder::FolderType> m_typeFilter;
-    int updateSyncFolderListTimer;
+    QString m_nameFilter;
+    NameMatch m_nameMatch;
+    mutable QVector<SearchEntry> m_searchEntries;
+    // Sorted names and paths with their source rows, for prefix lookups
+    mutable QVector<QPair<QString, int> > m_prefixIndex;
+    mutable QVector<bool> m_nameMatches;
+    mutable bool m_searchIndexDirty;
+    mutable bool m_nameMatchesDirty;
+    bool m_refilterQueued;
 };
 
 #endif
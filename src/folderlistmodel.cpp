@@ -14,11 +14,26 @@
 #include <qmailmessagekey.h>
 #include <qmailstore.h>
 
+#include <QSet>
+
 #include "folderlistmodel.h"
 #include "folderaccessor.h"
+#include "folderhierarchy.h"
 #include "folderutils.h"
 #include "logging_p.h"
 
+static bool sameFolder(const QMailFolder &a, const QMailFolder &b)
+{
+    return a.status() == b.status()
+            && a.displayName() == b.displayName()
+            && a.path() == b.path()
+            && a.parentFolderId() == b.parentFolderId()
+            && a.parentAccountId() == b.parentAccountId()
+            && a.serverCount() == b.serverCount()
+            && a.serverUnreadCount() == b.serverUnreadCount()
+            && a.serverUndiscoveredCount() == b.serverUndiscoveredCount();
+}
+
 static bool folderLessThan(const QMailFolderId &idA, const QMailFolderId &idB)
 {
     Q_ASSERT(idA.isValid());
@@ -78,29 +93,6 @@ static bool folderLessThan(const QMailFolderId &idA, const QMailFolderId &idB)
     }
 }
 
-static bool isStandardFolder(const QMailFolderId &id)
-{
-    EmailFolder::FolderType folderType = FolderUtils::folderTypeFromId(id);
-    return folderType == EmailFolder::InboxFolder || folderType == EmailFolder::DraftsFolder
-            || folderType == EmailFolder::SentFolder || folderType == EmailFolder::TrashFolder
-            || folderType == EmailFolder::OutboxFolder || folderType == EmailFolder::JunkFolder;
-}
-
-static bool isAncestorFolder(const QMailFolderId &id, const QMailFolderId &ancestor)
-{
-    QMailFolderId current = id;
-    while (current.isValid()) {
-        if (current == ancestor)
-            return true;
-
-        QMailFolder folder(current);
-        if (folder.status() & QMailFolder::NonMail)
-            return false;
-        current = folder.parentFolderId();
-    }
-    return false;
-}
-
 static QString localFolderName(EmailFolder::FolderType folderType)
 {
     switch (folderType) {
@@ -195,27 +187,21 @@ QVariant FolderListModel::data(const QModelIndex &index, int role) const
     case FolderNestingLevel:
         // Eliminate any nesting that standard folders might
         // have since these are at top
-        if (isStandardFolder(item->folderId)) {
+        if (FolderUtils::isStandardFolder(item->folderId)) {
             return 0;
         } else {
-            QMailFolder tempFolder = folder;
-            int level = 0;
-            while (tempFolder.parentFolderId().isValid()) {
-                tempFolder = QMailFolder(tempFolder.parentFolderId());
-                level++;
-            }
-            return level;
+            return qMax(0, FolderHierarchy::instance()->depth(item->folderId));
         }
     case FolderType:
         return item->folderType;
     case FolderRenamePermitted:
     case FolderMovePermitted:
         return item->folderId != QMailFolderId::LocalStorageFolderId
-                && !isStandardFolder(item->folderId)
+                && !FolderUtils::isStandardFolder(item->folderId)
                 && (folder.status() & QMailFolder::RenamePermitted);
     case FolderDeletionPermitted:
         return item->folderId != QMailFolderId::LocalStorageFolderId
-                && !isStandardFolder(item->folderId)
+                && !FolderUtils::isStandardFolder(item->folderId)
                 && (folder.status() & QMailFolder::DeletionPermitted);
     case FolderChildCreatePermitted:
         return item->folderId != QMailFolderId::LocalStorageFolderId
@@ -241,20 +227,57 @@ bool FolderListModel::setData(const QModelIndex &index, const QVariant &value, i
         const FolderItem *item = m_folderList.at(index.row());
         Q_ASSERT(item);
 
-        QMailFolder folder(item->folderId);
-        folder.setStatus(QMailFolder::SynchronizationEnabled, value.toBool());
-
-        bool success =  QMailStore::instance()->updateFolder(&folder);
-        if (success) {
-            emit dataChanged(index, index, QVector<int>() << role);
-        }
-        return success;
+        return setSyncEnabled(QVariantList() << item->folderId.toULongLong(), value.toBool());
     }
     default:
         return false;
     }
 }
 
+// Writes the synchronization flag of all the given folders and emits a single change
+// for them, instead of a model reload per folder.
+bool FolderListModel::setSyncEnabled(const QVariantList &folderIds, bool enabled)
+{
+    QHash<QMailFolderId, int> rows;
+    for (int i = 0; i < m_folderList.count(); ++i) {
+        rows.insert(m_folderList.at(i)->folderId, i);
+    }
+
+    bool success = true;
+    int firstRow = -1;
+    int lastRow = -1;
+    for (const QVariant &folderId : folderIds) {
+        const QMailFolderId id(folderId.toULongLong());
+        if (!rows.contains(id) || id == QMailFolderId::LocalStorageFolderId) {
+            qCWarning(lcEmail) << Q_FUNC_INFO << "Folder not in the model:" << folderId;
+            success = false;
+            continue;
+        }
+
+        QMailFolder folder(id);
+        if (bool(folder.status() & QMailFolder::SynchronizationEnabled) == enabled) {
+            continue;
+        }
+
+        folder.setStatus(QMailFolder::SynchronizationEnabled, enabled);
+        m_pendingSyncUpdates.insert(id, folder);
+        if (!QMailStore::instance()->updateFolder(&folder)) {
+            m_pendingSyncUpdates.remove(id);
+            success = false;
+            continue;
+        }
+
+        const int row = rows.value(id);
+        firstRow = (firstRow == -1) ? row : qMin(firstRow, row);
+        lastRow = qMax(lastRow, row);
+    }
+
+    if (firstRow != -1) {
+        emit dataChanged(index(firstRow, 0), index(lastRow, 0), QVector<int>() << FolderSyncEnabled);
+    }
+    return success;
+}
+
 bool FolderListModel::canCreateTopLevelFolders() const
 {
     return m_account.status() & QMailAccount::CanCreateFolders;
@@ -344,19 +367,56 @@ void FolderListModel::onFoldersChanged(const QMailFolderIdList &ids)
 {
     // Don't reload the model if folders are not from current account or a local folder,
     // folders list can be long in some cases.
-    bool needCheckResync = false;
+    QSet<QMailFolderId> changedIds;
     for (const QMailFolderId &folderId : ids) {
         QMailFolder folder(folderId);
+        auto pending = m_pendingSyncUpdates.find(folderId);
+        if (pending != m_pendingSyncUpdates.end()) {
+            const bool unchanged = sameFolder(folder, pending.value());
+            m_pendingSyncUpdates.erase(pending);
+            if (unchanged) {
+                // Sync flag written by this model, already notified
+                continue;
+            }
+        }
         if (folderId == QMailFolderId::LocalStorageFolderId || folder.parentAccountId() == m_accountId) {
-            doReloadModel();
-            emit dataChanged(createIndex(0, 0), createIndex(m_folderList.count() - 1, 0));
-            needCheckResync = true;
-            break;
+            changedIds.insert(folderId);
         }
     }
-    if (needCheckResync) {
-        checkResyncNeeded();
+    if (changedIds.isEmpty()) {
+        return;
     }
+
+    // Renamed or moved folders can take another place in the list
+    QList<FolderItem> previous;
+    for (const FolderItem *item : m_folderList) {
+        previous.append(*item);
+    }
+    doReloadModel();
+
+    bool sameLayout = previous.count() == m_folderList.count();
+    for (int i = 0; sameLayout && i < previous.count(); ++i) {
+        const FolderItem *item = m_folderList.at(i);
+        sameLayout = item->folderId == previous.at(i).folderId
+                && item->folderType == previous.at(i).folderType
+                && item->parentId == previous.at(i).parentId;
+    }
+
+    if (!sameLayout) {
+        emit dataChanged(createIndex(0, 0), createIndex(m_folderList.count() - 1, 0));
+    } else {
+        // Only the folders themselves changed, nesting and order are the same
+        const QVector<int> roles = QVector<int>() << FolderName << FolderServerCount
+                                                  << FolderRenamePermitted << FolderDeletionPermitted
+                                                  << FolderChildCreatePermitted << FolderMovePermitted
+                                                  << FolderMessagesPermitted << FolderSyncEnabled;
+        for (int i = 0; i < m_folderList.count(); ++i) {
+            if (changedIds.contains(m_folderList.at(i)->folderId)) {
+                emit dataChanged(index(i, 0), index(i, 0), roles);
+            }
+        }
+    }
+    checkResyncNeeded();
 }
 
 void FolderListModel::updateUnreadCount(const QMailFolderIdList &folderIds)
@@ -453,13 +513,7 @@ bool FolderListModel::isFolderAncestorOf(int folderId, int ancestorFolderId)
         // Every folder has 'root' ancestor
         return true;
     }
-    while (id.isValid()) {
-        id = QMailFolder(id).parentFolderId();
-        if (id == ancestorId) {
-            return true;
-        }
-    }
-    return false;
+    return FolderHierarchy::instance()->isAncestor(id, ancestorId);
 }
 
 void FolderListModel::createAndAddFolderItem(const QMailFolderId &mailFolderId,
@@ -467,6 +521,9 @@ void FolderListModel::createAndAddFolderItem(const QMailFolderId &mailFolderId,
                                              const QMailMessageKey &folderMessageKey)
 {
     FolderItem *item = new FolderItem(mailFolderId, mailFolderType, folderMessageKey, 0);
+    if (mailFolderId != QMailFolderId::LocalStorageFolderId) {
+        item->parentId = QMailFolder(mailFolderId).parentFolderId();
+    }
     item->unreadCount = FolderUtils::folderUnreadCount(item->folderId, item->folderType, item->messageKey, m_accountId);
     m_folderList.append(item);
 }
@@ -482,9 +539,10 @@ void FolderListModel::addFolderAndChildren(const QMailFolderId &folderId, QMailM
     createAndAddFolderItem(originalList[i], folderType, messageKey);
     originalList.removeAt(i);
     int j = i;
-    while (j < originalList.size() && isAncestorFolder(originalList[j], folderId)) {
+    FolderHierarchy *hierarchy = FolderHierarchy::instance();
+    while (j < originalList.size() && hierarchy->isMailDescendantOrSelf(originalList[j], folderId)) {
         // Do not add any standard folder that might be a child
-        if (isStandardFolder(originalList[j])) {
+        if (FolderUtils::isStandardFolder(originalList[j])) {
             j++;
         } else {
             EmailFolder::FolderType folderType = FolderUtils::folderTypeFromId(originalList[j]);
@@ -499,6 +557,7 @@ void FolderListModel::addFolderAndChildren(const QMailFolderId &folderId, QMailM
 
 void FolderListModel::resetModel()
 {
+    m_pendingSyncUpdates.clear();
     beginResetModel();
     doReloadModel();
     endResetModel();
@@ -16,6 +16,7 @@
 #include <qmailaccount.h>
 
 #include <QAbstractListModel>
+#include <QHash>
 
 class FolderAccessor;
 
@@ -62,6 +63,7 @@ public:
     Q_INVOKABLE int indexFromFolderId(int folderId);
     Q_INVOKABLE int standardFolderIndex(EmailFolder::FolderType folderType);
     Q_INVOKABLE bool isFolderAncestorOf(int folderId, int ancestorFolderId);
+    Q_INVOKABLE bool setSyncEnabled(const QVariantList &folderIds, bool enabled);
 
 signals:
     void canCreateTopLevelFoldersChanged();
@@ -94,6 +96,7 @@ private:
         EmailFolder::FolderType folderType;
         QMailMessageKey messageKey;
         int unreadCount;
+        QMailFolderId parentId;
 
         FolderItem(QMailFolderId mailFolderId, EmailFolder::FolderType mailFolderType,
                    QMailMessageKey folderMessageKey, int folderUnreadCount)
@@ -104,6 +107,9 @@ private:
     QMailAccountId m_accountId;
     QMailAccount m_account;
     QList<FolderItem*> m_folderList;
+    // Folders as written by setSyncEnabled(), their update notifications are already
+    // handled unless something else changed the folder since
+    QHash<QMailFolderId, QMailFolder> m_pendingSyncUpdates;
 };
 
 #endif
@@ -0,0 +1,459 @@
+/*
+ * Copyright (c) 2020 Open Mobile Platform LLC.
+ *
+ * This program is licensed under the terms and conditions of the
+ * Apache License, version 2.0.  The full text of the Apache License is at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include <algorithm>
+
+#include <qmailmessage.h>
+#include <qmailstore.h>
+
+#include "foldertreemodel.h"
+#include "folderaccessor.h"
+#include "folderlistmodel.h"
+#include "folderutils.h"
+#include "logging_p.h"
+
+namespace {
+
+bool nameLessThan(const QString &a, const QString &b)
+{
+    return a.compare(b, Qt::CaseInsensitive) < 0;
+}
+
+}
+
+FolderTreeModel::FolderTreeModel(QObject *parent)
+    : QAbstractItemModel(parent)
+{
+    connect(QMailStore::instance(), &QMailStore::foldersAdded,
+            this, &FolderTreeModel::onFoldersAdded);
+    connect(QMailStore::instance(), &QMailStore::foldersRemoved,
+            this, &FolderTreeModel::onFoldersRemoved);
+    connect(QMailStore::instance(), &QMailStore::foldersUpdated,
+            this, &FolderTreeModel::onFoldersUpdated);
+    connect(QMailStore::instance(), &QMailStore::folderContentsModified,
+            this, &FolderTreeModel::updateUnreadCount);
+}
+
+FolderTreeModel::~FolderTreeModel()
+{
+    releaseChildren(&m_root);
+}
+
+QHash<int, QByteArray> FolderTreeModel::roleNames() const
+{
+    static QHash<int, QByteArray> roles;
+    if (roles.isEmpty()) {
+        roles.insert(FolderListModel::FolderName, "folderName");
+        roles.insert(FolderListModel::FolderId, "folderId");
+        roles.insert(FolderListModel::FolderUnreadCount, "folderUnreadCount");
+        roles.insert(FolderListModel::FolderServerCount, "folderServerCount");
+        roles.insert(FolderListModel::FolderNestingLevel, "folderNestingLevel");
+        roles.insert(FolderListModel::FolderType, "folderType");
+        roles.insert(FolderListModel::FolderRenamePermitted, "canRename");
+        roles.insert(FolderListModel::FolderDeletionPermitted, "canDelete");
+        roles.insert(FolderListModel::FolderChildCreatePermitted, "canCreateChild");
+        roles.insert(FolderListModel::FolderMovePermitted, "canMove");
+        roles.insert(FolderListModel::FolderMessagesPermitted, "canHaveMessages");
+        roles.insert(FolderListModel::FolderSyncEnabled, "syncEnabled");
+        roles.insert(FolderListModel::FolderParentId, "parentFolderId");
+    }
+    return roles;
+}
+
+QModelIndex FolderTreeModel::index(int row, int column, const QModelIndex &parent) const
+{
+    if (!hasIndex(row, column, parent))
+        return QModelIndex();
+
+    Node *parentNode = nodeFromIndex(parent);
+    return createIndex(row, column, parentNode->children.at(row));
+}
+
+QModelIndex FolderTreeModel::parent(const QModelIndex &child) const
+{
+    if (!child.isValid())
+        return QModelIndex();
+
+    return indexFromNode(nodeFromIndex(child)->parent);
+}
+
+int FolderTreeModel::rowCount(const QModelIndex &parent) const
+{
+    if (parent.column() > 0)
+        return 0;
+
+    return nodeFromIndex(parent)->children.count();
+}
+
+int FolderTreeModel::columnCount(const QModelIndex &parent) const
+{
+    Q_UNUSED(parent)
+    return 1;
+}
+
+bool FolderTreeModel::hasChildren(const QModelIndex &parent) const
+{
+    const Node *node = nodeFromIndex(parent);
+    return node->fetched ? !node->children.isEmpty() : !node->unloaded.isEmpty();
+}
+
+bool FolderTreeModel::canFetchMore(const QModelIndex &parent) const
+{
+    const Node *node = nodeFromIndex(parent);
+    return !node->fetched && !node->unloaded.isEmpty();
+}
+
+void FolderTreeModel::fetchMore(const QModelIndex &parent)
+{
+    Node *node = nodeFromIndex(parent);
+    if (node->fetched)
+        return;
+
+    // Folders may have changed since the unloaded children were found
+    for (const QMailFolderId &id : node->unloaded) {
+        m_unloaded.remove(id);
+    }
+    node->unloaded.clear();
+    const QList<Node *> children = queryChildren(node);
+    if (!children.isEmpty()) {
+        beginInsertRows(parent, 0, children.count() - 1);
+        node->children = children;
+        node->fetched = true;
+        endInsertRows();
+    } else {
+        node->fetched = true;
+        if (parent.isValid()) {
+            emit dataChanged(parent, parent);
+        }
+    }
+}
+
+QVariant FolderTreeModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid())
+        return QVariant();
+
+    const Node *node = nodeFromIndex(index);
+
+    switch (role) {
+    case FolderListModel::FolderName:
+        return node->name;
+    case FolderListModel::FolderId:
+        return node->folderId.toULongLong();
+    case FolderListModel::FolderUnreadCount:
+        return node->unreadCount;
+    case FolderListModel::FolderServerCount:
+        return node->serverCount;
+    case FolderListModel::FolderNestingLevel:
+        return node->depth;
+    case FolderListModel::FolderType:
+        return node->folderType;
+    case FolderListModel::FolderRenamePermitted:
+    case FolderListModel::FolderMovePermitted:
+        return !FolderUtils::isStandardFolderType(node->folderType)
+                && (node->status & QMailFolder::RenamePermitted);
+    case FolderListModel::FolderDeletionPermitted:
+        return !FolderUtils::isStandardFolderType(node->folderType)
+                && (node->status & QMailFolder::DeletionPermitted);
+    case FolderListModel::FolderChildCreatePermitted:
+        return bool(node->status & QMailFolder::ChildCreationPermitted);
+    case FolderListModel::FolderMessagesPermitted:
+        return bool(node->status & QMailFolder::MessagesPermitted);
+    case FolderListModel::FolderSyncEnabled:
+        return bool(node->status & QMailFolder::SynchronizationEnabled);
+    case FolderListModel::FolderParentId:
+        return node->parent->folderId.toULongLong();
+    default:
+        return QVariant();
+    }
+}
+
+void FolderTreeModel::setAccountKey(int id)
+{
+    QMailAccountId accountId(id);
+    if (accountId.isValid()) {
+        m_accountId = accountId;
+        resetModel();
+        emit accountKeyChanged();
+    } else {
+        qCWarning(lcEmail) << "Can't create folder tree model for invalid account:" << id;
+    }
+}
+
+int FolderTreeModel::accountKey() const
+{
+    return static_cast<int>(m_accountId.toULongLong());
+}
+
+FolderAccessor *FolderTreeModel::folderAccessor(const QModelIndex &index)
+{
+    if (!index.isValid())
+        return nullptr;
+
+    const Node *node = nodeFromIndex(index);
+    FolderAccessor *accessor = new FolderAccessor(node->folderId, node->folderType, node->messageKey);
+    accessor->setAccountId(m_accountId);
+    return accessor;
+}
+
+// Releases the loaded children of a folder, they get loaded again on next fetchMore()
+void FolderTreeModel::collapse(const QModelIndex &index)
+{
+    Node *node = nodeFromIndex(index);
+    if (!index.isValid() || !node->fetched)
+        return;
+
+    if (!node->children.isEmpty()) {
+        beginRemoveRows(index, 0, node->children.count() - 1);
+        QMailFolderIdList ids;
+        for (const Node *child : node->children) {
+            ids.append(child->folderId);
+        }
+        releaseChildren(node);
+        for (const QMailFolderId &id : ids) {
+            addUnloaded(id, node);
+        }
+        endRemoveRows();
+    }
+    node->fetched = false;
+}
+
+void FolderTreeModel::onFoldersAdded(const QMailFolderIdList &ids)
+{
+    for (const QMailFolderId &id : ids) {
+        const QMailFolder folder(id);
+        if (folder.parentAccountId() != m_accountId || m_nodes.contains(id) || m_unloaded.contains(id))
+            continue;
+
+        placeFolder(folder);
+    }
+}
+
+void FolderTreeModel::onFoldersRemoved(const QMailFolderIdList &ids)
+{
+    for (const QMailFolderId &id : ids) {
+        // Children get removed with their parent
+        if (Node *node = m_nodes.value(id)) {
+            removeNode(node);
+        } else if (m_unloaded.contains(id)) {
+            removeUnloaded(id);
+        }
+    }
+}
+
+void FolderTreeModel::onFoldersUpdated(const QMailFolderIdList &ids)
+{
+    for (const QMailFolderId &id : ids) {
+        const QMailFolder folder(id);
+        const bool ownFolder = folder.parentAccountId() == m_accountId;
+        if (Node *node = m_nodes.value(id)) {
+            if (ownFolder && folder.parentFolderId() == node->parent->folderId
+                    && folder.displayName() == node->name) {
+                node->serverCount = folder.serverCount();
+                node->status = folder.status();
+                const QModelIndex changedIndex = indexFromNode(node);
+                emit dataChanged(changedIndex, changedIndex);
+                continue;
+            }
+            // Moved or renamed, place it again
+            removeNode(node);
+        } else if (Node *parentNode = m_unloaded.value(id)) {
+            if (ownFolder && folder.parentFolderId() == parentNode->folderId)
+                continue;
+            // Moved away from a folder not expanded
+            removeUnloaded(id);
+        }
+
+        if (ownFolder) {
+            placeFolder(folder);
+        }
+    }
+}
+
+void FolderTreeModel::updateUnreadCount(const QMailFolderIdList &folderIds)
+{
+    QList<Node *> nodes;
+    for (const QMailFolderId &id : folderIds) {
+        if (Node *node = m_nodes.value(id)) {
+            nodes.append(node);
+        }
+    }
+
+    updateUnreadCounts(nodes);
+    for (Node *node : nodes) {
+        const QModelIndex changedIndex = indexFromNode(node);
+        emit dataChanged(changedIndex, changedIndex, QVector<int>() << FolderListModel::FolderUnreadCount);
+    }
+}
+
+FolderTreeModel::Node *FolderTreeModel::nodeFromIndex(const QModelIndex &index) const
+{
+    if (index.isValid()) {
+        return static_cast<Node *>(index.internalPointer());
+    }
+    return const_cast<Node *>(&m_root);
+}
+
+QModelIndex FolderTreeModel::indexFromNode(Node *node) const
+{
+    if (!node || node == &m_root)
+        return QModelIndex();
+
+    return createIndex(node->parent->children.indexOf(node), 0, node);
+}
+
+FolderTreeModel::Node *FolderTreeModel::createNode(const QMailFolder &folder, Node *parent)
+{
+    Node *node = new Node;
+    node->folderId = folder.id();
+    node->name = folder.displayName();
+    node->serverCount = folder.serverCount();
+    node->status = folder.status();
+    node->folderType = FolderUtils::folderTypeFromId(folder.id());
+    node->messageKey = QMailMessageKey::status(QMailMessage::Removed, QMailDataComparator::Excludes);
+    if (node->folderType != EmailFolder::TrashFolder) {
+        node->messageKey &= QMailMessageKey::status(QMailMessage::Trash, QMailDataComparator::Excludes);
+    }
+    node->depth = parent->depth + 1;
+    node->parent = parent;
+    m_nodes.insert(node->folderId, node);
+    return node;
+}
+
+QList<FolderTreeModel::Node *> FolderTreeModel::queryChildren(Node *node)
+{
+    const QMailFolderKey key = QMailFolderKey::parentAccountId(m_accountId)
+            & QMailFolderKey::parentFolderId(node->folderId);
+    const QMailFolderIdList ids = QMailStore::instance()->queryFolders(key);
+
+    QList<Node *> children;
+    for (const QMailFolderId &id : ids) {
+        children.append(createNode(QMailFolder(id), node));
+    }
+    updateUnreadCounts(children);
+    findUnloadedChildren(children);
+    std::sort(children.begin(), children.end(), [](const Node *a, const Node *b) {
+        return nameLessThan(a->name, b->name);
+    });
+    return children;
+}
+
+void FolderTreeModel::updateUnreadCounts(const QList<Node *> &nodes)
+{
+    for (Node *node : nodes) {
+        node->unreadCount = FolderUtils::folderUnreadCount(node->folderId, node->folderType,
+                                                           node->messageKey, m_accountId);
+    }
+}
+
+void FolderTreeModel::findUnloadedChildren(const QList<Node *> &nodes)
+{
+    // Only the ids, the children are loaded when their parent gets expanded
+    for (Node *node : nodes) {
+        const QMailFolderKey key = QMailFolderKey::parentAccountId(m_accountId)
+                & QMailFolderKey::parentFolderId(node->folderId);
+        for (const QMailFolderId &id : QMailStore::instance()->queryFolders(key)) {
+            addUnloaded(id, node);
+        }
+    }
+}
+
+void FolderTreeModel::addUnloaded(const QMailFolderId &id, Node *parent)
+{
+    parent->unloaded.insert(id);
+    m_unloaded.insert(id, parent);
+}
+
+void FolderTreeModel::removeUnloaded(const QMailFolderId &id)
+{
+    Node *parent = m_unloaded.take(id);
+    parent->unloaded.remove(id);
+    const QModelIndex parentIndex = indexFromNode(parent);
+    if (parentIndex.isValid()) {
+        emit dataChanged(parentIndex, parentIndex);
+    }
+}
+
+void FolderTreeModel::placeFolder(const QMailFolder &folder)
+{
+    Node *parentNode = folder.parentFolderId().isValid() ? m_nodes.value(folder.parentFolderId()) : &m_root;
+    if (!parentNode) {
+        // Parent branch not loaded
+        return;
+    } else if (parentNode->fetched) {
+        insertNode(folder, parentNode);
+    } else {
+        addUnloaded(folder.id(), parentNode);
+        const QModelIndex parentIndex = indexFromNode(parentNode);
+        if (parentIndex.isValid()) {
+            emit dataChanged(parentIndex, parentIndex);
+        }
+    }
+}
+
+void FolderTreeModel::insertNode(const QMailFolder &folder, Node *parent)
+{
+    const QString name = folder.displayName();
+    auto it = std::lower_bound(parent->children.begin(), parent->children.end(), name,
+                               [](const Node *node, const QString &name) {
+        return nameLessThan(node->name, name);
+    });
+    const int row = it - parent->children.begin();
+
+    Node *node = createNode(folder, parent);
+    updateUnreadCounts(QList<Node *>() << node);
+    findUnloadedChildren(QList<Node *>() << node);
+
+    beginInsertRows(indexFromNode(parent), row, row);
+    parent->children.insert(row, node);
+    endInsertRows();
+}
+
+void FolderTreeModel::removeNode(Node *node)
+{
+    Node *parent = node->parent;
+    const int row = parent->children.indexOf(node);
+    Q_ASSERT(row >= 0);
+
+    beginRemoveRows(indexFromNode(parent), row, row);
+    parent->children.removeAt(row);
+    deleteNode(node);
+    endRemoveRows();
+}
+
+void FolderTreeModel::deleteNode(Node *node)
+{
+    releaseChildren(node);
+    for (const QMailFolderId &id : node->unloaded) {
+        m_unloaded.remove(id);
+    }
+    m_nodes.remove(node->folderId);
+    delete node;
+}
+
+void FolderTreeModel::releaseChildren(Node *node)
+{
+    for (Node *child : node->children) {
+        deleteNode(child);
+    }
+    node->children.clear();
+}
+
+void FolderTreeModel::resetModel()
+{
+    beginResetModel();
+    releaseChildren(&m_root);
+    m_root.unloaded.clear();
+    m_unloaded.clear();
+    m_root.fetched = false;
+    if (m_accountId.isValid()) {
+        m_root.children = queryChildren(&m_root);
+        m_root.fetched = true;
+    }
+    endResetModel();
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2020 Open Mobile Platform LLC.
+ *
+ * This program is licensed under the terms and conditions of the
+ * Apache License, version 2.0.  The full text of the Apache License is at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef FOLDERTREEMODEL_H
+#define FOLDERTREEMODEL_H
+
+#include <QAbstractItemModel>
+#include <QHash>
+#include <QSet>
+
+#include <qmailfolder.h>
+#include <qmailaccount.h>
+#include <qmailmessagekey.h>
+
+#include "emailfolder.h"
+
+class FolderAccessor;
+
+// Hierarchical variant of FolderListModel with the same roles.
+// Only top level folders are loaded initially, children of a folder are loaded
+// when the folder gets expanded through fetchMore() and can be released with collapse().
+class Q_DECL_EXPORT FolderTreeModel : public QAbstractItemModel
+{
+    Q_OBJECT
+    Q_PROPERTY(int accountKey READ accountKey WRITE setAccountKey NOTIFY accountKeyChanged FINAL)
+
+public:
+    explicit FolderTreeModel(QObject *parent = nullptr);
+    ~FolderTreeModel();
+
+    QModelIndex index(int row, int column, const QModelIndex &parent = QModelIndex()) const override;
+    QModelIndex parent(const QModelIndex &child) const override;
+    int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+    int columnCount(const QModelIndex &parent = QModelIndex()) const override;
+    bool hasChildren(const QModelIndex &parent = QModelIndex()) const override;
+    bool canFetchMore(const QModelIndex &parent) const override;
+    void fetchMore(const QModelIndex &parent) override;
+    QVariant data(const QModelIndex &index, int role) const override;
+
+    void setAccountKey(int id);
+    int accountKey() const;
+
+    Q_INVOKABLE FolderAccessor *folderAccessor(const QModelIndex &index);
+    Q_INVOKABLE void collapse(const QModelIndex &index);
+
+signals:
+    void accountKeyChanged();
+
+protected:
+    QHash<int, QByteArray> roleNames() const override;
+
+private slots:
+    void onFoldersAdded(const QMailFolderIdList &ids);
+    void onFoldersRemoved(const QMailFolderIdList &ids);
+    void onFoldersUpdated(const QMailFolderIdList &ids);
+    void updateUnreadCount(const QMailFolderIdList &folderIds);
+
+private:
+    struct Node {
+        QMailFolderId folderId;
+        QString name;
+        EmailFolder::FolderType folderType = EmailFolder::NormalFolder;
+        QMailMessageKey messageKey;
+        int unreadCount = 0;
+        int serverCount = 0;
+        quint64 status = 0;
+        int depth = -1;
+        bool fetched = false;
+        Node *parent = nullptr;
+        QList<Node *> children;
+        QSet<QMailFolderId> unloaded; // children known before they are loaded
+    };
+
+    Node *nodeFromIndex(const QModelIndex &index) const;
+    QModelIndex indexFromNode(Node *node) const;
+    Node *createNode(const QMailFolder &folder, Node *parent);
+    QList<Node *> queryChildren(Node *node);
+    void updateUnreadCounts(const QList<Node *> &nodes);
+    void findUnloadedChildren(const QList<Node *> &nodes);
+    void addUnloaded(const QMailFolderId &id, Node *parent);
+    void removeUnloaded(const QMailFolderId &id);
+    void placeFolder(const QMailFolder &folder);
+    void insertNode(const QMailFolder &folder, Node *parent);
+    void removeNode(Node *node);
+    void deleteNode(Node *node);
+    void releaseChildren(Node *node);
+    void resetModel();
+
+    QMailAccountId m_accountId;
+    Node m_root;
+    QHash<QMailFolderId, Node *> m_nodes;
+    // Parents of the unloaded children
+    QHash<QMailFolderId, Node *> m_unloaded;
+};
+
+#endif
@@ -98,3 +98,15 @@ bool FolderUtils::isOutgoingFolderType(EmailFolder::FolderType type)
             || type == EmailFolder::DraftsFolder
             || type == EmailFolder::OutboxFolder);
 }
+
+bool FolderUtils::isStandardFolder(const QMailFolderId &id)
+{
+    return isStandardFolderType(folderTypeFromId(id));
+}
+
+bool FolderUtils::isStandardFolderType(EmailFolder::FolderType folderType)
+{
+    return folderType == EmailFolder::InboxFolder || folderType == EmailFolder::DraftsFolder
+            || folderType == EmailFolder::SentFolder || folderType == EmailFolder::TrashFolder
+            || folderType == EmailFolder::OutboxFolder || folderType == EmailFolder::JunkFolder;
+}
@@ -21,6 +21,8 @@ int folderUnreadCount(const QMailFolderId &folderId, EmailFolder::FolderType fol
                       QMailMessageKey folderMessageKey, QMailAccountId accountId);
 EmailFolder::FolderType folderTypeFromId(const QMailFolderId &id);
 bool isOutgoingFolderType(EmailFolder::FolderType type);
+bool isStandardFolder(const QMailFolderId &id);
+bool isStandardFolderType(EmailFolder::FolderType folderType);
 
 }
 
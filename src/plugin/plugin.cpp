@@ -36,6 +36,7 @@
 #include "folderlistmodel.h"
 #include "folderlistproxymodel.h"
 #include "folderlistfiltertypemodel.h"
+#include "foldertreemodel.h"
 #include "emailaccountlistmodel.h"
 #include "emailtransmitaddresslistmodel.h"
 #include "emailmessagelistmodel.h"
@@ -78,6 +79,7 @@ public:
         qmlRegisterType<FolderListModel>(uri, 0, 1, "FolderListModel");
         qmlRegisterType<FolderListProxyModel>(uri, 0, 1, "FolderListProxyModel");
         qmlRegisterType<FolderListFilterTypeModel>(uri, 0, 1, "FolderListFilterTypeModel");
+        qmlRegisterType<FolderTreeModel>(uri, 0, 1, "FolderTreeModel");
         qmlRegisterType<EmailAccountListModel>(uri, 0, 1, "EmailAccountListModel");
         qmlRegisterType<EmailTransmitAddressListModel>(uri, 0, 1, "EmailTransmitAddressListModel");
         qmlRegisterType<EmailMessageListModel>(uri, 0, 1, "EmailMessageListModel");
@@ -5,13 +5,16 @@ TARGET = nemoemail-qt5
 PKGCONFIG += QmfMessageServer QmfClient accounts-qt5
 
 SOURCES += \
+    $$PWD/actionjournal.cpp \
     $$PWD/emailaccountlistmodel.cpp \
     $$PWD/emailtransmitaddresslistmodel.cpp \
     $$PWD/emailmessagelistmodel.cpp \
     $$PWD/folderaccessor.cpp \
+    $$PWD/folderhierarchy.cpp \
     $$PWD/folderlistmodel.cpp \
     $$PWD/folderlistproxymodel.cpp \
     $$PWD/folderlistfiltertypemodel.cpp \
+    $$PWD/foldertreemodel.cpp \
     $$PWD/folderutils.cpp \
     $$PWD/emailagent.cpp \
     $$PWD/emailmessage.cpp \
@@ -21,6 +24,9 @@ SOURCES += \
     $$PWD/emailfolder.cpp \
     $$PWD/emailautoconfig.cpp \
     $$PWD/attachmentlistmodel.cpp \
+    $$PWD/attachmentstore.cpp \
+    $$PWD/attachmentverifier.cpp \
+    $$PWD/attachmentwriter.cpp \
     $$PWD/logging.cpp
 
 # could make more of these private?
@@ -32,7 +38,11 @@ PUBLIC_HEADERS += \
     $$PWD/emailaccount.h \
 
 PRIVATE_HEADERS += \
+    $$PWD/actionjournal.h \
     $$PWD/attachmentlistmodel.h \
+    $$PWD/attachmentstore.h \
+    $$PWD/attachmentverifier.h \
+    $$PWD/attachmentwriter.h \
     $$PWD/emailaccountlistmodel.h \
     $$PWD/emailtransmitaddresslistmodel.h \
     $$PWD/emailfolder.h \
@@ -40,9 +50,11 @@ PRIVATE_HEADERS += \
     $$PWD/emailutils.h \
     $$PWD/emailautoconfig.h \
     $$PWD/folderaccessor.h \
+    $$PWD/folderhierarchy.h \
     $$PWD/folderlistmodel.h \
     $$PWD/folderlistproxymodel.h \
     $$PWD/folderlistfiltertypemodel.h \
+    $$PWD/foldertreemodel.h \
     $$PWD/folderutils.h \
     $$PWD/logging_p.h \
 
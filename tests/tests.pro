@@ -3,6 +3,9 @@ SUBDIRS = \
     tst_emailfolder \
     tst_emailmessage \
     tst_folderlistmodel \
+    tst_foldertreemodel \
+    tst_downloadqueue \
+    tst_attachmentstore \
     tst_autoconfig
 
 tests_xml.target = tests.xml
@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2020 Open Mobile Platform LLC.
+ *
+ * This program is licensed under the terms and conditions of the
+ * Apache License, version 2.0.  The full text of the Apache License is at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include <QDir>
+#include <QFile>
+#include <QObject>
+#include <QTemporaryDir>
+#include <QTest>
+#include <qmailstore.h>
+
+#include "attachmentstore.h"
+/*
+    Unit test for AttachmentStore class.
+*/
+class tst_AttachmentStore : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void cleanupTestCase();
+    void init();
+
+    void sharedContent();
+    void removedWhileNotRunning();
+    void sharedIndex();
+
+private:
+    QMailMessageId addMessage(const QString &subject);
+    QString writeIncoming(const AttachmentStore &store, const QString &name);
+
+    QScopedPointer<QTemporaryDir> m_root;
+    QMailAccount m_account;
+    QMailFolder m_folder;
+};
+
+void tst_AttachmentStore::initTestCase()
+{
+    QMailAccountConfiguration config;
+    m_account.setName("Account 1");
+    QVERIFY(QMailStore::instance()->addAccount(&m_account, &config));
+
+    m_folder = QMailFolder("TestFolder", QMailFolderId(), m_account.id());
+    QVERIFY(QMailStore::instance()->addFolder(&m_folder));
+    QVERIFY(m_folder.id().isValid());
+}
+
+void tst_AttachmentStore::cleanupTestCase()
+{
+    QMailStore::instance()->removeAccount(m_account.id());
+}
+
+void tst_AttachmentStore::init()
+{
+    m_root.reset(new QTemporaryDir);
+    QVERIFY(m_root->isValid());
+}
+
+QMailMessageId tst_AttachmentStore::addMessage(const QString &subject)
+{
+    QMailMessage message;
+    message.setMessageType(QMailMessage::Email);
+    message.setParentAccountId(m_account.id());
+    message.setParentFolderId(m_folder.id());
+    message.setSubject(subject);
+    message.setServerUid(subject);
+    message.setStatus(QMailMessage::Incoming, true);
+    if (!QMailStore::instance()->addMessage(&message)) {
+        return QMailMessageId();
+    }
+    return message.id();
+}
+
+QString tst_AttachmentStore::writeIncoming(const AttachmentStore &store, const QString &name)
+{
+    QDir().mkpath(store.temporaryDirectory());
+    QFile file(store.temporaryDirectory() + '/' + name);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return QString();
+    }
+    file.write("attachment content");
+    return file.fileName();
+}
+
+void tst_AttachmentStore::sharedContent()
+{
+    AttachmentStore store(m_root->path());
+    const QByteArray digest = QByteArray::fromHex("0102");
+    const QMailMessageId message1 = addMessage("sharedContent1");
+    const QMailMessageId message2 = addMessage("sharedContent2");
+    QVERIFY(message1.isValid());
+    QVERIFY(message2.isValid());
+
+    const QString first = store.add(writeIncoming(store, "a"), digest, "a.txt", message1, "location1");
+    const QString second = store.add(writeIncoming(store, "b"), digest, "b.txt", message2, "location2");
+    QCOMPARE(first, m_root->path() + QStringLiteral("/0102/a.txt"));
+    QCOMPARE(second, m_root->path() + QStringLiteral("/0102/b.txt"));
+    QVERIFY(QFile::exists(first));
+    QVERIFY(QFile::exists(second));
+    QVERIFY(QDir(store.temporaryDirectory()).entryList(QDir::Files).isEmpty());
+
+    // Files go with the last message referring to them
+    QVERIFY(QMailStore::instance()->removeMessage(message1));
+    QTRY_VERIFY(!QFile::exists(first));
+    QVERIFY(QFile::exists(second));
+
+    QVERIFY(QMailStore::instance()->removeMessage(message2));
+    QTRY_VERIFY(!QFile::exists(second));
+    QVERIFY(!QDir(m_root->path() + QStringLiteral("/0102")).exists());
+}
+
+void tst_AttachmentStore::removedWhileNotRunning()
+{
+    const QMailMessageId message = addMessage("removedWhileNotRunning");
+    QVERIFY(message.isValid());
+
+    QString path;
+    {
+        AttachmentStore store(m_root->path());
+        path = store.add(writeIncoming(store, "a"), QByteArray::fromHex("0304"), "a.txt", message, "location");
+        QVERIFY(QFile::exists(path));
+    }
+
+    QVERIFY(QMailStore::instance()->removeMessage(message));
+    QCoreApplication::processEvents();
+
+    // Reconciled with the mail store when loaded again
+    AttachmentStore store(m_root->path());
+    QVERIFY(!QFile::exists(path));
+}
+
+void tst_AttachmentStore::sharedIndex()
+{
+    // Like two processes using the same store
+    AttachmentStore store1(m_root->path());
+    AttachmentStore store2(m_root->path());
+    const QByteArray digest = QByteArray::fromHex("0506");
+    const QMailMessageId message1 = addMessage("sharedIndex1");
+    const QMailMessageId message2 = addMessage("sharedIndex2");
+    QVERIFY(message1.isValid());
+    QVERIFY(message2.isValid());
+
+    const QString path = store1.add(writeIncoming(store1, "a"), digest, "a.txt", message1, "location1");
+    QCOMPARE(store2.add(writeIncoming(store2, "a"), digest, "a.txt", message2, "location2"), path);
+
+    // Still referred to by the message saved through the other store
+    QVERIFY(QMailStore::instance()->removeMessage(message1));
+    QTest::qWait(100);
+    QVERIFY(QFile::exists(path));
+
+    QVERIFY(QMailStore::instance()->removeMessage(message2));
+    QTRY_VERIFY(!QFile::exists(path));
+}
+
+#include "tst_attachmentstore.moc"
+QTEST_MAIN(tst_AttachmentStore)
@@ -0,0 +1,4 @@
+include(../common.pri)
+TARGET = tst_attachmentstore
+
+SOURCES += tst_attachmentstore.cpp
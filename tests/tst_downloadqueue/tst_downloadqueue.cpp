@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2020 Open Mobile Platform LLC.
+ *
+ * This program is licensed under the terms and conditions of the
+ * Apache License, version 2.0.  The full text of the Apache License is at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include <QObject>
+#include <QTest>
+#include <QLoggingCategory>
+#include <QTemporaryDir>
+
+#include "downloadqueue.h"
+
+Q_LOGGING_CATEGORY(lcAD, "org.qt.messageserver.attachmentdownloader", QtWarningMsg)
+
+/*
+    Unit test for DownloadQueue class.
+*/
+class tst_DownloadQueue : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void init();
+
+    void accountsTakeTurns();
+    void duplicates();
+    void requeue();
+    void runningLimit();
+    void removeAccounts();
+    void persistence();
+
+private:
+    QString queuePath() const;
+    static DownloadQueue::Job job(quint64 account, quint64 message, int part);
+    static QString takeNext(DownloadQueue *queue);
+
+    QScopedPointer<QTemporaryDir> m_dir;
+};
+
+void tst_DownloadQueue::init()
+{
+    m_dir.reset(new QTemporaryDir);
+    QVERIFY(m_dir->isValid());
+}
+
+QString tst_DownloadQueue::queuePath() const
+{
+    return m_dir->filePath("queue");
+}
+
+DownloadQueue::Job tst_DownloadQueue::job(quint64 account, quint64 message, int part)
+{
+    DownloadQueue::Job job;
+    job.accountId = QMailAccountId(account);
+    job.location = QMailMessagePart::Location(QString("%1-%2").arg(message).arg(part));
+    job.size = 1024;
+    return job;
+}
+
+// Location of the next part, empty if there is none
+QString tst_DownloadQueue::takeNext(DownloadQueue *queue)
+{
+    DownloadQueue::Job next;
+    if (!queue->takeNext([](const DownloadQueue::Job &) { return true; }, &next)) {
+        return QString();
+    }
+    return next.location.toString(true);
+}
+
+void tst_DownloadQueue::accountsTakeTurns()
+{
+    DownloadQueue queue(queuePath());
+    QVERIFY(queue.enqueue(job(1, 10, 1)));
+    QVERIFY(queue.enqueue(job(1, 10, 2)));
+    QVERIFY(queue.enqueue(job(1, 11, 1)));
+    QVERIFY(queue.enqueue(job(2, 20, 1)));
+    QCOMPARE(queue.size(), 4);
+
+    QCOMPARE(takeNext(&queue), QString("10-1"));
+    QCOMPARE(takeNext(&queue), QString("20-1"));
+    QCOMPARE(takeNext(&queue), QString("10-2"));
+    QCOMPARE(takeNext(&queue), QString("11-1"));
+
+    // An account not ready lets the next one go first
+    DownloadQueue other(m_dir->filePath("other"));
+    QVERIFY(other.enqueue(job(1, 10, 1)));
+    QVERIFY(other.enqueue(job(2, 20, 1)));
+    DownloadQueue::Job next;
+    QVERIFY(other.takeNext([](const DownloadQueue::Job &job) { return job.accountId != QMailAccountId(1); }, &next));
+    QCOMPARE(next.location.toString(true), QString("20-1"));
+    QVERIFY(!other.takeNext([](const DownloadQueue::Job &job) { return job.accountId != QMailAccountId(1); }, &next));
+    QCOMPARE(takeNext(&other), QString("10-1"));
+}
+
+void tst_DownloadQueue::duplicates()
+{
+    DownloadQueue queue(queuePath());
+    QVERIFY(queue.enqueue(job(1, 10, 1)));
+    QVERIFY(!queue.enqueue(job(1, 10, 1)));
+    QCOMPARE(queue.size(), 1);
+
+    // Also while downloading
+    QCOMPARE(takeNext(&queue), QString("10-1"));
+    QVERIFY(!queue.enqueue(job(1, 10, 1)));
+
+    // Queued again once finished
+    queue.finish(job(1, 10, 1).location);
+    QCOMPARE(queue.size(), 0);
+    QVERIFY(queue.enqueue(job(1, 10, 1)));
+}
+
+void tst_DownloadQueue::requeue()
+{
+    DownloadQueue queue(queuePath());
+    QVERIFY(queue.enqueue(job(1, 10, 1)));
+    QVERIFY(queue.enqueue(job(1, 10, 2)));
+    QCOMPARE(takeNext(&queue), QString("10-1"));
+
+    // Runs again before the rest of the account
+    queue.requeue(job(1, 10, 1).location);
+    QCOMPARE(queue.size(), 2);
+    QCOMPARE(takeNext(&queue), QString("10-1"));
+    QCOMPARE(takeNext(&queue), QString("10-2"));
+}
+
+void tst_DownloadQueue::runningLimit()
+{
+    DownloadQueue queue(queuePath());
+    for (int part = 1; part <= 5; ++part) {
+        QVERIFY(queue.enqueue(job(1, 10, part)));
+    }
+
+    for (int part = 1; part <= 4; ++part) {
+        QCOMPARE(takeNext(&queue), QString("10-%1").arg(part));
+    }
+    QVERIFY(takeNext(&queue).isEmpty());
+
+    queue.finish(job(1, 10, 2).location);
+    QCOMPARE(takeNext(&queue), QString("10-5"));
+}
+
+void tst_DownloadQueue::removeAccounts()
+{
+    DownloadQueue queue(queuePath());
+    QVERIFY(queue.enqueue(job(1, 10, 1)));
+    QVERIFY(queue.enqueue(job(1, 10, 2)));
+    QVERIFY(queue.enqueue(job(2, 20, 1)));
+    QCOMPARE(takeNext(&queue), QString("10-1"));
+    QCOMPARE(queue.accounts().size(), 2);
+
+    queue.removeAccounts(QMailAccountIdList() << QMailAccountId(1));
+    QCOMPARE(queue.size(), 1);
+    QCOMPARE(queue.accounts(), QMailAccountIdList() << QMailAccountId(2));
+    QCOMPARE(takeNext(&queue), QString("20-1"));
+    QVERIFY(takeNext(&queue).isEmpty());
+}
+
+void tst_DownloadQueue::persistence()
+{
+    {
+        DownloadQueue queue(queuePath());
+        QVERIFY(queue.enqueue(job(1, 10, 1)));
+        QVERIFY(queue.enqueue(job(1, 10, 2)));
+        QVERIFY(queue.enqueue(job(2, 20, 1)));
+        QCOMPARE(takeNext(&queue), QString("10-1"));
+        QCOMPARE(takeNext(&queue), QString("20-1"));
+        queue.finish(job(2, 20, 1).location);
+        // Saved when destroyed
+    }
+
+    {
+        DownloadQueue queue(queuePath());
+        QCOMPARE(queue.size(), 0);
+        queue.restore([](const DownloadQueue::Job &) { return true; });
+        QCOMPARE(queue.size(), 2);
+        // The interrupted download goes first
+        QCOMPARE(takeNext(&queue), QString("10-1"));
+        QCOMPARE(takeNext(&queue), QString("10-2"));
+    }
+
+    // Parts not accepted anymore are dropped
+    {
+        DownloadQueue queue(queuePath());
+        queue.restore([](const DownloadQueue::Job &job) {
+            return job.location.toString(true) != QLatin1String("10-1");
+        });
+        QCOMPARE(queue.size(), 1);
+        QCOMPARE(takeNext(&queue), QString("10-2"));
+    }
+}
+
+#include "tst_downloadqueue.moc"
+QTEST_MAIN(tst_DownloadQueue)
@@ -0,0 +1,8 @@
+include(../common.pri)
+TARGET = tst_downloadqueue
+
+INCLUDEPATH += $$SRCDIR/attachmentdownloader
+
+SOURCES += tst_downloadqueue.cpp \
+    $$SRCDIR/attachmentdownloader/downloadqueue.cpp
+HEADERS += $$SRCDIR/attachmentdownloader/downloadqueue.h
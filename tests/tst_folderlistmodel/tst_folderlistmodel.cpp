@@ -9,9 +9,11 @@
 
 #include <QObject>
 #include <QTest>
+#include <QSignalSpy>
 #include <qmailstore.h>
 
 #include "folderlistmodel.h"
+#include "folderlistfiltertypemodel.h"
 /*
     Unit test for FolderListModel class.
 */
@@ -24,6 +26,11 @@ private slots:
     void cleanupTestCase();
 
     void sortModel();
+    void folderAncestors();
+    void setSyncEnabled();
+    void folderUpdated();
+    void syncFolderList();
+    void nameFilter();
 
 private:
     QMailAccount m_account;
@@ -116,5 +123,143 @@ void tst_FolderListModel::sortModel()
     QCOMPARE(model.folderId(8), int(m_folder3.id().toULongLong()));
 }
 
+void tst_FolderListModel::folderAncestors()
+{
+    FolderListModel model;
+    model.setAccountKey(m_account.id().toULongLong());
+
+    const int folder1 = m_folder1.id().toULongLong();
+    const int folder2 = m_folder2.id().toULongLong();
+    const int folder2_2 = m_folder2_2.id().toULongLong();
+    const int folder3 = m_folder3.id().toULongLong();
+
+    QVERIFY(model.isFolderAncestorOf(folder2_2, folder2));
+    QVERIFY(!model.isFolderAncestorOf(folder2, folder2_2));
+    QVERIFY(!model.isFolderAncestorOf(folder2, folder2));
+    QVERIFY(!model.isFolderAncestorOf(folder3, folder2));
+    // Invalid ancestor is the root of every folder
+    QVERIFY(model.isFolderAncestorOf(folder1, 0));
+
+    // Moving a folder updates the labels
+    m_folder2.setParentFolderId(m_folder1.id());
+    QVERIFY(QMailStore::instance()->updateFolder(&m_folder2));
+    QTRY_VERIFY(model.isFolderAncestorOf(folder2, folder1));
+    QVERIFY(model.isFolderAncestorOf(folder2_2, folder1));
+    QVERIFY(!model.isFolderAncestorOf(folder1, folder2));
+
+    m_folder2.setParentFolderId(QMailFolderId());
+    QVERIFY(QMailStore::instance()->updateFolder(&m_folder2));
+    QTRY_VERIFY(!model.isFolderAncestorOf(folder2_2, folder1));
+}
+
+void tst_FolderListModel::setSyncEnabled()
+{
+    FolderListModel model;
+    model.setAccountKey(m_account.id().toULongLong());
+
+    QSignalSpy dataChanged(&model, &FolderListModel::dataChanged);
+    QSignalSpy reset(&model, &FolderListModel::modelReset);
+    QVariantList folderIds;
+    folderIds << m_folder1.id().toULongLong() << m_folder3.id().toULongLong();
+
+    QVERIFY(model.setSyncEnabled(folderIds, true));
+    QCOMPARE(dataChanged.count(), 1);
+    QVERIFY(QMailFolder(m_folder1.id()).status() & QMailFolder::SynchronizationEnabled);
+    QVERIFY(QMailFolder(m_folder3.id()).status() & QMailFolder::SynchronizationEnabled);
+    QVERIFY(model.data(model.index(model.indexFromFolderId(m_folder1.id().toULongLong()), 0),
+                       FolderListModel::FolderSyncEnabled).toBool());
+
+    // Unchanged folders are not written again
+    QVERIFY(model.setSyncEnabled(folderIds, true));
+    QCOMPARE(dataChanged.count(), 1);
+
+    QVERIFY(model.setSyncEnabled(folderIds, false));
+    QCOMPARE(dataChanged.count(), 2);
+    QVERIFY(!(QMailFolder(m_folder1.id()).status() & QMailFolder::SynchronizationEnabled));
+    QCOMPARE(reset.count(), 0);
+}
+
+void tst_FolderListModel::folderUpdated()
+{
+    FolderListModel model;
+    model.setAccountKey(m_account.id().toULongLong());
+    const int row = model.indexFromFolderId(m_folder3.id().toULongLong());
+
+    // Only the updated folder is notified while the layout stays
+    QSignalSpy dataChanged(&model, &FolderListModel::dataChanged);
+    QMailFolder folder(m_folder3.id());
+    folder.setServerCount(5);
+    QVERIFY(QMailStore::instance()->updateFolder(&folder));
+    QTRY_COMPARE(dataChanged.count(), 1);
+    QCOMPARE(dataChanged.first().at(0).toModelIndex().row(), row);
+    QCOMPARE(dataChanged.first().at(1).toModelIndex().row(), row);
+    QVERIFY(dataChanged.first().at(2).value<QVector<int> >().contains(FolderListModel::FolderServerCount));
+    QCOMPARE(model.data(model.index(row, 0), FolderListModel::FolderServerCount).toInt(), 5);
+
+    folder.setServerCount(0);
+    QVERIFY(QMailStore::instance()->updateFolder(&folder));
+    QTRY_COMPARE(dataChanged.count(), 2);
+}
+
+void tst_FolderListModel::syncFolderList()
+{
+    FolderListFilterTypeModel model;
+    model.setAccountKey(m_account.id().toULongLong());
+
+    QSignalSpy changed(&model, &FolderListFilterTypeModel::syncFolderListChanged);
+    const QString name = QMailFolder(m_folder3.id()).displayName();
+    QVERIFY(!model.syncFolderList().contains(name));
+
+    // Enabling sync lists the folder under its name
+    QVERIFY(model.setSyncEnabled(QVariantList() << m_folder3.id().toULongLong(), true));
+    QCOMPARE(changed.count(), 1);
+    QVERIFY(model.syncFolderList().contains(name));
+
+    // Rename arriving together with the model's own sync update is not lost
+    QVERIFY(model.setSyncEnabled(QVariantList() << m_folder3.id().toULongLong(), false));
+    QVERIFY(model.setSyncEnabled(QVariantList() << m_folder3.id().toULongLong(), true));
+    QMailFolder folder(m_folder3.id());
+    folder.setDisplayName("RenamedFolder3");
+    QVERIFY(QMailStore::instance()->updateFolder(&folder));
+    QTRY_VERIFY(model.syncFolderList().contains(QStringLiteral("RenamedFolder3")));
+    QVERIFY(!model.syncFolderList().contains(name));
+
+    QVERIFY(model.setSyncEnabled(QVariantList() << m_folder3.id().toULongLong(), false));
+    QVERIFY(!model.syncFolderList().contains(QStringLiteral("RenamedFolder3")));
+    folder = QMailFolder(m_folder3.id());
+    folder.setDisplayName(name);
+    QVERIFY(QMailStore::instance()->updateFolder(&folder));
+}
+
+void tst_FolderListModel::nameFilter()
+{
+    FolderListFilterTypeModel model;
+    model.setAccountKey(m_account.id().toULongLong());
+    const int folders = model.count();
+
+    // Matching folders come with their ancestors
+    model.setNameFilter(QStringLiteral("TestFolder2_2"));
+    QCOMPARE(model.count(), 3);
+    model.setNameFilter(QStringLiteral("testfolder2"));
+    QCOMPARE(model.count(), 4);
+    model.setNameMatch(FolderListFilterTypeModel::SubstringMatch);
+    model.setNameFilter(QStringLiteral("older2_2"));
+    QCOMPARE(model.count(), 3);
+
+    // Renamed folder is matched under its new name
+    const QString name = QMailFolder(m_folder3.id()).displayName();
+    QMailFolder folder(m_folder3.id());
+    folder.setDisplayName("TestFolder2_2_9");
+    QVERIFY(QMailStore::instance()->updateFolder(&folder));
+    QTRY_COMPARE(model.count(), 4);
+
+    folder.setDisplayName(name);
+    QVERIFY(QMailStore::instance()->updateFolder(&folder));
+    QTRY_COMPARE(model.count(), 3);
+
+    model.setNameFilter(QString());
+    QCOMPARE(model.count(), folders);
+}
+
 #include "tst_folderlistmodel.moc"
 QTEST_MAIN(tst_FolderListModel)
@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) 2020 Open Mobile Platform LLC.
+ *
+ * This program is licensed under the terms and conditions of the
+ * Apache License, version 2.0.  The full text of the Apache License is at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include <QObject>
+#include <QTest>
+#include <QSignalSpy>
+#include <qmailstore.h>
+
+#include "folderlistmodel.h"
+#include "foldertreemodel.h"
+/*
+    Unit test for FolderTreeModel class.
+*/
+class tst_FolderTreeModel : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void cleanupTestCase();
+
+    void fetchMore();
+    void unreadCount();
+    void folderUpdated();
+    void unloadedChildren();
+    void collapse();
+
+private:
+    QModelIndex folderIndex(const FolderTreeModel &model, const QMailFolderId &id,
+                            const QModelIndex &parent = QModelIndex()) const;
+
+    QMailAccount m_account;
+
+    QMailFolder m_folder1;
+    QMailFolder m_folder2;
+    QMailFolder m_folder2_1;
+    QMailFolder m_folder2_2;
+    QMailFolder m_folder2_2_1;
+};
+
+void tst_FolderTreeModel::initTestCase()
+{
+    QMailAccountConfiguration config1;
+    m_account.setName("Account 1");
+    QVERIFY(QMailStore::instance()->addAccount(&m_account, &config1));
+
+    //root folder
+    m_folder1 = QMailFolder("TestFolder1", QMailFolderId(), m_account.id());
+    QVERIFY(QMailStore::instance()->addFolder(&m_folder1));
+    QVERIFY(m_folder1.id().isValid());
+
+    //root folder
+    m_folder2 = QMailFolder("TestFolder2", QMailFolderId(), m_account.id());
+    QVERIFY(QMailStore::instance()->addFolder(&m_folder2));
+    QVERIFY(m_folder2.id().isValid());
+
+    //folder with valid parent
+    m_folder2_1 = QMailFolder("TestFolder2_1", m_folder2.id(), m_account.id());
+    QVERIFY(QMailStore::instance()->addFolder(&m_folder2_1));
+    QVERIFY(m_folder2_1.id().isValid());
+
+    //folder with valid parent
+    m_folder2_2 = QMailFolder("TestFolder2_2", m_folder2.id(), m_account.id());
+    QVERIFY(QMailStore::instance()->addFolder(&m_folder2_2));
+    QVERIFY(m_folder2_2.id().isValid());
+
+    //folder with valid parent
+    m_folder2_2_1 = QMailFolder("TestFolder2_2_1", m_folder2_2.id(), m_account.id());
+    QVERIFY(QMailStore::instance()->addFolder(&m_folder2_2_1));
+    QVERIFY(m_folder2_2_1.id().isValid());
+}
+
+void tst_FolderTreeModel::cleanupTestCase()
+{
+    //Removes also all folders associated with the account
+    QMailStore::instance()->removeAccount(m_account.id());
+}
+
+QModelIndex tst_FolderTreeModel::folderIndex(const FolderTreeModel &model, const QMailFolderId &id,
+                                             const QModelIndex &parent) const
+{
+    for (int row = 0; row < model.rowCount(parent); ++row) {
+        const QModelIndex index = model.index(row, 0, parent);
+        if (index.data(FolderListModel::FolderId).toULongLong() == id.toULongLong())
+            return index;
+    }
+    return QModelIndex();
+}
+
+void tst_FolderTreeModel::fetchMore()
+{
+    FolderTreeModel model;
+    model.setAccountKey(m_account.id().toULongLong());
+
+    // Only top level folders initially, sorted by name
+    QCOMPARE(model.rowCount(), 2);
+    const QModelIndex folder1 = model.index(0, 0);
+    const QModelIndex folder2 = model.index(1, 0);
+    QCOMPARE(folder1.data(FolderListModel::FolderId).toULongLong(), m_folder1.id().toULongLong());
+    QCOMPARE(folder2.data(FolderListModel::FolderId).toULongLong(), m_folder2.id().toULongLong());
+    QVERIFY(!model.hasChildren(folder1));
+    QVERIFY(!model.canFetchMore(folder1));
+    QVERIFY(model.hasChildren(folder2));
+    QVERIFY(model.canFetchMore(folder2));
+    QCOMPARE(model.rowCount(folder2), 0);
+
+    QSignalSpy inserted(&model, &FolderTreeModel::rowsInserted);
+    model.fetchMore(folder2);
+    QCOMPARE(inserted.count(), 1);
+    QCOMPARE(model.rowCount(folder2), 2);
+    QVERIFY(!model.canFetchMore(folder2));
+
+    const QModelIndex folder2_1 = folderIndex(model, m_folder2_1.id(), folder2);
+    const QModelIndex folder2_2 = folderIndex(model, m_folder2_2.id(), folder2);
+    QVERIFY(folder2_1.isValid());
+    QVERIFY(folder2_2.isValid());
+    QCOMPARE(model.parent(folder2_2), folder2);
+    QCOMPARE(folder2_2.data(FolderListModel::FolderNestingLevel).toInt(), 1);
+    QCOMPARE(folder2_2.data(FolderListModel::FolderParentId).toULongLong(), m_folder2.id().toULongLong());
+    QCOMPARE(folder2_2.data(FolderListModel::FolderName).toString(), QStringLiteral("TestFolder2_2"));
+    QVERIFY(!model.hasChildren(folder2_1));
+    QVERIFY(model.hasChildren(folder2_2));
+}
+
+void tst_FolderTreeModel::unreadCount()
+{
+    QMailMessage message;
+    message.setMessageType(QMailMessage::Email);
+    message.setParentAccountId(m_account.id());
+    message.setParentFolderId(m_folder2_1.id());
+    message.setSubject("unreadMessage");
+    message.setStatus(QMailMessage::Incoming, true);
+    message.setStatus(QMailMessage::Read, false);
+    message.setServerUid("unreadMessage");
+    QVERIFY(QMailStore::instance()->addMessage(&message));
+
+    FolderTreeModel model;
+    model.setAccountKey(m_account.id().toULongLong());
+    const QModelIndex folder2 = folderIndex(model, m_folder2.id());
+    model.fetchMore(folder2);
+
+    // Counted when the parent gets expanded
+    const QModelIndex folder2_1 = folderIndex(model, m_folder2_1.id(), folder2);
+    const QModelIndex folder2_2 = folderIndex(model, m_folder2_2.id(), folder2);
+    QCOMPARE(folder2_1.data(FolderListModel::FolderUnreadCount).toInt(), 1);
+    QCOMPARE(folder2_2.data(FolderListModel::FolderUnreadCount).toInt(), 0);
+
+    QVERIFY(QMailStore::instance()->updateMessagesMetaData(QMailMessageKey::id(message.id()),
+                                                           QMailMessage::Read, true));
+    QTRY_COMPARE(folder2_1.data(FolderListModel::FolderUnreadCount).toInt(), 0);
+
+    QVERIFY(QMailStore::instance()->removeMessage(message.id()));
+}
+
+void tst_FolderTreeModel::folderUpdated()
+{
+    FolderTreeModel model;
+    model.setAccountKey(m_account.id().toULongLong());
+    const QModelIndex folder1 = folderIndex(model, m_folder1.id());
+    QVERIFY(!folder1.data(FolderListModel::FolderSyncEnabled).toBool());
+
+    QSignalSpy dataChanged(&model, &FolderTreeModel::dataChanged);
+    QMailFolder folder(m_folder1.id());
+    folder.setStatus(QMailFolder::SynchronizationEnabled, true);
+    folder.setServerCount(5);
+    QVERIFY(QMailStore::instance()->updateFolder(&folder));
+
+    // Cached roles follow the stored folder
+    QTRY_VERIFY(dataChanged.count() > 0);
+    QVERIFY(folder1.data(FolderListModel::FolderSyncEnabled).toBool());
+    QCOMPARE(folder1.data(FolderListModel::FolderServerCount).toInt(), 5);
+
+    folder.setStatus(QMailFolder::SynchronizationEnabled, false);
+    folder.setServerCount(0);
+    QVERIFY(QMailStore::instance()->updateFolder(&folder));
+    QTRY_VERIFY(!folder1.data(FolderListModel::FolderSyncEnabled).toBool());
+}
+
+void tst_FolderTreeModel::unloadedChildren()
+{
+    FolderTreeModel model;
+    model.setAccountKey(m_account.id().toULongLong());
+    const QModelIndex folder1 = folderIndex(model, m_folder1.id());
+    const QModelIndex folder2 = folderIndex(model, m_folder2.id());
+    QVERIFY(!model.hasChildren(folder1));
+
+    // Added under a folder not expanded
+    QMailFolder child("TestFolder1_1", m_folder1.id(), m_account.id());
+    QVERIFY(QMailStore::instance()->addFolder(&child));
+    QTRY_VERIFY(model.hasChildren(folder1));
+    QVERIFY(model.canFetchMore(folder1));
+
+    // Moved away from it
+    child.setParentFolderId(m_folder2.id());
+    QVERIFY(QMailStore::instance()->updateFolder(&child));
+    QTRY_VERIFY(!model.hasChildren(folder1));
+    QVERIFY(!model.canFetchMore(folder1));
+
+    model.fetchMore(folder2);
+    QCOMPARE(model.rowCount(folder2), 3);
+
+    // Removed before the folder gets expanded
+    child.setParentFolderId(m_folder1.id());
+    QVERIFY(QMailStore::instance()->updateFolder(&child));
+    QTRY_VERIFY(model.hasChildren(folder1));
+    QTRY_COMPARE(model.rowCount(folder2), 2);
+    QVERIFY(QMailStore::instance()->removeFolder(child.id()));
+    QTRY_VERIFY(!model.hasChildren(folder1));
+
+    // Nothing to insert, the expanded folder stays valid
+    QSignalSpy inserted(&model, &FolderTreeModel::rowsInserted);
+    model.fetchMore(folder1);
+    QCOMPARE(inserted.count(), 0);
+    QCOMPARE(model.rowCount(folder1), 0);
+    QVERIFY(!model.canFetchMore(folder1));
+}
+
+void tst_FolderTreeModel::collapse()
+{
+    FolderTreeModel model;
+    model.setAccountKey(m_account.id().toULongLong());
+    const QModelIndex folder2 = folderIndex(model, m_folder2.id());
+    model.fetchMore(folder2);
+    QCOMPARE(model.rowCount(folder2), 2);
+
+    QSignalSpy removed(&model, &FolderTreeModel::rowsRemoved);
+    model.collapse(folder2);
+    QCOMPARE(removed.count(), 1);
+    QCOMPARE(model.rowCount(folder2), 0);
+    QVERIFY(model.hasChildren(folder2));
+    QVERIFY(model.canFetchMore(folder2));
+
+    // Released children are still followed
+    QSignalSpy dataChanged(&model, &FolderTreeModel::dataChanged);
+    QVERIFY(QMailStore::instance()->removeFolder(m_folder2_1.id()));
+    QTRY_COMPARE(dataChanged.count(), 1);
+    QCOMPARE(dataChanged.first().at(0).toModelIndex(), folder2);
+    QVERIFY(model.hasChildren(folder2));
+    model.fetchMore(folder2);
+    QCOMPARE(model.rowCount(folder2), 1);
+
+    m_folder2_1 = QMailFolder("TestFolder2_1", m_folder2.id(), m_account.id());
+    QVERIFY(QMailStore::instance()->addFolder(&m_folder2_1));
+    QTRY_COMPARE(model.rowCount(folder2), 2);
+}
+
+#include "tst_foldertreemodel.moc"
+QTEST_MAIN(tst_FolderTreeModel)
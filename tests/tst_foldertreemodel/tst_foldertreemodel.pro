@@ -0,0 +1,4 @@
+include(../common.pri)
+TARGET = tst_foldertreemodel
+
+SOURCES += tst_foldertreemodel.cpp